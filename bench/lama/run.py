@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+"""Runs the Lama benchmark suite and reports the measurements as JSON.
+
+Each benchmark is run under the source interpreter (-i), the stack machine
+interpreter (-s) and as a native executable, a warm-up run followed by a
+number of measured runs. For each benchmark and mode the report contains
+the wall times of the measured runs with their mean, minimum and variance,
+the peak resident set size and, for native runs, the number of garbage
+collections (taken from the runtime with LAMA_GC_STATS).
+
+Bytecode is not measured: byterun only disassembles bytecode files.
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE   = os.path.dirname(os.path.abspath(__file__))
+ROOT   = os.path.normpath(os.path.join(HERE, "..", ".."))
+MODES  = ["i", "s", "native"]
+
+
+def benchmarks(names):
+    found = sorted(f[:-len(".lama")] for f in os.listdir(HERE) if f.endswith(".lama"))
+    return [b for b in found if not names or b in names]
+
+
+def run(cmd, stdin, env):
+    """Runs a command, returns its wall time (s) and peak RSS (KiB)."""
+    with open(stdin or os.devnull) as inp, tempfile.TemporaryFile() as errf:
+        start = time.perf_counter()
+        proc  = subprocess.Popen(cmd, cwd=HERE, env=env, stdin=inp,
+                                 stdout=subprocess.DEVNULL, stderr=errf)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall  = time.perf_counter() - start
+        errf.seek(0)
+        err   = errf.read().decode(errors="replace")
+    if os.waitstatus_to_exitcode(status) != 0:
+        raise RuntimeError("%s failed: %s" % (" ".join(cmd), err.strip()))
+    return wall, usage.ru_maxrss
+
+
+def gc_stats(path):
+    stats = {}
+    try:
+        with open(path) as f:
+            for line in f:
+                key, value = line.split()
+                stats[key] = int(value)
+    except OSError:
+        pass
+    return stats
+
+
+def measure(args, bench, mode):
+    src   = bench + ".lama"
+    stdin = os.path.join(HERE, bench + ".input")
+    stdin = stdin if os.path.exists(stdin) else None
+    env   = dict(os.environ, LAMA=os.path.join(ROOT, "runtime"))
+    flags = ["-I", os.path.join(ROOT, "stdlib")] + (["-O"] if args.optimize else [])
+
+    if mode == "native":
+        subprocess.run([args.lamac] + flags + [src], cwd=HERE, env=env, check=True)
+        cmd = ["./" + bench]
+    else:
+        cmd = [args.lamac] + flags + ["-" + mode, src]
+
+    times, rss, gcs = [], 0, []
+    with tempfile.TemporaryDirectory() as tmp:
+        env["LAMA_GC_STATS"] = os.path.join(tmp, "gc")
+        for i in range(args.warmup + args.repeat):
+            wall, peak = run(cmd, stdin, env)
+            if i < args.warmup:
+                continue
+            times.append(wall)
+            rss = max(rss, peak)
+            if mode == "native":
+                gcs.append(gc_stats(env["LAMA_GC_STATS"]).get("collections"))
+
+    return {
+        "benchmark": bench,
+        "mode":      mode,
+        "runs":      len(times),
+        "times":     times,
+        "mean":      statistics.mean(times),
+        "min":       min(times),
+        "variance":  statistics.variance(times) if len(times) > 1 else 0.0,
+        "peak_rss_kib": rss,
+        "gc_collections": gcs[-1] if gcs else None,
+    }
+
+
+def revision():
+    try:
+        return subprocess.run(["git", "rev-parse", "HEAD"], cwd=ROOT, check=True,
+                              capture_output=True, text=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("benchmarks", nargs="*", help="benchmarks to run (all by default)")
+    parser.add_argument("--lamac", default=os.path.join(ROOT, "src", "lamac"), help="the compiler")
+    parser.add_argument("--modes", default=",".join(MODES), help="comma-separated modes: i, s, native")
+    parser.add_argument("--repeat", type=int, default=5, help="measured runs per benchmark and mode")
+    parser.add_argument("--warmup", type=int, default=1, help="unmeasured runs before the measured ones")
+    parser.add_argument("-O", dest="optimize", action="store_true", help="compile with -O")
+    parser.add_argument("-o", dest="output", help="write the report to a file instead of stdout")
+    args = parser.parse_args()
+
+    modes = [m for m in args.modes.split(",") if m]
+    for m in modes:
+        if m not in MODES:
+            parser.error("unknown mode %s" % m)
+
+    results = []
+    for bench in benchmarks(args.benchmarks):
+        for mode in modes:
+            print("%s (%s)..." % (bench, mode), file=sys.stderr)
+            results.append(measure(args, bench, mode))
+
+    report = {
+        "date":     datetime.datetime.now(datetime.timezone.utc).isoformat(),
+        "revision": revision(),
+        "host":     platform.node(),
+        "machine":  platform.machine(),
+        "optimize": args.optimize,
+        "repeat":   args.repeat,
+        "warmup":   args.warmup,
+        "results":  results,
+    }
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    json.dump(report, out, indent=2)
+    out.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -6,9 +6,6 @@
 # include <malloc.h>
 # include "../runtime/runtime.h"
 
-void *__start_custom_data;
-void *__stop_custom_data;
-
 /* The unpacked representation of bytecode file */
 typedef struct {
   char *string_ptr;              /* A pointer to the beginning of the string table */
@@ -231,6 +228,15 @@ void disassemble (FILE *f, bytefile *bf) {
         fprintf (f, "LINE\t%d", INT);
         break;
 
+      case 11:
+        fprintf (f, "TCALLC\t%d", INT);
+        break;
+
+      case 12:
+        fprintf (f, "TCALL\t0x%.8x ", INT);
+        fprintf (f, "%d", INT);
+        break;
+
       default:
         FAIL;
       }
@@ -278,6 +284,173 @@ void disassemble (FILE *f, bytefile *bf) {
  stop: fprintf (f, "<end>\n");
 }
 
+/* Profiling.
+
+   The profile counts the occurrences of opcodes and of pairs of adjacent
+   opcodes in the bytecode, and for each function (a BEGIN or CBEGIN) the
+   number of its instructions, the first source line and the number of
+   call sites and closures referring to it. Function offsets are mapped back
+   to public names when there are ones.
+*/
+
+# define MAX_FUNCTIONS 4096
+
+typedef struct {
+  int offset;   /* the offset of BEGIN          */
+  int line;     /* the first line of the body   */
+  int insns;    /* the number of instructions   */
+  int calls;    /* the number of call sites     */
+  int closures; /* the number of closures       */
+} function_profile;
+
+/* Gets a printable name of an opcode */
+char* opcode_name (unsigned char x) {
+  static char *ops  [] = {"BINOP +", "BINOP -", "BINOP *", "BINOP /", "BINOP %", "BINOP <", "BINOP <=",
+                          "BINOP >", "BINOP >=", "BINOP ==", "BINOP !=", "BINOP &&", "BINOP !!"};
+  static char *ones [] = {"CONST", "STRING", "SEXP", "STI", "STA", "JMP", "END", "RET", "DROP", "DUP", "SWAP", "ELEM"};
+  static char *lds  [] = {"LD G", "LD L", "LD A", "LD C", "LDA G", "LDA L", "LDA A", "LDA C", "ST G", "ST L", "ST A", "ST C"};
+  static char *fives[] = {"CJMPz", "CJMPnz", "BEGIN", "CBEGIN", "CLOSURE", "CALLC", "CALL", "TAG", "ARRAY", "FAIL", "LINE", "TCALLC", "TCALL"};
+  static char *pats [] = {"PATT =str", "PATT #string", "PATT #array", "PATT #sexp", "PATT #ref", "PATT #val", "PATT #fun"};
+  static char *calls[] = {"CALL Lread", "CALL Lwrite", "CALL Llength", "CALL Lstring", "CALL Barray"};
+  int h = (x & 0xF0) >> 4, l = x & 0x0F;
+
+  switch (h) {
+  case 0:  if (l >= 1 && l <= 13) return ops[l-1]; break;
+  case 1:  if (l <= 11) return ones[l]; break;
+  case 2:
+  case 3:
+  case 4:  if (l <= 3) return lds[(h-2)*4 + l]; break;
+  case 5:  if (l <= 12) return fives[l]; break;
+  case 6:  if (l <= 6) return pats[l]; break;
+  case 7:  if (l <= 4) return calls[l]; break;
+  }
+
+  return "<invalid>";
+}
+
+/* Gets the number of operand bytes of an instruction */
+int operands_size (char *ip) {
+  unsigned char x = *ip;
+  int h = (x & 0xF0) >> 4, l = x & 0x0F;
+
+  switch (h) {
+  case 1:
+    switch (l) {
+    case 0: case 1: case 5: return sizeof (int);
+    case 2:                 return 2 * sizeof (int);
+    default:                return 0;
+    }
+
+  case 2:
+  case 3:
+  case 4:
+    return sizeof (int);
+
+  case 5:
+    switch (l) {
+    case 2: case 3: case 6: case 7: case 9: case 12:
+      return 2 * sizeof (int);
+
+    case 4: {
+      int n = *(int*)(ip + 1 + sizeof (int));
+      return 2 * sizeof (int) + n * (1 + sizeof (int));
+    }
+
+    default:
+      return sizeof (int);
+    }
+
+  case 7:
+    return l == 4 ? sizeof (int) : 0;
+
+  default:
+    return 0;
+  }
+}
+
+/* Gets the name of the public symbol at an offset, or NULL */
+char* public_name_at (bytefile *bf, int offset) {
+  for (int i = 0; i < bf->public_symbols_number; i++)
+    if (get_public_offset (bf, i) == offset) return get_public_name (bf, i);
+
+  return NULL;
+}
+
+static function_profile *find_function (function_profile *fs, int n, int offset) {
+  for (int i = 0; i < n; i++)
+    if (fs[i].offset == offset) return &fs[i];
+
+  return NULL;
+}
+
+static int compare_counts (const void *a, const void *b) {
+  return ((int*) b)[1] - ((int*) a)[1];
+}
+
+/* Prints the profile of the bytecode */
+void profile (FILE *f, bytefile *bf) {
+  static int       counts [256], pairs [256*256][2], singles [256][2];
+  function_profile fs [MAX_FUNCTIONS], *fn = NULL;
+  int              nfs = 0, prev = -1, npairs = 0;
+  char            *ip;
+
+  memset (counts, 0, sizeof (counts));
+  memset (pairs,  0, sizeof (pairs));
+
+  /* the functions are found first, as calls can refer forward */
+  for (ip = bf->code_ptr; (*ip & 0xF0) != 0xF0; ip += 1 + operands_size (ip))
+    if ((*ip == 0x52 || *ip == 0x53) && nfs < MAX_FUNCTIONS)
+      fs[nfs++] = (function_profile) {ip - bf->code_ptr, 0, 0, 0, 0};
+
+  for (ip = bf->code_ptr; (*ip & 0xF0) != 0xF0; ip += 1 + operands_size (ip)) {
+    unsigned char x = *ip;
+
+    if (x == 0x52 || x == 0x53) {
+      fn   = find_function (fs, nfs, ip - bf->code_ptr);
+      prev = -1;
+    }
+
+    counts[x]++;
+    if (prev >= 0) pairs[prev * 256 + x][1]++;
+    prev = x;
+
+    if (fn != NULL) {
+      fn->insns++;
+      if (x == 0x5a && fn->line == 0) fn->line = *(int*)(ip + 1);
+    }
+
+    if (x == 0x56 || x == 0x5c || x == 0x54) {
+      function_profile *g = find_function (fs, nfs, *(int*)(ip + 1));
+      if (g != NULL) {
+        if (x == 0x54) g->closures++; else g->calls++;
+      }
+    }
+  }
+
+  for (int i = 0; i < 256; i++) singles[i][0] = i, singles[i][1] = counts[i];
+  qsort (singles, 256, sizeof (singles[0]), compare_counts);
+
+  fprintf (f, "Opcodes:\n");
+  for (int i = 0; i < 256 && singles[i][1] > 0; i++)
+    fprintf (f, "   %8d  %s\n", singles[i][1], opcode_name (singles[i][0]));
+
+  for (int i = 0; i < 256*256; i++)
+    if (pairs[i][1] > 0) pairs[npairs][0] = i, pairs[npairs++][1] = pairs[i][1];
+  qsort (pairs, npairs, sizeof (pairs[0]), compare_counts);
+
+  fprintf (f, "Opcode pairs:\n");
+  for (int i = 0; i < npairs && i < 32; i++)
+    fprintf (f, "   %8d  %s; %s\n", pairs[i][1], opcode_name (pairs[i][0] >> 8), opcode_name (pairs[i][0] & 0xFF));
+
+  fprintf (f, "Functions:\n");
+  fprintf (f, "   %-10s  %8s  %6s  %6s  %8s  %s\n", "offset", "insns", "line", "calls", "closures", "name");
+  for (int i = 0; i < nfs; i++) {
+    char *name = public_name_at (bf, fs[i].offset);
+    fprintf (f, "   0x%.8x  %8d  %6d  %6d  %8d  %s\n",
+             fs[i].offset, fs[i].insns, fs[i].line, fs[i].calls, fs[i].closures, name == NULL ? "" : name);
+  }
+}
+
 /* Dumps the contents of the file */
 void dump_file (FILE *f, bytefile *bf) {
   int i;
@@ -295,6 +468,11 @@ void dump_file (FILE *f, bytefile *bf) {
 }
 
 int main (int argc, char* argv[]) {
+  if (argc > 2 && strcmp (argv[1], "-p") == 0) {
+    profile (stdout, read_file (argv[2]));
+    return 0;
+  }
+
   bytefile *f = read_file (argv[1]);
   dump_file (stdout, f);
   return 0;
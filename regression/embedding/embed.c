@@ -0,0 +1,63 @@
+/* Embedding test: runs the unit Embed in two runtime instances on two
+   threads at once. Each instance has to see its own global variables of
+   the unit, including the flag of its initialization */
+
+# include "runtime.h"
+
+# define BOX(x)   ((((word) (x)) << 1) | 1)
+# define UNBOX(x) (((word) (x)) >> 1)
+
+extern void* initEmbed    ();
+extern void* Linitialized ();
+extern void* LsetOffset   ();
+extern void* Lpush        ();
+extern void* LparSum      ();
+
+typedef struct {
+  word offset;
+  word initialized, push, par_sum;
+} result;
+
+static void* run (void *arg) {
+  result        *r    = (result*) arg;
+  lama_instance *inst = lama_create (65536);
+  void          *args [1];
+
+  if (inst == NULL) failure ("embed: can not create an instance\n");
+
+  /* the second initialization is skipped */
+  lama_run (inst, initEmbed, 0, NULL);
+  lama_run (inst, initEmbed, 0, NULL);
+
+  args[0] = (void*) BOX(r->offset);
+  lama_run (inst, LsetOffset, 1, args);
+
+  for (int i = 0; i < 100; i++) {
+    args[0] = (void*) BOX(100);
+    r->push = UNBOX(lama_run (inst, Lpush, 1, args));
+  }
+
+  args[0]        = (void*) BOX(1000);
+  r->par_sum     = UNBOX(lama_run (inst, LparSum, 1, args));
+  r->initialized = UNBOX(lama_run (inst, Linitialized, 0, NULL));
+
+  lama_destroy (inst);
+  
+  return NULL;
+}
+
+int main () {
+  pthread_t threads [2];
+  result    results [2] = {{.offset = 1000}, {.offset = 2000}};
+
+  for (int i = 0; i < 2; i++)
+    if (pthread_create (&threads[i], NULL, run, &results[i])) failure ("embed: can not create a thread\n");
+
+  for (int i = 0; i < 2; i++) {
+    pthread_join (threads[i], NULL);
+    printf ("instance %d: initialized %ld, push %ld, parSum %ld\n", i,
+            (long) results[i].initialized, (long) results[i].push, (long) results[i].par_sum);
+  }
+
+  return 0;
+}
@@ -13,6 +13,8 @@ F,snd;
 F,hd;
 F,tl;
 F,readLine;
+F,freadLine;
+F,readInts;
 F,stringcat;
 F,matchSubString;
 F,substring;
@@ -26,9 +28,16 @@ F,fopen;
 F,fclose;
 F,fread;
 F,fwrite;
+F,freadChunk;
+F,fwriteChunk;
+F,fseek;
+F,ftell;
+F,fmap;
+F,funmap;
 F,failure;
 F,read;
 F,write;
+F,flush;
 F,compare;
 F,i__Infix_4343;
 F,s__Infix_58;
@@ -50,9 +59,35 @@ F,enableGC;
 F,disableGC;
 F,random;
 F,time;
+F,clock;
+F,allocated;
+F,collections;
+F,longAdd;
+F,longSub;
+F,longDiv;
+F,measure;
+F,spawn;
+F,yield;
+F,join;
+F,detach;
 F,kindOf;
 F,compareTags;
 F,flatCompare;
 F,tagHash;
+F,collFind;
+F,collAdd;
+F,collRemove;
+F,collUnion;
+F,collDiff;
+F,sortArray;
+F,parSortArray;
+F,parMapArray;
+F,parInitArray;
+F,parReduce;
+F,sortList;
+F,matcherInit;
+F,matcherShift;
+F,matcherLine;
+F,matcherCol;
 F,uppercase;
 F,lowercase;
@@ -0,0 +1,295 @@
+/* Microbenchmarks for the runtime primitives.
+
+   Usage: bench [-r repetitions] [-n operations] [-s size] [benchmark ...]
+
+   Each benchmark performs a number of operations a number of times and
+   prints the best and the median time per operation in nanoseconds and in
+   cycles. The size is the number of fields of s-expressions, arrays and
+   closures (at most 8), the depth of compared, hashed and stringified
+   trees (at most 15, as the builder keeps two extra roots per level) and
+   the length of concatenated strings. The "gc" benchmark
+   measures collection pauses for a series of live trees of growing size;
+   its garbage are arrays of the given size.
+*/
+
+# include "../runtime.h"
+# include <x86intrin.h>
+
+# define BOX(x) ((((word) (x)) << 1) | 0x0001)
+
+# define MAX_FIELDS      8
+# define MAX_REPETITIONS 1000
+
+extern void   __gc_init       (void);
+extern void   __pre_gc        (void);
+extern void   __post_gc       (void);
+extern void*  alloc           (size_t);
+extern void*  Bsexp           (word, ...);
+extern void*  Barray          (word, ...);
+extern void*  Bclosure        (word, void*, ...);
+extern void*  Bstring         (void*);
+extern word   Lcompare        (void*, void*);
+extern word   Lhash           (void*);
+extern word   LtagHash        (char*);
+extern void*  Lstring         (void*);
+extern void*  Li__Infix_4343  (void*, void*);
+extern word   Lcollections    (void);
+extern void   push_extra_root (void**);
+extern void   pop_extra_root  (void**);
+extern __thread size_t __gc_stack_bottom;
+
+typedef struct {
+  char *name;
+  void (*setup) (int);
+  void (*run)   (int);
+} benchmark;
+
+static int   size        = 4;
+static int   operations  = 100000;
+static int   repetitions = 10;
+static word  node_tag;
+
+/* The operands, kept alive across operations: the section is scanned by the
+   GC just as the one with the globals of Lama programs */
+static void *roots [2] __attribute__((section ("custom_data"), used));
+
+static void entry (void) {}
+
+/* Variadic constructors with a number of fields known at run time */
+# define F BOX(1)
+
+static void* make_sexp (int n) {
+  switch (n) {
+  case 0:  return Bsexp (BOX(1), node_tag);
+  case 1:  return Bsexp (BOX(2), F, node_tag);
+  case 2:  return Bsexp (BOX(3), F, F, node_tag);
+  case 3:  return Bsexp (BOX(4), F, F, F, node_tag);
+  case 4:  return Bsexp (BOX(5), F, F, F, F, node_tag);
+  case 5:  return Bsexp (BOX(6), F, F, F, F, F, node_tag);
+  case 6:  return Bsexp (BOX(7), F, F, F, F, F, F, node_tag);
+  case 7:  return Bsexp (BOX(8), F, F, F, F, F, F, F, node_tag);
+  default: return Bsexp (BOX(9), F, F, F, F, F, F, F, F, node_tag);
+  }
+}
+
+static void* make_array (int n) {
+  switch (n) {
+  case 0:  return Barray (BOX(0));
+  case 1:  return Barray (BOX(1), F);
+  case 2:  return Barray (BOX(2), F, F);
+  case 3:  return Barray (BOX(3), F, F, F);
+  case 4:  return Barray (BOX(4), F, F, F, F);
+  case 5:  return Barray (BOX(5), F, F, F, F, F);
+  case 6:  return Barray (BOX(6), F, F, F, F, F, F);
+  case 7:  return Barray (BOX(7), F, F, F, F, F, F, F);
+  default: return Barray (BOX(8), F, F, F, F, F, F, F, F);
+  }
+}
+
+static void* make_closure (int n) {
+  switch (n) {
+  case 0:  return Bclosure (BOX(0), entry);
+  case 1:  return Bclosure (BOX(1), entry, F);
+  case 2:  return Bclosure (BOX(2), entry, F, F);
+  case 3:  return Bclosure (BOX(3), entry, F, F, F);
+  case 4:  return Bclosure (BOX(4), entry, F, F, F, F);
+  case 5:  return Bclosure (BOX(5), entry, F, F, F, F, F);
+  case 6:  return Bclosure (BOX(6), entry, F, F, F, F, F, F);
+  case 7:  return Bclosure (BOX(7), entry, F, F, F, F, F, F, F);
+  default: return Bclosure (BOX(8), entry, F, F, F, F, F, F, F, F);
+  }
+}
+
+/* A complete binary tree of s-expressions of a given depth */
+static void* make_tree (int depth) {
+  void *l, *r, *t;
+
+  if (depth == 0) return (void*) BOX(depth);
+
+  l = make_tree (depth - 1);
+  push_extra_root (&l);
+  r = make_tree (depth - 1);
+  push_extra_root (&r);
+  t = Bsexp (BOX(3), l, r, node_tag);
+  pop_extra_root (&r);
+  pop_extra_root (&l);
+
+  return t;
+}
+
+static void* make_string (int n) {
+  char buf [n + 1];
+
+  memset (buf, 'a', n);
+  buf[n] = 0;
+
+  return Bstring (buf);
+}
+
+static void setup_trees (int depth) {
+  if (depth > 15) depth = 15;
+  roots[0] = make_tree (depth);
+  roots[1] = make_tree (depth);
+}
+
+static void setup_strings (int length) {
+  roots[0] = make_string (length);
+  roots[1] = make_string (length);
+}
+
+/* __post_gc has to be called from the same frame as __pre_gc, which is why
+   the driver is compiled without sibling call optimization */
+static void run_alloc (int n) {
+  __pre_gc ();
+
+  for (int i = 0; i < n; i++) {
+    word *p = alloc (sizeof (word) * (size + 1));
+    p[0] = 3 | (size << 3);  /* an array header */
+    for (int j = 1; j <= size; j++) p[j] = F;
+  }
+
+  __post_gc ();
+}
+
+static void run_sexp    (int n) { for (int i = 0; i < n; i++) make_sexp (size); }
+static void run_array   (int n) { for (int i = 0; i < n; i++) make_array (size); }
+static void run_closure (int n) { for (int i = 0; i < n; i++) make_closure (size); }
+static void run_compare (int n) { for (int i = 0; i < n; i++) Lcompare (roots[0], roots[1]); }
+static void run_hash    (int n) { for (int i = 0; i < n; i++) Lhash (roots[0]); }
+static void run_concat  (int n) { for (int i = 0; i < n; i++) Li__Infix_4343 (roots[0], roots[1]); }
+static void run_string  (int n) { for (int i = 0; i < n; i++) Lstring (roots[0]); }
+static void run_tag     (int n) { for (int i = 0; i < n; i++) LtagHash ("Node"); }
+
+static benchmark benchmarks [] = {
+  {"alloc",    NULL,          run_alloc},
+  {"Bsexp",    NULL,          run_sexp},
+  {"Barray",   NULL,          run_array},
+  {"Bclosure", NULL,          run_closure},
+  {"Lcompare", setup_trees,   run_compare},
+  {"Lhash",    setup_trees,   run_hash},
+  {"++",       setup_strings, run_concat},
+  {"Lstring",  setup_trees,   run_string},
+  {"LtagHash", NULL,          run_tag},
+};
+
+# define BENCHMARKS (sizeof (benchmarks) / sizeof (benchmark))
+
+/* The GC scans the stack conservatively up to __gc_stack_bottom, while the
+   frames of the driver keep raw numbers (timestamps, cycle counts) which
+   might look like heap pointers; so the primitives are called under a
+   frame which is made the bottom of the stack for the GC */
+static void __attribute__((noinline)) call (void (*f) (int), int n) {
+  size_t bottom = __gc_stack_bottom;
+
+  __gc_stack_bottom = (size_t) __builtin_frame_address (0);
+  f (n);
+  __gc_stack_bottom = bottom;
+}
+
+static double now (void) {
+  struct timespec t;
+
+  clock_gettime (CLOCK_MONOTONIC, &t);
+
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int compare_doubles (const void *a, const void *b) {
+  double x = *(double*) a, y = *(double*) b;
+  return x < y ? -1 : x > y;
+}
+
+static void run (benchmark *b) {
+  double ns [MAX_REPETITIONS], cycles [MAX_REPETITIONS];
+
+  roots[0] = roots[1] = (void*) BOX(0);
+  if (b->setup) call (b->setup, size);
+
+  for (int r = 0; r < repetitions; r++) {
+    double             t = now ();
+    unsigned long long c = __rdtsc ();
+
+    call (b->run, operations);
+
+    cycles[r] = (double) (__rdtsc () - c) / operations;
+    ns[r]     = (now () - t) / operations;
+  }
+
+  qsort (ns,     repetitions, sizeof (double), compare_doubles);
+  qsort (cycles, repetitions, sizeof (double), compare_doubles);
+
+  printf ("%-10s %12.2f %12.2f %12.1f %12.1f\n",
+          b->name, ns[0], ns[repetitions / 2], cycles[0], cycles[repetitions / 2]);
+}
+
+/* Builds a live tree of a given depth, then allocates garbage until a
+   number of collections happen, timing the allocations which collect */
+static void run_gc (int depth) {
+  double total = 0, max = 0;
+  int    pauses = 0, live = (1 << depth) - 1;
+
+  roots[0] = make_tree (depth);
+
+  while (pauses < repetitions) {
+    word   before = Lcollections ();
+    double t      = now ();
+
+    make_array (size);
+
+    if (Lcollections () != before) {
+      t = now () - t;
+      total += t;
+      if (t > max) max = t;
+      pauses++;
+    }
+  }
+
+  printf ("gc         %12d %12zu %12.1f %12.1f\n",
+          live, live * 4 * sizeof (word), total / pauses / 1e3, max / 1e3);
+}
+
+static int selected (char *name, int argc, char *argv[]) {
+  if (argc == 0) return 1;
+
+  for (int i = 0; i < argc; i++)
+    if (strcmp (name, argv[i]) == 0) return 1;
+
+  return 0;
+}
+
+int main (int argc, char *argv[]) {
+  int opt;
+
+  while ((opt = getopt (argc, argv, "r:n:s:")) != -1) {
+    switch (opt) {
+    case 'r': repetitions = atoi (optarg); break;
+    case 'n': operations  = atoi (optarg); break;
+    case 's': size        = atoi (optarg); break;
+    default:
+      fprintf (stderr, "Usage: %s [-r repetitions] [-n operations] [-s size] [benchmark ...]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (repetitions < 1 || repetitions > MAX_REPETITIONS || operations < 1 || size < 0) {
+    fprintf (stderr, "Invalid parameters\n");
+    return 1;
+  }
+
+  /* a small heap, so that the collections happen often enough to be timed */
+  setenv ("LAMA_HEAP_SIZE", "67108864", 0);
+  __gc_init ();
+  node_tag = LtagHash ("Node");
+
+  printf ("%-10s %12s %12s %12s %12s\n", "benchmark", "best ns", "median ns", "best cycles", "median cycles");
+  for (int i = 0; i < BENCHMARKS; i++)
+    if (selected (benchmarks[i].name, argc - optind, argv + optind)) run (&benchmarks[i]);
+
+  if (selected ("gc", argc - optind, argv + optind)) {
+    printf ("\n%-10s %12s %12s %12s %12s\n", "benchmark", "live objects", "live bytes", "mean us", "max us");
+    for (int depth = 0; depth <= 16; depth += 4)
+      call (run_gc, depth);
+  }
+
+  return 0;
+}
@@ -4,8 +4,15 @@ printf_format2:		.string	"BOT: %lx\n"
 printf_format3:		.string	"TOP: %lx\n"
 printf_format4:		.string	"EAX: %lx\n"
 printf_format5:		.string	"LOL\n"
-__gc_stack_bottom:	.long	0
-__gc_stack_top:	        .long	0
+
+	// the stack bounds are per thread (see "Parallel array
+	// combinators" in runtime.c)
+			.section .tbss,"awT",@nobits
+			.align	4
+			.type	__gc_stack_bottom, @tls_object
+			.type	__gc_stack_top, @tls_object
+__gc_stack_bottom:	.zero	4
+__gc_stack_top:	        .zero	4
 
 			.globl	__pre_gc
 			.globl	__post_gc
@@ -13,26 +20,60 @@ __gc_stack_top:	        .long	0
 			.globl	__gc_root_scan_stack
 			.globl	__gc_stack_top
 			.globl	__gc_stack_bottom
+			.globl	__call_closure
 			.extern	init_pool
 			.extern	gc_test_and_copy_root
 			.text
 
-__gc_init:		movl	%ebp, __gc_stack_bottom
-			addl	$4, __gc_stack_bottom
+__gc_init:		movl	%ebp, %gs:__gc_stack_bottom@ntpoff
+			addl	$4, %gs:__gc_stack_bottom@ntpoff
 			call	__init
 			ret
 
+	// Call a Lama closure from the runtime:
+	//   __call_closure (closure, n, args)
+	// pushes n words from args, loads the closure into %edx
+	// and calls its entry point; the caller is responsible for
+	// saving the current stack segment, since here
+	// __gc_stack_bottom is set to the bottom of the callback's
+	// frames and __gc_stack_top is reset
+__call_closure:
+			pushl	%ebp
+			movl	%esp, %ebp
+			pushl	%ebx
+			pushl	%esi
+			pushl	%edi
+			movl	%esp, %gs:__gc_stack_bottom@ntpoff
+			movl	$0, %gs:__gc_stack_top@ntpoff
+			movl	12(%ebp), %ecx
+			movl	16(%ebp), %esi
+			jmp	__call_closure_test
+__call_closure_push:
+			decl	%ecx
+			pushl	(%esi,%ecx,4)
+__call_closure_test:
+			cmpl	$0, %ecx
+			jne	__call_closure_push
+			movl	8(%ebp), %edx
+			call	*(%edx)
+			leal	-12(%ebp), %esp
+			popl	%edi
+			popl	%esi
+			popl	%ebx
+			popl	%ebp
+			ret
+
 	// if __gc_stack_top is equal to 0
 	// then set __gc_stack_top to %ebp
 	// else return
 __pre_gc:
 			pushl	%eax
-			movl	__gc_stack_top, %eax
+			movl	%gs:__gc_stack_top@ntpoff, %eax
 			cmpl	$0, %eax
 			jne	__pre_gc_2
 			movl	%ebp, %eax
 			// addl	$8, %eax
-			movl	%eax, __gc_stack_top
+			movl	%eax, %gs:__gc_stack_top@ntpoff
 __pre_gc_2:
 			popl	%eax
 			ret
@@ -43,10 +84,10 @@ __pre_gc_2:
 	// else return
 __post_gc:
 			pushl	%eax
-			movl	__gc_stack_top, %eax
+			movl	%gs:__gc_stack_top@ntpoff, %eax
 			cmpl	%eax, %ebp
 			jnz	__post_gc2
-			movl	$0, __gc_stack_top
+			movl	$0, %gs:__gc_stack_top@ntpoff
 __post_gc2:
 			popl	%eax
 			ret
@@ -59,7 +100,7 @@ __gc_root_scan_stack:
 			movl	%esp, %ebp
 			pushl	%ebx
 			pushl	%edx
-			movl	__gc_stack_top, %eax
+			movl	%gs:__gc_stack_top@ntpoff, %eax
 			jmp 	next
 
 loop:
@@ -83,12 +124,12 @@ check12:
 	// i.e. the following is not true:
 	// __gc_stack_bottom <= (%eax) <= __gc_stack_top
 check21:	
-			cmpl	%ebx, __gc_stack_top
+			cmpl	%ebx, %gs:__gc_stack_top@ntpoff
 			jna	check22
 			jmp	loop2
 
 check22:
-			cmpl	%ebx, __gc_stack_bottom
+			cmpl	%ebx, %gs:__gc_stack_bottom@ntpoff
 			jnb	next
 
 	// check if it a valid pointer
@@ -105,7 +146,7 @@ gc_run_t:
 
 next:
 			addl	$4, %eax
-			cmpl	%eax, __gc_stack_bottom
+			cmpl	%eax, %gs:__gc_stack_bottom@ntpoff
 			jne	loop
 returnn:
 			movl	$0, %eax
@@ -0,0 +1,151 @@
+	// the stack bounds are per thread (see "Parallel array
+	// combinators" in runtime.c)
+			.section .tbss,"awT",@nobits
+			.align	8
+			.type	__gc_stack_bottom, @tls_object
+			.type	__gc_stack_top, @tls_object
+__gc_stack_bottom:	.zero	8
+__gc_stack_top:	        .zero	8
+
+			.globl	__pre_gc
+			.globl	__post_gc
+			.globl	__gc_init
+			.globl	__gc_root_scan_stack
+			.globl	__gc_stack_top
+			.globl	__gc_stack_bottom
+			.globl	__call_closure
+			.extern	init_pool
+			.extern	gc_test_and_copy_root
+			.text
+
+	// x86-64 version of gc_runtime.s: the same protocol with
+	// %rbp in place of %ebp and 8-byte stack slots; C functions
+	// are called with the stack aligned to 16 bytes
+__gc_init:		movq	%rbp, %fs:__gc_stack_bottom@tpoff
+			addq	$8, %fs:__gc_stack_bottom@tpoff
+			subq	$8, %rsp
+			call	__init
+			addq	$8, %rsp
+			ret
+
+	// Call a Lama closure from the runtime:
+	//   __call_closure (closure, n, args)
+	// pushes n words from args, loads the closure into %rdx
+	// and calls its entry point; the caller is responsible for
+	// saving the current stack segment, since here
+	// __gc_stack_bottom is set to the bottom of the callback's
+	// frames and __gc_stack_top is reset; the arguments are
+	// always passed on the stack, as the entry point of a
+	// closure of a built-in is a thunk which loads them into
+	// the registers (see "Thunks" in X86.ml)
+__call_closure:
+			pushq	%rbp
+			movq	%rsp, %rbp
+			pushq	%rbx
+			pushq	%r12
+			pushq	%r13
+			pushq	%r14
+			pushq	%r15
+			movq	%rsp, %fs:__gc_stack_bottom@tpoff
+			movq	$0, %fs:__gc_stack_top@tpoff
+			movq	%rsi, %rcx
+			movq	%rdx, %rsi
+			movq	%rdi, %rdx
+			jmp	__call_closure_test
+__call_closure_push:
+			decq	%rcx
+			pushq	(%rsi,%rcx,8)
+__call_closure_test:
+			cmpq	$0, %rcx
+			jne	__call_closure_push
+			call	*(%rdx)
+			leaq	-40(%rbp), %rsp
+			popq	%r15
+			popq	%r14
+			popq	%r13
+			popq	%r12
+			popq	%rbx
+			popq	%rbp
+			ret
+
+	// if __gc_stack_top is equal to 0
+	// then set __gc_stack_top to %rbp
+	// else return
+__pre_gc:
+			cmpq	$0, %fs:__gc_stack_top@tpoff
+			jne	__pre_gc_2
+			movq	%rbp, %fs:__gc_stack_top@tpoff
+__pre_gc_2:
+			ret
+
+	// if __gc_stack_top has been set by the caller
+	//   (i.e. it is equal to its %rbp)
+	// then set __gc_stack_top to 0
+	// else return
+__post_gc:
+			cmpq	%rbp, %fs:__gc_stack_top@tpoff
+			jne	__post_gc2
+			movq	$0, %fs:__gc_stack_top@tpoff
+__post_gc2:
+			ret
+	
+	// Scan stack for roots
+	// strting from __gc_stack_top
+	// till __gc_stack_bottom
+__gc_root_scan_stack:
+			pushq	%rbp
+			movq	%rsp, %rbp
+			pushq	%rbx
+			pushq	%r12
+			movq	%fs:__gc_stack_top@tpoff, %rbx
+			jmp 	next
+
+loop:
+			movq	(%rbx), %r12
+
+	// check that it is not a pointer to code section
+	// i.e. the following is not true:
+	// __executable_start <= (%rbx) <= __etext
+check11:	
+			leaq	__executable_start(%rip), %rdx
+			cmpq	%r12, %rdx
+			jna	check12
+			jmp	check21
+
+check12:	
+			leaq	__etext(%rip), %rdx
+			cmpq	%r12, %rdx
+			jnb	next
+
+	// check that it is not a pointer into the program stack
+	// i.e. the following is not true:
+	// __gc_stack_bottom <= (%rbx) <= __gc_stack_top
+check21:	
+			cmpq	%r12, %fs:__gc_stack_top@tpoff
+			jna	check22
+			jmp	loop2
+
+check22:
+			cmpq	%r12, %fs:__gc_stack_bottom@tpoff
+			jnb	next
+
+	// check if it a valid pointer
+	// i.e. the lastest bit is set to zero
+loop2:
+			testq	$1, %r12
+			jnz     next
+gc_run_t:
+			movq	%rbx, %rdi
+      			call	gc_test_and_copy_root
+
+next:
+			addq	$8, %rbx
+			cmpq	%rbx, %fs:__gc_stack_bottom@tpoff
+			jne	loop
+returnn:
+			movq	$0, %rax
+			popq	%r12
+			popq	%rbx
+			movq	%rbp, %rsp 
+			popq	%rbp
+			ret
@@ -19,7 +19,7 @@ void print_indent (void) {
 }
 #endif
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern __thread size_t __gc_stack_top, __gc_stack_bottom;
 
 /* GC pool structure and data; declared here in order to allow debug print */
 typedef struct {
@@ -29,9 +29,224 @@ typedef struct {
   size_t   size;
 } pool;
 
-static pool from_space;
-static pool to_space;
-size_t      *current;
+/* The state of a runtime instance: the heap and the state of the built-ins
+   which is not per thread. A program runs in the main instance; applications
+   which embed Lama can create more (see lama_create). The instance a thread
+   works with is rt; the stack bounds, extra roots and stack segments are
+   per thread */
+struct lama_instance {
+  pool                from_space;
+  pool                to_space;
+  size_t              space_size;       /* the size of a space in words                 */
+  int                 enable_GC;
+  size_t              gc_collections;
+  unsigned long long  gc_max_pause;     /* the longest pause in ns                      */
+  unsigned long long  allocated_words;  /* see "Benchmarking"                           */
+  size_t             *alloc_mark;
+  struct regexp     **re_cache;         /* compiled regular expressions                 */
+  struct in_buffer  **in_buffers;       /* input buffers by file descriptors            */
+  int                 in_buffers_size;
+  struct external    *externals;        /* strings mapped by fmap                       */
+  struct fiber      **fibers;           /* see "Fibers"                                 */
+  int                 fibers_number;
+  int                 fibers_size;
+  int                *fibers_free;      /* the numbers of released fibers               */
+  word               *fibers_gen;       /* the generations of the numbers               */
+  int                 fibers_free_number;
+  int                 fiber_current;
+  int                 fiber_finished;   /* a finished fiber whose stack is to be freed */
+  int                *run_queue;
+  int                 run_head;
+  int                 run_length;
+  int                 run_size;
+  size_t             *globals;          /* see "Global variables of units"              */
+  int                 globals_entry;    /* the descriptor of the segment on x86-32      */
+  struct mutator     *mutators;         /* see "Parallel array combinators"             */
+  int                 mutators_number;
+  int                 par_threads;      /* the size of the pool, -1 if not created      */
+  int                 par_active;       /* if a parallel operation runs                 */
+  int                 par_running;      /* threads out of safepoints                    */
+  int                 par_collecting;
+  int                 par_pending;      /* workers busy with the current job            */
+  int                 par_exit;         /* the pool is to be shut down                  */
+  unsigned            par_epoch;        /* the number of the current job                */
+  struct par_job     *par_current;
+  pthread_mutex_t     par_lock;
+  pthread_cond_t      par_cond;
+  pthread_mutex_t     re_lock;          /* guards the regexps in parallel operations    */
+  int                 inc_phase;        /* see "Incremental collection"                 */
+  unsigned long long  inc_pause;        /* the pause target in ns, 0 if not incremental */
+  size_t             *inc_trigger;      /* the allocation pointer which starts a cycle  */
+  size_t              inc_live;         /* the words left by the last collection        */
+  pool                inc_spare;        /* the last from-space kept for reuse           */
+  struct inc_entry   *inc_entries;      /* replicated objects in the order of copying   */
+  size_t              inc_number;
+  size_t              inc_size;
+  size_t              inc_scan;         /* the first entry not scanned yet              */
+  size_t              inc_item;         /* the entry being scanned                      */
+  size_t              inc_offset;       /* the fields [offset, end) of it to be scanned */
+  size_t              inc_end;
+  int                 inc_fresh;        /* if they are refreshed from the original      */
+  struct inc_slot    *inc_table;        /* open-addressing table of entries             */
+  unsigned            inc_epoch;        /* the number of the cycle in the table         */
+  size_t             *inc_log;          /* updated entries and chunks                   */
+  size_t              inc_log_number;
+  size_t              inc_log_size;
+  size_t             *inc_closures;     /* the entries of closures                      */
+  size_t              inc_closures_number;
+  size_t              inc_closures_size;
+  unsigned char      *inc_cards;        /* the flags of logged chunks                   */
+  size_t              inc_cards_number;
+  size_t              inc_cards_size;
+};
+
+extern const size_t __start_custom_data, __stop_custom_data;
+
+# define INSTANCE_INITIALIZER {                 \
+    .space_size     = 256 * 1024 * 1024,        \
+    .globals        = (size_t*) &__start_custom_data, \
+    .enable_GC      = 1,                        \
+    .fiber_finished = -1,                       \
+    .par_threads    = -1,                       \
+    .par_lock       = PTHREAD_MUTEX_INITIALIZER, \
+    .re_lock        = PTHREAD_MUTEX_INITIALIZER, \
+    .par_cond       = PTHREAD_COND_INITIALIZER  \
+  }
+
+static lama_instance           main_instance = INSTANCE_INITIALIZER;
+static __thread lama_instance *rt            = &main_instance;
+
+/* Global variables of units.
+
+   The compiler places the global variables of a unit and the flag of its
+   initialization in the section "custom_data" and addresses them through
+   a segment register: %gs on x86-64 and %fs on x86-32 (the C library uses
+   the other one for the thread-local storage). The main instance works with
+   the section itself through a flat segment. Any other instance has a copy
+   of the section made from its image before the initialization of units,
+   and a thread which runs the instance moves the base of its segment by the
+   distance from the section to the copy: with arch_prctl (or wrgsbase) on
+   x86-64 and with a descriptor of the LDT per instance on x86-32. As lea
+   does not take the base of a segment into account, the address of a global
+   variable is computed from __globals_base, the address of the copy.
+*/
+
+void *__globals_base __attribute__((section ("custom_data"))) = (void*) &__start_custom_data;
+
+static size_t         *globals_image;                    /* the section before the initialization */
+static pthread_once_t  globals_once = PTHREAD_ONCE_INIT;
+static __thread lama_instance *globals_instance;         /* the one the segment is set for        */
+
+/* a global variable of units in an instance */
+# define GLOBAL(inst, x) (*(void**) ((inst)->globals + ((size_t*) &(x) - (size_t*) &__start_custom_data)))
+
+# ifdef __x86_64__
+#   ifndef HWCAP2_FSGSBASE
+#     define HWCAP2_FSGSBASE (1 << 1)
+#   endif
+static int globals_fsgsbase; /* if wrgsbase is enabled */
+# else
+static unsigned char   globals_entries [LDT_ENTRIES]; /* used descriptors */
+static pthread_mutex_t globals_lock = PTHREAD_MUTEX_INITIALIZER;
+# endif
+
+/* the end of the global variables of units in an instance */
+static inline size_t* globals_end (lama_instance *inst) {
+  return inst->globals + (&__stop_custom_data - &__start_custom_data);
+}
+
+static void globals_save (void) {
+  size_t size = (&__stop_custom_data - &__start_custom_data) * sizeof (size_t);
+  
+  if ((globals_image = (size_t*) malloc (size)) == NULL)
+    failure ("globals: out of memory\n");
+
+  memcpy (globals_image, &__start_custom_data, size);
+
+# ifdef __x86_64__
+  globals_fsgsbase = (getauxval (AT_HWCAP2) & HWCAP2_FSGSBASE) != 0;
+# endif
+}
+
+/* Points the segment of the current thread to the global variables of an instance */
+static void set_globals (lama_instance *inst) {
+  if (globals_instance == inst) return;
+  
+# ifdef __x86_64__
+  word base = (char*) inst->globals - (char*) &__start_custom_data;
+
+  if (globals_fsgsbase) asm volatile ("wrgsbase %0" :: "r" (base));
+  else if (syscall (SYS_arch_prctl, ARCH_SET_GS, base))
+    failure ("globals: can not set the segment (%s)\n", strerror (errno));
+# else
+  unsigned short selector = (inst->globals_entry << 3) | 7; /* LDT, ring 3 */
+
+  if (inst == &main_instance) asm ("movw %%ds, %0" : "=r" (selector));
+
+  asm volatile ("movw %0, %%fs" :: "r" (selector));
+# endif
+
+  globals_instance = inst;
+}
+
+/* Makes the copy of the global variables of a new instance; returns 0 on success */
+static int globals_create (lama_instance *inst) {
+  size_t size = (&__stop_custom_data - &__start_custom_data) * sizeof (size_t);
+  
+  if ((inst->globals = (size_t*) malloc (size)) == NULL) return 1;
+
+  memcpy (inst->globals, globals_image, size);
+  GLOBAL(inst, __globals_base) = inst->globals;
+
+# ifndef __x86_64__
+  struct user_desc d = {0};
+  int              i;
+
+  pthread_mutex_lock (&globals_lock);
+  for (i = 0; i < LDT_ENTRIES && globals_entries[i]; i++);
+  if (i < LDT_ENTRIES) globals_entries[i] = 1;
+  pthread_mutex_unlock (&globals_lock);
+
+  d.entry_number   = i;
+  d.base_addr      = (unsigned) ((char*) inst->globals - (char*) &__start_custom_data);
+  d.limit          = 0xfffff;
+  d.seg_32bit      = 1;
+  d.limit_in_pages = 1;
+  d.useable        = 1;
+
+  if (i == LDT_ENTRIES || syscall (SYS_modify_ldt, 1, &d, sizeof (d))) {
+    if (i < LDT_ENTRIES) globals_entries[i] = 0;
+    free (inst->globals);
+    return 1;
+  }
+  
+  inst->globals_entry = i;
+# endif
+
+  return 0;
+}
+
+static void globals_release (lama_instance *inst) {
+# ifndef __x86_64__
+  struct user_desc d = {0};
+
+  d.entry_number    = inst->globals_entry;
+  d.read_exec_only  = 1;
+  d.seg_not_present = 1;
+  syscall (SYS_modify_ldt, 1, &d, sizeof (d));
+  
+  pthread_mutex_lock   (&globals_lock);
+  globals_entries[inst->globals_entry] = 0;
+  pthread_mutex_unlock (&globals_lock);
+# endif
+  
+  free (inst->globals);
+}
+
+/* end */
+
+/* the allocation pointer of the to-space during a collection */
+static __thread size_t *current;
 /* end */
 
 # ifdef __ENABLE_GC__
@@ -57,27 +272,40 @@ void __post_gc_subst () {}
 # define CLOSURE_TAG 0x00000007 
 # define UNBOXED_TAG 0x00000009 // Not actually a tag; used to return from LkindOf
 
-# define LEN(x) ((x & 0xFFFFFFF8) >> 3)
-# define TAG(x)  (x & 0x00000007)
+# define LEN(x) ((size_t) (x) >> 3)
+# define TAG(x)  ((x) & 0x00000007)
 
-# define TO_DATA(x) ((data*)((char*)(x)-sizeof(int)))
-# define TO_SEXP(x) ((sexp*)((char*)(x)-2*sizeof(int)))
+# define TO_DATA(x) ((data*)((char*)(x)-sizeof(word)))
+# define TO_SEXP(x) ((sexp*)((char*)(x)-2*sizeof(word)))
 #ifdef DEBUG_PRINT // GET_SEXP_TAG is necessary for printing from space
 # define GET_SEXP_TAG(x) (LEN(x))
 #endif
 
-# define UNBOXED(x)  (((int) (x)) &  0x0001)
-# define UNBOX(x)    (((int) (x)) >> 1)
-# define BOX(x)      ((((int) (x)) << 1) | 0x0001)
+# define UNBOXED(x)  (((word) (x)) &  0x0001)
+# define UNBOX(x)    (((word) (x)) >> 1)
+# define BOX(x)      ((((word) (x)) << 1) | 0x0001)
+
+# define IS_VALID_HEAP_POINTER(p)\
+  (!UNBOXED(p) &&		 \
+   (size_t)rt->from_space.begin <= (size_t)p &&	 \
+   (size_t)rt->from_space.end   >  (size_t)p)
+
+static int is_external (void *p);
 
-/* GC extra roots */
-#define MAX_EXTRA_ROOTS_NUMBER 32
+/* A value with a header: either in the heap or an external string (see fmap) */
+# define IS_VALID_POINTER(p)\
+  (IS_VALID_HEAP_POINTER(p) || (!UNBOXED(p) && is_external (p)))
+
+/* GC extra roots; the pool grows, since built-ins calling back Lama code
+   keep their roots across the callbacks, which may nest */
+#define EXTRA_ROOTS_NUMBER 32
 typedef struct {
   int current_free;
-  void ** roots[MAX_EXTRA_ROOTS_NUMBER];
+  int size;
+  void *** roots;
 } extra_roots_pool;
 
-static extra_roots_pool extra_roots;
+static __thread extra_roots_pool extra_roots;
 
 void clear_extra_roots (void) {
   extra_roots.current_free = 0;
@@ -88,9 +316,17 @@ void push_extra_root (void ** p) {
   indent++; print_indent ();
   printf ("push_extra_root %p %p\n", p, &p); fflush (stdout);
 #endif
-  if (extra_roots.current_free >= MAX_EXTRA_ROOTS_NUMBER) {
-    perror ("ERROR: push_extra_roots: extra_roots_pool overflow");
-    exit   (1);
+  if (extra_roots.current_free >= extra_roots.size) {
+    int size = extra_roots.size == 0 ? EXTRA_ROOTS_NUMBER : 2 * extra_roots.size;
+    void ***roots = realloc (extra_roots.roots, size * sizeof (void**));
+
+    if (roots == NULL) {
+      perror ("ERROR: push_extra_roots: extra_roots_pool overflow");
+      exit   (1);
+    }
+    
+    extra_roots.roots = roots;
+    extra_roots.size  = size;
   }
   extra_roots.roots[extra_roots.current_free] = p;
   extra_roots.current_free++;
@@ -126,7 +362,71 @@ void pop_extra_root (void ** p) {
 
 /* end */
 
+/* Callbacks into Lama code */
+
+/* While a built-in calls back a Lama closure, the part of the stack between
+   the built-in frame and the callback frames belongs to C code and must not be
+   scanned; the outer stack segment is saved here and scanned separately */
+typedef struct {
+  size_t top;
+  size_t bottom;
+} stack_segment;
+
+# define MAX_STACK_SEGMENTS 1024
+
+static __thread stack_segment stack_segments [MAX_STACK_SEGMENTS];
+static __thread int           stack_segments_number = 0;
+
+extern void* __call_closure (void *closure, int n, void **args);
+
+/* Calls a closure with n arguments; the calling built-in has to invoke
+   __pre_gc beforehand and to keep its heap pointers in extra roots */
+static void* call_closure (void *closure, int n, void **args) {
+  void *res;
+
+  if (__gc_stack_top == 0) {
+    perror ("ERROR: call_closure: __pre_gc is not called");
+    exit   (1);
+  }
+  
+  if (stack_segments_number >= MAX_STACK_SEGMENTS) {
+    perror ("ERROR: call_closure: stack segments overflow");
+    exit   (1);
+  }
+
+  stack_segments[stack_segments_number].top    = __gc_stack_top;
+  stack_segments[stack_segments_number].bottom = __gc_stack_bottom;
+  stack_segments_number++;
+  
+  res = __call_closure (closure, n, args);
+
+  stack_segments_number--;
+  __gc_stack_top    = stack_segments[stack_segments_number].top;
+  __gc_stack_bottom = stack_segments[stack_segments_number].bottom;
+
+  return res;
+}
+
+/* Registers n words starting at b as roots while a built-in allocates */
+static void push_roots (word *b, int n) {
+  if (stack_segments_number >= MAX_STACK_SEGMENTS) {
+    perror ("ERROR: push_roots: stack segments overflow");
+    exit   (1);
+  }
+
+  stack_segments[stack_segments_number].top    = (size_t) (b - 1);
+  stack_segments[stack_segments_number].bottom = (size_t) (b + n);
+  stack_segments_number++;
+}
+
+static void pop_roots (void) {
+  stack_segments_number--;
+}
+
+/* end */
+
 static void vfailure (char *s, va_list args) {
+  fflush   (stdout);
   fprintf  (stderr, "*** FAILURE: ");
   vfprintf (stderr, s, args); // vprintf (char *, va_list) <-> printf (char *, ...)
   exit     (255);
@@ -157,30 +457,32 @@ void Lassert (void *f, char *s, ...) {
 	 != STRING_TAG) failure ("string value expected in %s\n", memo); while (0)
 
 typedef struct {
-  int tag; 
+  word tag; 
   char contents[0];
 } data; 
 
 typedef struct {
-  int tag; 
+  word tag; 
   data contents; 
 } sexp;
 
 extern void* alloc    (size_t);
-extern void* Bsexp    (int n, ...);
-extern int   LtagHash (char*);
+extern void* Bsexp    (word n, ...);
+extern word  LtagHash (char*);
 
-void *global_sysargs;
+/* the command line arguments; a global variable of units (see "Global
+   variables of units") */
+void *global_sysargs __attribute__((section ("custom_data")));
 
 // Gets a raw tag
-extern int LkindOf (void *p) {
+extern word LkindOf (void *p) {
   if (UNBOXED(p)) return UNBOXED_TAG;
   
   return TAG(TO_DATA(p)->tag);
 }
 
 // Compare sexprs tags
-extern int LcompareTags (void *p, void *q) {
+extern word LcompareTags (void *p, void *q) {
   data *pd, *qd;
   
   ASSERT_BOXED ("compareTags, 0", p);
@@ -220,7 +522,7 @@ void* Ls__Infix_58 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "!!";
-int Ls__Infix_3333 (void *p, void *q) {
+word Ls__Infix_3333 (void *p, void *q) {
   ASSERT_UNBOXED("captured !!:1", p);
   ASSERT_UNBOXED("captured !!:2", q);
 
@@ -228,7 +530,7 @@ int Ls__Infix_3333 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "&&";
-int Ls__Infix_3838 (void *p, void *q) {
+word Ls__Infix_3838 (void *p, void *q) {
   ASSERT_UNBOXED("captured &&:1", p);
   ASSERT_UNBOXED("captured &&:2", q);
 
@@ -236,12 +538,12 @@ int Ls__Infix_3838 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "==";
-int Ls__Infix_6161 (void *p, void *q) {
+word Ls__Infix_6161 (void *p, void *q) {
   return BOX(p == q);
 }
 
 // Functional synonym for built-in operator "!=";
-int Ls__Infix_3361 (void *p, void *q) {
+word Ls__Infix_3361 (void *p, void *q) {
   ASSERT_UNBOXED("captured !=:1", p);
   ASSERT_UNBOXED("captured !=:2", q);
 
@@ -249,7 +551,7 @@ int Ls__Infix_3361 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "<=";
-int Ls__Infix_6061 (void *p, void *q) {
+word Ls__Infix_6061 (void *p, void *q) {
   ASSERT_UNBOXED("captured <=:1", p);
   ASSERT_UNBOXED("captured <=:2", q);
 
@@ -257,7 +559,7 @@ int Ls__Infix_6061 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "<";
-int Ls__Infix_60 (void *p, void *q) {
+word Ls__Infix_60 (void *p, void *q) {
   ASSERT_UNBOXED("captured <:1", p);
   ASSERT_UNBOXED("captured <:2", q);
 
@@ -265,7 +567,7 @@ int Ls__Infix_60 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator ">=";
-int Ls__Infix_6261 (void *p, void *q) {
+word Ls__Infix_6261 (void *p, void *q) {
   ASSERT_UNBOXED("captured >=:1", p);
   ASSERT_UNBOXED("captured >=:2", q);
 
@@ -273,7 +575,7 @@ int Ls__Infix_6261 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator ">";
-int Ls__Infix_62 (void *p, void *q) {
+word Ls__Infix_62 (void *p, void *q) {
   ASSERT_UNBOXED("captured >:1", p);
   ASSERT_UNBOXED("captured >:2", q);
 
@@ -281,7 +583,7 @@ int Ls__Infix_62 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "+";
-int Ls__Infix_43 (void *p, void *q) {
+word Ls__Infix_43 (void *p, void *q) {
   ASSERT_UNBOXED("captured +:1", p);
   ASSERT_UNBOXED("captured +:2", q);
 
@@ -289,7 +591,7 @@ int Ls__Infix_43 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "-";
-int Ls__Infix_45 (void *p, void *q) {
+word Ls__Infix_45 (void *p, void *q) {
   if (UNBOXED(p)) {
     ASSERT_UNBOXED("captured -:2", q);
     return BOX(UNBOX(p) - UNBOX(q));
@@ -300,7 +602,7 @@ int Ls__Infix_45 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "*";
-int Ls__Infix_42 (void *p, void *q) {
+word Ls__Infix_42 (void *p, void *q) {
   ASSERT_UNBOXED("captured *:1", p);
   ASSERT_UNBOXED("captured *:2", q);
 
@@ -308,7 +610,7 @@ int Ls__Infix_42 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "/";
-int Ls__Infix_47 (void *p, void *q) {
+word Ls__Infix_47 (void *p, void *q) {
   ASSERT_UNBOXED("captured /:1", p);
   ASSERT_UNBOXED("captured /:2", q);
 
@@ -316,14 +618,14 @@ int Ls__Infix_47 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "%";
-int Ls__Infix_37 (void *p, void *q) {
+word Ls__Infix_37 (void *p, void *q) {
   ASSERT_UNBOXED("captured %:1", p);
   ASSERT_UNBOXED("captured %:2", q);
 
   return BOX(UNBOX(p) % UNBOX(q));
 }
 
-extern int Llength (void *p) {
+extern word Llength (void *p) {
   data *a = (data*) BOX (NULL);
   
   ASSERT_BOXED(".length", p);
@@ -336,13 +638,13 @@ static char* chars = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234
 
 extern char* de_hash (int);
 
-extern int LtagHash (char *s) {
+extern word LtagHash (char *s) {
   char *p;
   int  h = 0, limit = 0;
                
   p = s;
 
-  while (*p && limit++ < 4) {
+  while (*p && limit++ < 5) {
     char *q = chars;
     int pos = 0;
     
@@ -396,7 +698,7 @@ typedef struct {
   int len;
 } StringBuf;
 
-static StringBuf stringBuf;
+static __thread StringBuf stringBuf;
 
 # define STRINGBUF_INIT 128
 
@@ -421,11 +723,14 @@ static void vprintStringBuf (char *fmt, va_list args) {
   int     written = 0,
           rest    = 0;
   char   *buf     = (char*) BOX(NULL);
+  va_list copy;
 
  again:
   buf     = &stringBuf.contents[stringBuf.ptr];
   rest    = stringBuf.len - stringBuf.ptr;
-  written = vsnprintf (buf, rest, fmt, args);
+  va_copy (copy, args);
+  written = vsnprintf (buf, rest, fmt, copy);
+  va_end  (copy);
   
   if (written >= rest) {
     extendStringBuf ();
@@ -447,10 +752,10 @@ int is_valid_heap_pointer (void *p);
 static void printValue (void *p) {
   data *a = (data*) BOX(NULL);
   int i   = BOX(0);
-  if (UNBOXED(p)) printStringBuf ("%d", UNBOX(p));
+  if (UNBOXED(p)) printStringBuf ("%ld", (long) UNBOX(p));
   else {
-    if (! is_valid_heap_pointer(p)) {
-      printStringBuf ("0x%x", p);
+    if (! IS_VALID_POINTER(p)) {
+      printStringBuf ("0x%lx", (unsigned long) p);
       return;
     }
     
@@ -464,8 +769,8 @@ static void printValue (void *p) {
     case CLOSURE_TAG:
       printStringBuf ("<closure ");
       for (i = 0; i < LEN(a->tag); i++) {
-	if (i) printValue ((void*)((int*) a->contents)[i]);
-	else printStringBuf ("0x%x", (void*)((int*) a->contents)[i]);
+	if (i) printValue ((void*)((word*) a->contents)[i]);
+	else printStringBuf ("0x%lx", (unsigned long) ((word*) a->contents)[i]);
 	
 	if (i != LEN(a->tag) - 1) printStringBuf (", ");
       }
@@ -475,7 +780,7 @@ static void printValue (void *p) {
     case ARRAY_TAG:
       printStringBuf ("[");
       for (i = 0; i < LEN(a->tag); i++) {
-        printValue ((void*)((int*) a->contents)[i]);
+        printValue ((void*)((word*) a->contents)[i]);
 	if (i != LEN(a->tag) - 1) printStringBuf (", ");
       }
       printStringBuf ("]");
@@ -494,8 +799,8 @@ static void printValue (void *p) {
 	printStringBuf ("{");
 
 	while (LEN(a->tag)) {
-	  printValue ((void*)((int*) b->contents)[0]);
-	  b = (data*)((int*) b->contents)[1];
+	  printValue ((void*)((word*) b->contents)[0]);
+	  b = (data*)((word*) b->contents)[1];
 	  if (! UNBOXED(b)) {
 	    printStringBuf (", ");
 	    b = TO_DATA(b);
@@ -510,7 +815,7 @@ static void printValue (void *p) {
 	if (LEN(a->tag)) {
 	  printStringBuf (" (");
 	  for (i = 0; i < LEN(a->tag); i++) {
-	    printValue ((void*)((int*) a->contents)[i]);
+	    printValue ((void*)((word*) a->contents)[i]);
 	    if (i != LEN(a->tag) - 1) printStringBuf (", ");
 	  }
 	  printStringBuf (")");
@@ -548,8 +853,8 @@ static void stringcat (void *p) {
 	data *b = a;
 	
 	while (LEN(a->tag)) {
-	  stringcat ((void*)((int*) b->contents)[0]);
-	  b = (data*)((int*) b->contents)[1];
+	  stringcat ((void*)((word*) b->contents)[0]);
+	  b = (data*)((word*) b->contents)[1];
 	  if (! UNBOXED(b)) {
 	    b = TO_DATA(b);
 	  }
@@ -566,17 +871,17 @@ static void stringcat (void *p) {
   }
 }
 
-extern int Luppercase (void *v) {
+extern word Luppercase (void *v) {
   ASSERT_UNBOXED("Luppercase:1", v);
   return BOX(toupper ((int) UNBOX(v)));
 }
 
-extern int Llowercase (void *v) {
+extern word Llowercase (void *v) {
   ASSERT_UNBOXED("Llowercase:1", v);
   return BOX(tolower ((int) UNBOX(v)));
 }
 
-extern int LmatchSubString (char *subj, char *patt, int pos) {
+extern word LmatchSubString (char *subj, char *patt, word pos) {
   data *p = TO_DATA(patt), *s = TO_DATA(subj);
   int   n;
 
@@ -592,7 +897,7 @@ extern int LmatchSubString (char *subj, char *patt, int pos) {
   return BOX(strncmp (subj + UNBOX(pos), patt, n) == 0);
 }
 
-extern void* Lsubstring (void *subj, int p, int l) {
+extern void* Lsubstring (void *subj, word p, word l) {
   data *d = TO_DATA(subj);
   int pp = UNBOX (p), ll = UNBOX (l);
 
@@ -606,7 +911,7 @@ extern void* Lsubstring (void *subj, int p, int l) {
     __pre_gc ();
 
     push_extra_root (&subj);
-    r = (data*) alloc (ll + 1 + sizeof (int));
+    r = (data*) alloc (ll + 1 + sizeof (word));
     pop_extra_root (&subj);
 
     r->tag = STRING_TAG | (ll << 3);
@@ -622,348 +927,1001 @@ extern void* Lsubstring (void *subj, int p, int l) {
             subject length=%d)", pp, ll, LEN(d->tag));
 }
 
-extern struct re_pattern_buffer *Lregexp (char *regexp) {
-  regex_t *b = (regex_t*) malloc (sizeof (regex_t));
+/* Regular expressions.
 
-  memset (b, 0, sizeof (regex_t));
-  
-  int n = (int) re_compile_pattern (regexp, strlen (regexp), b);
-  
-  if (n != 0) {
-    failure ("%", strerror (n));
-  };
+   Compiled regexps are cached by pattern, so repeated calls of "regexp"
+   with the same pattern share a single compiled object. Each compiled
+   object keeps the GNU pattern buffer and, when the pattern is a plain
+   regular expression (literals, ".", bracket lists, "*", "+", "?",
+   "\(...\)" and "\|"), a position automaton which is lazily turned into a
+   DFA while matching. Like re_match the DFA finds the longest match at
+   the given position, but it runs in time linear in the length of the
+   match. Patterns with anchors, back references or other GNU extensions
+   are matched by re_match.
 
-  return b;
-}
+   The cache and the DFA tables of an instance are shared by the threads of
+   a parallel operation (see "Parallel array combinators"), thus while one
+   runs they are used under re_lock. No heap allocation is made with the lock
+   held, so a thread waiting for it never delays a collection for long.
+*/
 
-extern int LregexpMatch (struct re_pattern_buffer *b, char *s, int pos) {
-  int res;
-  
-  ASSERT_BOXED("regexpMatch:1", b);
-  ASSERT_STRING("regexpMatch:2", s);
-  ASSERT_UNBOXED("regexpMatch:3", pos);
+# define RE_MAX_POSITIONS 255
+# define RE_MAX_NODES     1024
+# define RE_MAX_STATES    1024
+# define RE_CACHE_SIZE    256
+# define RE_WORDS         ((RE_MAX_POSITIONS + 1 + 31) / 32)
 
-  res = re_match (b, s, LEN(TO_DATA(s)->tag), UNBOX(pos), 0);
+# define RE_UNKNOWN (-1)
+# define RE_DEAD    (-2)
 
-  if (res) {
-    return BOX (res);
-  }
+# define RE_SET_ADD(s, i) ((s)[(i) >> 5] |= 1u << ((i) & 31))
+# define RE_SET_HAS(s, i) ((s)[(i) >> 5] & (1u << ((i) & 31)))
 
-  return BOX (res);
-}
+enum { RE_EMPTY, RE_CHARS, RE_CAT, RE_ALT, RE_STAR, RE_PLUS, RE_OPT };
 
-extern void* Bstring (void*);
+typedef struct {
+  int      kind;
+  int      left, right;
+  int      nullable;
+  unsigned first[RE_WORDS];
+  unsigned last [RE_WORDS];
+} re_node;
 
-void *Lclone (void *p) {
-  data *obj;
-  sexp *sobj;
-  void* res;
-  int n;
-#ifdef DEBUG_PRINT
-  register int * ebp asm ("ebp");
-  indent++; print_indent ();
-  printf ("Lclone arg: %p %p\n", &p, p); fflush (stdout);
-#endif
-  __pre_gc ();
-  
-  if (UNBOXED(p)) return p;
-  else {
-    data *a = TO_DATA(p);
-    int t   = TAG(a->tag), l = LEN(a->tag);
+typedef struct {
+  unsigned set  [RE_WORDS];
+  int      accept;
+  int      trans[256];
+} re_state;
 
-    push_extra_root (&p);
-    switch (t) {
-    case STRING_TAG:
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("Lclone: string1 &p=%p p=%p\n", &p, p); fflush (stdout);
-#endif
-      res = Bstring (TO_DATA(p)->contents);
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("Lclone: string2 %p %p\n", &p, p); fflush (stdout);
-#endif
-      break;
+typedef struct {
+  int       npos;                        /* positions; position npos is the initial one */
+  unsigned  chars [RE_MAX_POSITIONS][8];
+  unsigned  follow[RE_MAX_POSITIONS + 1][RE_WORDS];
+  unsigned  final [RE_WORDS];
+  re_state *states;
+  int       nstates, capacity;
+  int      *index;                       /* open-addressing table of state numbers */
+} re_dfa;
+
+typedef struct regexp {
+  char           *pattern;
+  regex_t         gnu;
+  re_dfa         *dfa;
+  struct regexp  *next;
+} regexp;
 
-    case ARRAY_TAG:      
-    case CLOSURE_TAG:
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("Lclone: closure or array &p=%p p=%p ebp=%p\n", &p, p, ebp); fflush (stdout);
-#endif
-      obj = (data*) alloc (sizeof(int) * (l+1));
-      memcpy (obj, TO_DATA(p), sizeof(int) * (l+1));
-      res = (void*) (obj->contents);
-      break;
-      
-    case SEXP_TAG:
-#ifdef DEBUG_PRINT
-      print_indent (); printf ("Lclone: sexp\n"); fflush (stdout);
-#endif
-      sobj = (sexp*) alloc (sizeof(int) * (l+2));
-      memcpy (sobj, TO_SEXP(p), sizeof(int) * (l+2));
-      res = (void*) sobj->contents.contents;
-      break;
-       
-    default:
-      failure ("invalid tag %d in clone *****\n", t);
-    }
-    pop_extra_root (&p);
-  }
-#ifdef DEBUG_PRINT
-  print_indent (); printf ("Lclone ends1\n"); fflush (stdout);
-#endif
+typedef struct {
+  unsigned char *s;
+  re_dfa        *dfa;
+  re_node       *nodes;
+  int            nnodes;
+} re_parser;
 
-  __post_gc ();
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("Lclone ends2\n"); fflush (stdout);
-  indent--;
-#endif
-  return res;
+static int re_node_new (re_parser *p, int kind, int left, int right) {
+  if (p->nnodes == RE_MAX_NODES) return -1;
+
+  re_node *n = &p->nodes[p->nnodes];
+
+  memset (n, 0, sizeof (re_node));
+  n->kind  = kind;
+  n->left  = left;
+  n->right = right;
+
+  return p->nnodes++;
 }
 
-# define HASH_DEPTH 3
-# define HASH_APPEND(acc, x) (((acc + (unsigned) x) << (WORD_SIZE / 2)) | ((acc + (unsigned) x) >> (WORD_SIZE / 2)))
+static int re_chars (re_parser *p, unsigned *chars) {
+  int n;
 
-int inner_hash (int depth, unsigned acc, void *p) {
-  if (depth > HASH_DEPTH) return acc;
+  if (p->dfa->npos == RE_MAX_POSITIONS) return -1;
+  if ((n = re_node_new (p, RE_CHARS, p->dfa->npos, 0)) < 0) return -1;
 
-  if (UNBOXED(p)) return HASH_APPEND(acc, UNBOX(p));
-  else if (is_valid_heap_pointer (p)) {
-    data *a = TO_DATA(p);
-    int t = TAG(a->tag), l = LEN(a->tag), i;
+  memcpy (p->dfa->chars[p->dfa->npos++], chars, 8 * sizeof (unsigned));
 
-    acc = HASH_APPEND(acc, t);
-    acc = HASH_APPEND(acc, l);    
+  return n;
+}
 
-    switch (t) {
-    case STRING_TAG: {
-      char *p = a->contents;
+static int re_bracket (re_parser *p) {
+  unsigned chars[8] = {0};
+  int negate = 0, i;
 
-      while (*p) {
-        int n = (int) *p++;
-	acc = HASH_APPEND(acc, n);
-      }
+  if (*p->s == '^') {negate = 1; p->s++;}
 
-      return acc;
-    }
-      
-    case CLOSURE_TAG:
-      acc = HASH_APPEND(acc, ((void**) a->contents)[0]);
-      i = 1;
-      break;
-      
-    case ARRAY_TAG:
-      i = 0;
-      break;
+  /* the first character is taken literally even if it is ']', and can
+     start a range */
+  do {
+    unsigned char lo = *p->s++, hi = lo;
 
-    case SEXP_TAG: {
-#ifndef DEBUG_PRINT
-      int ta = TO_SEXP(p)->tag;
-#else
-      int ta = GET_SEXP_TAG(TO_SEXP(p)->tag);
-#endif
-      acc = HASH_APPEND(acc, ta);
-      i = 0;
-      break;
-    }
+    if (lo == 0) return -1;
+    if (lo == '[' && (*p->s == ':' || *p->s == '=' || *p->s == '.')) return -1;
+    if (*p->s == '-' && p->s[1] != ']' && p->s[1] != 0) {hi = p->s[1]; p->s += 2;}
 
-    default:
-      failure ("invalid tag %d in hash *****\n", t);
-    }
+    for (i = lo; i <= hi; i++) RE_SET_ADD(chars, i);
+  } while (*p->s != ']');
 
-    for (; i<l; i++) 
-      acc = inner_hash (depth+1, acc, ((void**) a->contents)[i]);
+  p->s++;
 
-    return acc;
-  }
-  else return HASH_APPEND(acc, p);
-}
+  if (negate)
+    for (i = 0; i < 8; i++) chars[i] = ~chars[i];
 
-extern void* LstringInt (char *b) {
-  int n;
-  sscanf (b, "%d", &n);
-  return (void*) BOX(n);
+  return re_chars (p, chars);
 }
 
-extern int Lhash (void *p) {
-  return BOX(0x3fffff & inner_hash (0, 0, p));
-}
+static int re_alt (re_parser *p, int depth);
 
-extern int LflatCompare (void *p, void *q) {
-  if (UNBOXED(p)) {
-    if (UNBOXED(q)) {
-      return BOX (UNBOX(p) - UNBOX(q));
-    }
-    
+static int re_atom (re_parser *p, int depth) {
+  unsigned chars[8] = {0};
+  unsigned char c = *p->s++;
+  int i;
+
+  switch (c) {
+  case '[':
+    return re_bracket (p);
+
+  case '.':
+    for (i = 0; i < 8; i++) chars[i] = ~0u;
+    chars['\n' >> 5] &= ~(1u << ('\n' & 31));
+    return re_chars (p, chars);
+
+  case '^':
+  case '$':
+  case '*':
+  case '+':
+  case '?':
+    /* context-dependent in GNU syntax; leave to re_match */
     return -1;
-  }
-  else if (~UNBOXED(q)) {
-    return BOX(p - q);
-  }
-  else BOX(1);
-}
 
-extern int Lcompare (void *p, void *q) {
-# define COMPARE_AND_RETURN(x,y) do if (x != y) return BOX(x - y); while (0)
-  
-  if (p == q) return BOX(0);
- 
-  if (UNBOXED(p)) {
-    if (UNBOXED(q)) return BOX(UNBOX(p) - UNBOX(q));    
-    else return BOX(-1);
-  }
-  else if (UNBOXED(q)) return BOX(1);
-  else {
-    if (is_valid_heap_pointer (p)) {
-      if (is_valid_heap_pointer (q)) {
-        data *a = TO_DATA(p), *b = TO_DATA(q);
-        int ta = TAG(a->tag), tb = TAG(b->tag);
-        int la = LEN(a->tag), lb = LEN(b->tag);
-        int i;
-    
-        COMPARE_AND_RETURN (ta, tb);
-      
-        switch (ta) {
-        case STRING_TAG:
-          return BOX(strcmp (a->contents, b->contents));
-      
-        case CLOSURE_TAG:
-          COMPARE_AND_RETURN (((void**) a->contents)[0], ((void**) b->contents)[0]);
-          COMPARE_AND_RETURN (la, lb);
-          i = 1;
-          break;
-      
-        case ARRAY_TAG:
-          COMPARE_AND_RETURN (la, lb);
-          i = 0;
-          break;
+  case '\\':
+    c = *p->s++;
 
-        case SEXP_TAG: {
-#ifndef DEBUG_PRINT
-          int ta = TO_SEXP(p)->tag, tb = TO_SEXP(q)->tag;      
-#else
-          int ta = GET_SEXP_TAG(TO_SEXP(p)->tag), tb = GET_SEXP_TAG(TO_SEXP(q)->tag);
-#endif      
-          COMPARE_AND_RETURN (ta, tb);
-          COMPARE_AND_RETURN (la, lb);
-          i = 0;
-          break;
-        }
+    if (c == '(') {
+      int n = re_alt (p, depth + 1);
 
-        default:
-          failure ("invalid tag %d in compare *****\n", ta);
-        }
+      if (n < 0 || p->s[0] != '\\' || p->s[1] != ')') return -1;
 
-        for (; i<la; i++) {
-          int c = Lcompare (((void**) a->contents)[i], ((void**) b->contents)[i]);
-          if (c != BOX(0)) return BOX(c);
-        }
-    
-        return BOX(0);
-      }
-      else return BOX(-1);
+      p->s += 2;
+      return n;
     }
-    else if (is_valid_heap_pointer (q)) return BOX(1);
-    else return BOX (p - q);
+
+    if (c == 0 || isalnum (c) || strchr ("<>`'{}()|", c)) return -1;
+
+  default:
+    RE_SET_ADD(chars, c);
+    return re_chars (p, chars);
   }
 }
 
-extern void* Belem (void *p, int i) {
-  data *a = (data *)BOX(NULL);
+static int re_piece (re_parser *p, int depth) {
+  int n = re_atom (p, depth);
 
-  ASSERT_BOXED(".elem:1", p);
-  ASSERT_UNBOXED(".elem:2", i);
-  
-  a = TO_DATA(p);
-  i = UNBOX(i);
-  
-  if (TAG(a->tag) == STRING_TAG) {
-    return (void*) BOX(a->contents[i]);
+  while (n >= 0) {
+    switch (*p->s) {
+    case '*': n = re_node_new (p, RE_STAR, n, 0); break;
+    case '+': n = re_node_new (p, RE_PLUS, n, 0); break;
+    case '?': n = re_node_new (p, RE_OPT , n, 0); break;
+    default : return n;
+    }
+
+    p->s++;
   }
-  
-  return (void*) ((int*) a->contents)[i];
+
+  return n;
 }
 
-extern void* LmakeArray (int length) {
-  data *r;
-  int n;
+static int re_branch (re_parser *p, int depth) {
+  int n = re_node_new (p, RE_EMPTY, 0, 0);
 
-  ASSERT_UNBOXED("makeArray:1", length);
-  
-  __pre_gc ();
+  while (n >= 0 && *p->s && !(p->s[0] == '\\' && (p->s[1] == '|' || p->s[1] == ')'))) {
+    int m = re_piece (p, depth);
 
-  n = UNBOX(length);
-  r = (data*) alloc (sizeof(int) * (n+1));
+    if (m < 0) return -1;
 
-  r->tag = ARRAY_TAG | (n << 3);
+    n = re_node_new (p, RE_CAT, n, m);
+  }
+
+  return n;
+}
+
+static int re_alt (re_parser *p, int depth) {
+  int n = re_branch (p, depth);
+
+  while (n >= 0 && p->s[0] == '\\' && p->s[1] == '|') {
+    p->s += 2;
+
+    int m = re_branch (p, depth);
+
+    if (m < 0) return -1;
+
+    n = re_node_new (p, RE_ALT, n, m);
+  }
+
+  if (n >= 0 && depth == 0 && *p->s) return -1;
+
+  return n;
+}
+
+static void re_union (unsigned *dst, unsigned *src) {
+  int i;
+
+  for (i = 0; i < RE_WORDS; i++) dst[i] |= src[i];
+}
+
+static void re_follow (re_dfa *dfa, unsigned *from, unsigned *to) {
+  int p;
+
+  for (p = 0; p < dfa->npos; p++)
+    if (RE_SET_HAS(from, p)) re_union (dfa->follow[p], to);
+}
+
+/* Computes nullable/first/last bottom-up (children always precede parents)
+   and fills in the follow sets of the position automaton */
+static void re_analyze (re_parser *p) {
+  re_dfa *dfa = p->dfa;
+  int     i;
+
+  for (i = 0; i < p->nnodes; i++) {
+    re_node *n = &p->nodes[i], *l = &p->nodes[n->left], *r = &p->nodes[n->right];
+
+    switch (n->kind) {
+    case RE_EMPTY:
+      n->nullable = 1;
+      break;
+
+    case RE_CHARS:
+      RE_SET_ADD(n->first, n->left);
+      RE_SET_ADD(n->last , n->left);
+      break;
+
+    case RE_CAT:
+      n->nullable = l->nullable && r->nullable;
+      re_union (n->first, l->first);
+      if (l->nullable) re_union (n->first, r->first);
+      re_union (n->last, r->last);
+      if (r->nullable) re_union (n->last, l->last);
+      re_follow (dfa, l->last, r->first);
+      break;
+
+    case RE_ALT:
+      n->nullable = l->nullable || r->nullable;
+      re_union (n->first, l->first); re_union (n->first, r->first);
+      re_union (n->last , l->last ); re_union (n->last , r->last );
+      break;
+
+    case RE_STAR:
+    case RE_PLUS:
+    case RE_OPT:
+      n->nullable = n->kind == RE_PLUS ? l->nullable : 1;
+      re_union (n->first, l->first);
+      re_union (n->last , l->last );
+      if (n->kind != RE_OPT) re_follow (dfa, l->last, l->first);
+      break;
+    }
+  }
+}
+
+static re_dfa *re_dfa_create (char *pattern) {
+  re_parser p;
+  re_node  *root;
+  int       r;
+
+  p.s      = (unsigned char*) pattern;
+  p.dfa    = (re_dfa*) calloc (1, sizeof (re_dfa));
+  p.nodes  = (re_node*) malloc (RE_MAX_NODES * sizeof (re_node));
+  p.nnodes = 0;
+
+  if (p.dfa == NULL || p.nodes == NULL) failure ("regexp: out of memory\n");
+
+  if ((r = re_alt (&p, 0)) < 0) {
+    free (p.nodes);
+    free (p.dfa);
+    return NULL;
+  }
+
+  re_analyze (&p);
+
+  root = &p.nodes[r];
+
+  memcpy (p.dfa->follow[p.dfa->npos], root->first, sizeof (root->first));
+  memcpy (p.dfa->final, root->last, sizeof (root->last));
+
+  if (root->nullable) RE_SET_ADD(p.dfa->final, p.dfa->npos);
+
+  free (p.nodes);
+
+  return p.dfa;
+}
+
+static unsigned re_hash (unsigned *set) {
+  unsigned h = 0;
+  int      i;
+
+  for (i = 0; i < RE_WORDS; i++) h = h * 31 + set[i];
+
+  return h;
+}
+
+static void re_flush (re_dfa *dfa) {
+  int i;
+
+  dfa->nstates = 0;
+
+  for (i = 0; i < 2 * RE_MAX_STATES; i++) dfa->index[i] = -1;
+}
+
+/* Returns the number of the state for a given set of positions, creating
+   it if needed */
+static int re_state_of (re_dfa *dfa, unsigned *set) {
+  unsigned h = re_hash (set) & (2 * RE_MAX_STATES - 1);
+  int      i, n;
+
+  if (dfa->index == NULL) {
+    if ((dfa->index = (int*) malloc (2 * RE_MAX_STATES * sizeof (int))) == NULL)
+      failure ("regexp: out of memory\n");
 
-  memset (r->contents, 0, n * sizeof(int));
+    re_flush (dfa);
+  }
+
+  for (; (n = dfa->index[h]) >= 0; h = (h + 1) & (2 * RE_MAX_STATES - 1))
+    if (memcmp (dfa->states[n].set, set, RE_WORDS * sizeof (unsigned)) == 0) return n;
+
+  if (dfa->nstates == dfa->capacity) {
+    dfa->capacity = dfa->capacity ? 2 * dfa->capacity : 16;
+    dfa->states   = (re_state*) realloc (dfa->states, dfa->capacity * sizeof (re_state));
+
+    if (dfa->states == NULL) failure ("regexp: out of memory\n");
+  }
+
+  re_state *s = &dfa->states[n = dfa->nstates++];
+
+  memcpy (s->set, set, sizeof (s->set));
+
+  s->accept = 0;
+
+  for (i = 0; i < RE_WORDS; i++)
+    if (set[i] & dfa->final[i]) s->accept = 1;
+
+  for (i = 0; i < 256; i++) s->trans[i] = RE_UNKNOWN;
+
+  dfa->index[h] = n;
+
+  return n;
+}
+
+static int re_initial (re_dfa *dfa) {
+  unsigned set[RE_WORDS] = {0};
+
+  RE_SET_ADD(set, dfa->npos);
+
+  return re_state_of (dfa, set);
+}
+
+/* Computes the transition from *state on c. When the state limit is
+   reached the DFA is flushed and *state is re-created first */
+static int re_step (re_dfa *dfa, int *state, unsigned char c) {
+  unsigned next[RE_WORDS] = {0};
+  int      p, q, empty = 1, n;
+
+  if (dfa->nstates >= RE_MAX_STATES - 1) {
+    unsigned current[RE_WORDS];
+
+    memcpy (current, dfa->states[*state].set, sizeof (current));
+    re_flush (dfa);
+    *state = re_state_of (dfa, current);
+  }
+
+  for (p = 0; p <= dfa->npos; p++)
+    if (RE_SET_HAS(dfa->states[*state].set, p))
+      for (q = 0; q < dfa->npos; q++)
+        if (RE_SET_HAS(dfa->follow[p], q) && RE_SET_HAS(dfa->chars[q], c)) {
+          RE_SET_ADD(next, q);
+          empty = 0;
+        }
+
+  n = empty ? RE_DEAD : re_state_of (dfa, next);
+
+  return dfa->states[*state].trans[c] = n;
+}
+
+static int re_dfa_match (re_dfa *dfa, unsigned char *s, int len, int pos) {
+  int state = re_initial (dfa), i, res;
+
+  res = dfa->states[state].accept ? 0 : -1;
+
+  for (i = pos; i < len; i++) {
+    int next = dfa->states[state].trans[s[i]];
+
+    if (next == RE_UNKNOWN) next = re_step (dfa, &state, s[i]);
+    if (next == RE_DEAD) break;
+
+    state = next;
+
+    if (dfa->states[state].accept) res = i + 1 - pos;
+  }
+
+  return res;
+}
+
+static inline void re_enter (void) {
+  if (rt->par_active) pthread_mutex_lock (&rt->re_lock);
+}
+
+static inline void re_leave (void) {
+  if (rt->par_active) pthread_mutex_unlock (&rt->re_lock);
+}
+
+static regexp *re_cached (char *pattern) {
+  unsigned    h = 0;
+  char       *c;
+  const char *err;
+  regexp     *r;
+
+  for (c = pattern; *c; c++) h = h * 31 + (unsigned char) *c;
+
+  h %= RE_CACHE_SIZE;
+
+  if (rt->re_cache == NULL && (rt->re_cache = (regexp**) calloc (RE_CACHE_SIZE, sizeof (regexp*))) == NULL)
+    failure ("regexp: out of memory\n");
+
+  for (r = rt->re_cache[h]; r; r = r->next)
+    if (strcmp (r->pattern, pattern) == 0) return r;
+
+  r = (regexp*) calloc (1, sizeof (regexp));
+
+  if (r == NULL) failure ("regexp: out of memory\n");
+
+  if ((err = re_compile_pattern (pattern, strlen (pattern), &r->gnu)) != NULL) {
+    failure ("regexp: %s in \"%s\"\n", err, pattern);
+  }
+
+  r->pattern  = strdup (pattern);
+  r->dfa      = re_dfa_create (pattern);
+  r->next     = rt->re_cache[h];
+  rt->re_cache[h] = r;
+
+  return r;
+}
+
+extern regexp *Lregexp (char *pattern) {
+  regexp *r;
   
-  __post_gc ();
+  ASSERT_STRING("regexp:1", pattern);
 
-  return r->contents;
+  re_enter ();
+  r = re_cached (pattern);
+  re_leave ();
+
+  return r;
 }
 
-extern void* LmakeString (int length) {
-  int   n = UNBOX(length);
-  data *r;
+extern word LregexpMatch (regexp *r, char *s, word pos) {
+  int len = LEN(TO_DATA(s)->tag), n;
 
-  ASSERT_UNBOXED("makeString", length);
+  ASSERT_BOXED("regexpMatch:1", r);
+  ASSERT_STRING("regexpMatch:2", s);
+  ASSERT_UNBOXED("regexpMatch:3", pos);
+
+  re_enter ();
   
-  __pre_gc () ;
+  if (r->dfa && UNBOX(pos) >= 0 && UNBOX(pos) <= len)
+    n = re_dfa_match (r->dfa, (unsigned char*) s, len, UNBOX(pos));
+  else
+    n = re_match (&r->gnu, s, len, UNBOX(pos), 0);
+
+  re_leave ();
   
-  r = (data*) alloc (n + 1 + sizeof (int));
+  return BOX (n);
+}
 
-  r->tag = STRING_TAG | (n << 3);
+/* Matcher cursors.
 
-  __post_gc();
+   A cursor is an array [buf, lines, pos], where lines holds the
+   positions at which the lines of buf start. Shifting a cursor is a
+   single allocation; line and column numbers are computed on demand by
+   a binary search over lines.
+*/
+
+static void* matcher_cursor (void **buf, void **lines, word pos) {
+  data *r;
   
+  push_extra_root (buf);
+  push_extra_root (lines);
+  r = (data*) alloc (sizeof (word) * 4);
+  pop_extra_root (lines);
+  pop_extra_root (buf);
+
+  r->tag = ARRAY_TAG | (3 << 3);
+
+  ((word*) r->contents)[0] = (word) *buf;
+  ((word*) r->contents)[1] = (word) *lines;
+  ((word*) r->contents)[2] = pos;
+
   return r->contents;
 }
 
-extern void* Bstring (void *p) {
-  int   n = strlen (p);
-  data *s = NULL;
+static int matcher_line (word *m) {
+  data *lines = TO_DATA(m[1]);
+  int   pos   = UNBOX(m[2]), l = 0, r = LEN(lines->tag);
+
+  /* the last line starting at or before pos */
+  while (r - l > 1) {
+    int k = (l + r) / 2;
+
+    if (UNBOX(((word*) lines->contents)[k]) <= pos) l = k;
+    else r = k;
+  }
+
+  return l;
+}
+
+extern void* LmatcherInit (void *buf) {
+  char *s = (char*) buf, *p, *end = s + LEN(TO_DATA(buf)->tag);
+  int   n = 1, i;
+  data *lines;
+  void *r;
+
+  ASSERT_STRING("matcherInit:1", buf);
+
+  for (p = s; (p = memchr (p, '\n', end - p)) != NULL; p++) n++;
+
+  __pre_gc ();
+
+  push_extra_root (&buf);
+  lines = (data*) alloc (sizeof (word) * (n + 1));
+  pop_extra_root (&buf);
+
+  lines->tag = ARRAY_TAG | (n << 3);
+  ((word*) lines->contents)[0] = BOX(0);
+
+  s   = (char*) buf;
+  end = s + LEN(TO_DATA(buf)->tag);
   
+  for (p = s, i = 1; (p = memchr (p, '\n', end - p)) != NULL; p++)
+    ((word*) lines->contents)[i++] = BOX(p - s + 1);
+
+  r = lines->contents;
+  r = matcher_cursor (&buf, &r, BOX(0));
+
+  __post_gc ();
+
+  return r;
+}
+
+extern void* LmatcherShift (void *m, word n) {
+  void *buf, *lines, *r;
+  
+  ASSERT_BOXED("matcherShift:1", m);
+  ASSERT_UNBOXED("matcherShift:2", n);
+
   __pre_gc ();
+
+  buf   = (void*) ((word*) m)[0];
+  lines = (void*) ((word*) m)[1];
+  r     = matcher_cursor (&buf, &lines, BOX(UNBOX(((word*) m)[2]) + UNBOX(n)));
+
+  __post_gc ();
+
+  return r;
+}
+
+extern word LmatcherLine (void *m) {
+  ASSERT_BOXED("matcherLine:1", m);
+  
+  return BOX(matcher_line ((word*) m) + 1);
+}
+
+extern word LmatcherCol (void *m) {
+  word *mm    = (word*) m;
+  char *buf   = (char*) mm[0];
+  int   pos   = UNBOX(mm[2]), col = 1, i;
+
+  ASSERT_BOXED("matcherCol:1", m);
+
+  for (i = UNBOX(((word*) TO_DATA(mm[1])->contents)[matcher_line (mm)]); i < pos; i++)
+    col += buf[i] == '\t' ? 8 : 1;
+
+  return BOX(col);
+}
+
+extern void* Bstring (void*);
+
+void *Lclone (void *p) {
+  data *obj;
+  sexp *sobj;
+  void* res;
+  int n;
 #ifdef DEBUG_PRINT
+  register int * ebp asm ("ebp");
   indent++; print_indent ();
-  printf ("Bstring: call LmakeString %s %p %p %p %i\n", p, &p, p, s, n);
-  fflush(stdout);
+  printf ("Lclone arg: %p %p\n", &p, p); fflush (stdout);
 #endif
-  push_extra_root (&p);
-  s = LmakeString (BOX(n));  
-  pop_extra_root(&p);
+  __pre_gc ();
+  
+  if (UNBOXED(p)) return p;
+  else {
+    data *a = TO_DATA(p);
+    int t   = TAG(a->tag), l = LEN(a->tag);
+
+    push_extra_root (&p);
+    switch (t) {
+    case STRING_TAG:
 #ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("\tBstring: call strncpy: %p %p %p %i\n", &p, p, s, n); fflush(stdout);
+      print_indent ();
+      printf ("Lclone: string1 &p=%p p=%p\n", &p, p); fflush (stdout);
 #endif
-  strncpy ((char*)s, p, n + 1);
+      res = Bstring (TO_DATA(p)->contents);
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("Lclone: string2 %p %p\n", &p, p); fflush (stdout);
+#endif
+      break;
+
+    case ARRAY_TAG:      
+    case CLOSURE_TAG:
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("Lclone: closure or array &p=%p p=%p ebp=%p\n", &p, p, ebp); fflush (stdout);
+#endif
+      obj = (data*) alloc (sizeof(word) * (l+1));
+      memcpy (obj, TO_DATA(p), sizeof(word) * (l+1));
+      res = (void*) (obj->contents);
+      break;
+      
+    case SEXP_TAG:
+#ifdef DEBUG_PRINT
+      print_indent (); printf ("Lclone: sexp\n"); fflush (stdout);
+#endif
+      sobj = (sexp*) alloc (sizeof(word) * (l+2));
+      memcpy (sobj, TO_SEXP(p), sizeof(word) * (l+2));
+      res = (void*) sobj->contents.contents;
+      break;
+       
+    default:
+      failure ("invalid tag %d in clone *****\n", t);
+    }
+    pop_extra_root (&p);
+  }
+#ifdef DEBUG_PRINT
+  print_indent (); printf ("Lclone ends1\n"); fflush (stdout);
+#endif
+
+  __post_gc ();
 #ifdef DEBUG_PRINT
   print_indent ();
-  printf ("\tBstring: ends\n"); fflush(stdout);
+  printf ("Lclone ends2\n"); fflush (stdout);
   indent--;
 #endif
-  __post_gc ();
-  
-  return s;
+  return res;
 }
 
-extern void* Lstringcat (void *p) {
-  void *s;
+# define HASH_DEPTH 3
+# define HASH_APPEND(acc, x) (((acc + (unsigned) (word) x) << (WORD_SIZE / 2)) | ((acc + (unsigned) (word) x) >> (WORD_SIZE / 2)))
 
-  /* ASSERT_BOXED("stringcat", p); */
-  
-  __pre_gc ();
-  
-  createStringBuf ();
-  stringcat (p);
+int inner_hash (int depth, unsigned acc, void *p) {
+  if (depth > HASH_DEPTH) return acc;
 
-  push_extra_root(&p);
-  s = Bstring (stringBuf.contents);
-  pop_extra_root(&p);
+  if (UNBOXED(p)) return HASH_APPEND(acc, UNBOX(p));
+  else if (IS_VALID_POINTER(p)) {
+    data *a = TO_DATA(p);
+    int t = TAG(a->tag), l = LEN(a->tag), i;
+
+    acc = HASH_APPEND(acc, t);
+    acc = HASH_APPEND(acc, l);    
+
+    switch (t) {
+    case STRING_TAG: {
+      char *p = a->contents;
+
+      while (*p) {
+        int n = (int) *p++;
+	acc = HASH_APPEND(acc, n);
+      }
+
+      return acc;
+    }
+      
+    case CLOSURE_TAG:
+      acc = HASH_APPEND(acc, ((void**) a->contents)[0]);
+      i = 1;
+      break;
+      
+    case ARRAY_TAG:
+      i = 0;
+      break;
+
+    case SEXP_TAG: {
+#ifndef DEBUG_PRINT
+      int ta = TO_SEXP(p)->tag;
+#else
+      int ta = GET_SEXP_TAG(TO_SEXP(p)->tag);
+#endif
+      acc = HASH_APPEND(acc, ta);
+      i = 0;
+      break;
+    }
+
+    default:
+      failure ("invalid tag %d in hash *****\n", t);
+    }
+
+    for (; i<l; i++) 
+      acc = inner_hash (depth+1, acc, ((void**) a->contents)[i]);
+
+    return acc;
+  }
+  else return HASH_APPEND(acc, p);
+}
+
+extern void* LstringInt (char *b) {
+  int n;
+  sscanf (b, "%d", &n);
+  return (void*) BOX(n);
+}
+
+extern word Lhash (void *p) {
+  return BOX(0x3fffff & inner_hash (0, 0, p));
+}
+
+extern word LflatCompare (void *p, void *q) {
+  if (UNBOXED(p)) {
+    if (UNBOXED(q)) {
+      return BOX (UNBOX(p) - UNBOX(q));
+    }
+    
+    return -1;
+  }
+  else if (~UNBOXED(q)) {
+    return BOX(p - q);
+  }
+  else BOX(1);
+}
+
+/* Structural comparison is iterative: the fields which are still to be
+   compared are kept on an explicit stack, and the last field of each object
+   is compared in place of the object itself (thus long lists do not grow the
+   stack) */
+typedef struct {
+  void **a;
+  void **b;
+  int    i;
+  int    n;
+} compare_frame;
+
+# define COMPARE_STACK_INIT 64
+
+/* Compares the headers of two values; returns a non-zero difference, or zero
+   and the fields still to be compared */
+static word compare_shallow (void *p, void *q, void ***fa, void ***fb, int *n) {
+  *n = 0;
+  
+  if (p == q) return 0;
+ 
+  if (UNBOXED(p)) {
+    if (UNBOXED(q)) return UNBOX(p) - UNBOX(q);
+    else return -1;
+  }
+  else if (UNBOXED(q)) return 1;
+  else if (IS_VALID_POINTER(p)) {
+    if (IS_VALID_POINTER(q)) {
+      data *a = TO_DATA(p), *b = TO_DATA(q);
+      int ta = TAG(a->tag), tb = TAG(b->tag);
+      int la = LEN(a->tag), lb = LEN(b->tag);
+    
+      if (ta != tb) return ta - tb;
+      
+      switch (ta) {
+      case STRING_TAG: {
+        int c = memcmp (a->contents, b->contents, la < lb ? la : lb);
+        
+        return c ? c : la - lb;
+      }
+      
+      case CLOSURE_TAG:
+        if (((void**) a->contents)[0] != ((void**) b->contents)[0])
+          return (word) ((void**) a->contents)[0] - (word) ((void**) b->contents)[0];
+        if (la != lb) return la - lb;
+        *fa = (void**) a->contents + 1;
+        *fb = (void**) b->contents + 1;
+        *n  = la - 1;
+        return 0;
+      
+      case ARRAY_TAG:
+        if (la != lb) return la - lb;
+        break;
+
+      case SEXP_TAG: {
+#ifndef DEBUG_PRINT
+        int ta = TO_SEXP(p)->tag, tb = TO_SEXP(q)->tag;      
+#else
+        int ta = GET_SEXP_TAG(TO_SEXP(p)->tag), tb = GET_SEXP_TAG(TO_SEXP(q)->tag);
+#endif      
+        if (ta != tb) return ta - tb;
+        if (la != lb) return la - lb;
+        break;
+      }
+
+      default:
+        failure ("invalid tag %d in compare *****\n", ta);
+      }
+
+      *fa = (void**) a->contents;
+      *fb = (void**) b->contents;
+      *n  = la;
+      return 0;
+    }
+    else return -1;
+  }
+  else if (IS_VALID_POINTER(q)) return 1;
+  else return (word) p - (word) q;
+}
+
+/* Takes the next pair of fields to compare off the stack; returns 0 if
+   there is none */
+static int compare_next (compare_frame *stack, int *sp, void **p, void **q) {
+  while (*sp > 0) {
+    compare_frame *f = &stack[*sp-1];
+      
+    while (f->i < f->n && f->a[f->i] == f->b[f->i]) f->i++;
+
+    if (f->i < f->n) {
+      *p = f->a[f->i];
+      *q = f->b[f->i];
+      if (++f->i == f->n) (*sp)--;
+      return 1;
+    }
+
+    (*sp)--;
+  }
+
+  return 0;
+}
+
+extern word Lcompare (void *p, void *q) {
+  compare_frame  init [COMPARE_STACK_INIT], *stack = init;
+  int            sp = 0, size = COMPARE_STACK_INIT;
+  word           res = 0;
+  void         **fa, **fb;
+  int            n, i;
+  
+  for (;;) {
+    if ((res = compare_shallow (p, q, &fa, &fb, &n)) != 0) break;
+    
+    /* identical words are equal whatever they are */
+    for (i = 0; i < n && fa[i] == fb[i]; i++);
+
+    if (i < n) {
+      /* two different integers decide at once: a flat array of integers is
+         compared in one pass over its words without using the stack */
+      if (UNBOXED(fa[i]) && UNBOXED(fb[i])) {
+        res = UNBOX(fa[i]) - UNBOX(fb[i]);
+        break;
+      }
+      
+      if (i < n-1) {
+        if (sp == size) {
+          compare_frame *s = (compare_frame*) malloc (2 * size * sizeof (compare_frame));
+          
+          if (s == NULL) failure ("compare: out of memory\n");
+          
+          memcpy (s, stack, size * sizeof (compare_frame));
+          if (stack != init) free (stack);
+          stack = s;
+          size *= 2;
+        }
+
+        stack[sp].a = fa;
+        stack[sp].b = fb;
+        stack[sp].i = i+1;
+        stack[sp].n = n;
+        sp++;
+      }
+
+      p = fa[i];
+      q = fb[i];
+      continue;
+    }
+
+    if (! compare_next (stack, &sp, &p, &q)) break;
+  }
+
+  if (stack != init) free (stack);
+  
+  return BOX(res);
+}
+
+extern void* Belem (void *p, word i) {
+  data *a = (data *)BOX(NULL);
+
+  ASSERT_BOXED(".elem:1", p);
+  ASSERT_UNBOXED(".elem:2", i);
+  
+  a = TO_DATA(p);
+  i = UNBOX(i);
+  
+  if (TAG(a->tag) == STRING_TAG) {
+    return (void*) BOX(a->contents[i]);
+  }
+  
+  return (void*) ((word*) a->contents)[i];
+}
+
+extern void* LmakeArray (word length) {
+  data *r;
+  int n;
+
+  ASSERT_UNBOXED("makeArray:1", length);
+  
+  __pre_gc ();
+
+  n = UNBOX(length);
+  r = (data*) alloc (sizeof(word) * (n+1));
+
+  r->tag = ARRAY_TAG | (n << 3);
+
+  memset (r->contents, 0, n * sizeof(word));
+  
+  __post_gc ();
+
+  return r->contents;
+}
+
+extern void* LmakeString (word length) {
+  int   n = UNBOX(length);
+  data *r;
+
+  ASSERT_UNBOXED("makeString", length);
+  
+  __pre_gc () ;
+  
+  r = (data*) alloc (n + 1 + sizeof (word));
+
+  r->tag = STRING_TAG | (n << 3);
+
+  __post_gc();
+  
+  return r->contents;
+}
+
+extern void* Bstring (void *p) {
+  int   n = strlen (p);
+  data *s = NULL;
+  
+  __pre_gc ();
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+  printf ("Bstring: call LmakeString %s %p %p %p %i\n", p, &p, p, s, n);
+  fflush(stdout);
+#endif
+  push_extra_root (&p);
+  s = LmakeString (BOX(n));  
+  pop_extra_root(&p);
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("\tBstring: call strncpy: %p %p %p %i\n", &p, p, s, n); fflush(stdout);
+#endif
+  strncpy ((char*)s, p, n + 1);
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("\tBstring: ends\n"); fflush(stdout);
+  indent--;
+#endif
+  __post_gc ();
+  
+  return s;
+}
+
+extern void* Lstringcat (void *p) {
+  void *s;
+
+  /* ASSERT_BOXED("stringcat", p); */
+  
+  __pre_gc ();
+  
+  createStringBuf ();
+  stringcat (p);
+
+  push_extra_root(&p);
+  s = Bstring (stringBuf.contents);
+  pop_extra_root(&p);
   
   deleteStringBuf ();
 
@@ -980,911 +1938,3661 @@ extern void* Lstring (void *p) {
   createStringBuf ();
   printValue (p);
 
-  push_extra_root(&p);
-  s = Bstring (stringBuf.contents);
-  pop_extra_root(&p);
-  
-  deleteStringBuf ();
+  push_extra_root(&p);
+  s = Bstring (stringBuf.contents);
+  pop_extra_root(&p);
+  
+  deleteStringBuf ();
+
+  __post_gc ();
+
+  return s;
+}
+
+/* Constructor arguments are copied into a rooted local array before
+   allocation: on x86-64 variadic arguments come in registers and are not
+   seen by the stack scan */
+extern void* Bclosure (word bn, void *entry, ...) {
+  va_list args; 
+  int     i;
+  data    *r; 
+  int     n = UNBOX(bn);
+  word    vals [n + 1];
+  
+  __pre_gc ();
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+  printf ("Bclosure: create n = %d\n", n); fflush(stdout);
+#endif
+  va_start(args, entry);
+  
+  for (i = 0; i<n; i++) vals[i] = va_arg(args, word);
+  
+  va_end(args);
+
+  push_roots (vals, n);
+  r = (data*) alloc (sizeof(word) * (n+2));
+  pop_roots ();
+  
+  r->tag = CLOSURE_TAG | ((n + 1) << 3);
+  ((void**) r->contents)[0] = entry;
+  memcpy ((word*) r->contents + 1, vals, sizeof(word) * n);
+  
+  __post_gc();
+
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("Bclosure: ends\n", n); fflush(stdout);
+  indent--;
+#endif
+
+  return r->contents;
+}
+
+extern void* Barray (word bn, ...) {
+  va_list args; 
+  int     i; 
+  data    *r; 
+  int     n = UNBOX(bn);
+  word    vals [n + 1];
+    
+  __pre_gc ();
+  
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+  printf ("Barray: create n = %d\n", n); fflush(stdout);
+#endif
+  va_start(args, bn);
+  
+  for (i = 0; i<n; i++) vals[i] = va_arg(args, word);
+  
+  va_end(args);
+
+  push_roots (vals, n);
+  r = (data*) alloc (sizeof(word) * (n+1));
+  pop_roots ();
+
+  r->tag = ARRAY_TAG | (n << 3);
+  memcpy (r->contents, vals, sizeof(word) * n);
+  
+  __post_gc();
+#ifdef DEBUG_PRINT
+  indent--;
+#endif
+  return r->contents;
+}
+
+extern void* Bsexp (word bn, ...) {
+  va_list args; 
+  int     i;    
+  sexp   *r;  
+  data   *d;  
+  int     n = UNBOX(bn); 
+  word    vals [n];
+
+  __pre_gc () ;
+  
+  va_start(args, bn);
+  
+  for (i=0; i<n; i++) vals[i] = va_arg(args, word);
+
+  va_end(args);
+  
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+  printf("Bsexp: allocate %zu!\n",sizeof(word) * (n+1)); fflush (stdout);
+#endif
+  push_roots (vals, n-1);
+  r = (sexp*) alloc (sizeof(word) * (n+1));
+  pop_roots ();
+  d = &(r->contents);
+    
+  d->tag = SEXP_TAG | ((n-1) << 3);
+  memcpy (d->contents, vals, sizeof(word) * (n-1));
+  
+  r->tag = UNBOX(vals[n-1]);
+
+#ifdef DEBUG_PRINT
+  r->tag = SEXP_TAG | ((r->tag) << 3);
+  print_indent ();
+  printf("Bsexp: ends\n"); fflush (stdout);
+  indent--;
+#endif
+
+  __post_gc();
+
+  return d->contents;
+}
+
+extern word Btag (void *d, word t, word n) {
+  data *r; 
+  
+  if (UNBOXED(d)) return BOX(0);
+  else {
+    r = TO_DATA(d);
+#ifndef DEBUG_PRINT
+    return BOX(TAG(r->tag) == SEXP_TAG && TO_SEXP(d)->tag == UNBOX(t) && LEN(r->tag) == UNBOX(n));
+#else
+    return BOX(TAG(r->tag) == SEXP_TAG &&
+               GET_SEXP_TAG(TO_SEXP(d)->tag) == UNBOX(t) && LEN(r->tag) == UNBOX(n));
+#endif
+  }
+}
+
+extern word Barray_patt (void *d, word n) {
+  data *r; 
+  
+  if (UNBOXED(d)) return BOX(0);
+  else {
+    r = TO_DATA(d);
+    return BOX(TAG(r->tag) == ARRAY_TAG && LEN(r->tag) == UNBOX(n));
+  }
+}
+
+extern word Bstring_patt (void *x, void *y) {
+  data *rx = (data *) BOX (NULL),
+       *ry = (data *) BOX (NULL);
+  
+  ASSERT_STRING(".string_patt:2", y);
+      
+  if (UNBOXED(x)) return BOX(0);
+  else {
+    rx = TO_DATA(x); ry = TO_DATA(y);
+
+    if (TAG(rx->tag) != STRING_TAG) return BOX(0);
+    
+    return BOX(strcmp (rx->contents, ry->contents) == 0 ? 1 : 0);
+  }
+}
+
+extern word Bclosure_tag_patt (void *x) {
+  if (UNBOXED(x)) return BOX(0);
+  
+  return BOX(TAG(TO_DATA(x)->tag) == CLOSURE_TAG);
+}
+
+extern word Bboxed_patt (void *x) {
+  return BOX(UNBOXED(x) ? 0 : 1);
+}
+
+extern word Bunboxed_patt (void *x) {
+  return BOX(UNBOXED(x) ? 1 : 0);
+}
+
+extern word Barray_tag_patt (void *x) {
+  if (UNBOXED(x)) return BOX(0);
+  
+  return BOX(TAG(TO_DATA(x)->tag) == ARRAY_TAG);
+}
+
+extern word Bstring_tag_patt (void *x) {
+  if (UNBOXED(x)) return BOX(0);
+  
+  return BOX(TAG(TO_DATA(x)->tag) == STRING_TAG);
+}
+
+extern word Bsexp_tag_patt (void *x) {
+  if (UNBOXED(x)) return BOX(0);
+  
+  return BOX(TAG(TO_DATA(x)->tag) == SEXP_TAG);
+}
+
+static void inc_barrier (void *p, size_t i);
+
+extern void* Bsta (void *v, word i, void *x) {
+  if (UNBOXED(i)) {
+    ASSERT_BOXED(".sta:3", x);
+    //    ASSERT_UNBOXED(".sta:2", i);
+
+    if (rt->inc_phase) inc_barrier (x, UNBOX(i));
+  
+    if (TAG(TO_DATA(x)->tag) == STRING_TAG)((char*) x)[UNBOX(i)] = (char) UNBOX(v);
+    else ((word*) x)[UNBOX(i)] = (word) v;
+
+    return v;
+  }
+
+  * (void**) x = v;
+
+  return v;
+}
+
+/* Formats Lama arguments into the string buffer: every conversion takes
+   one word, which is unboxed if it is an integer; integer conversions are
+   widened to the size of a word */
+static void printFormatted (char *s, va_list args) {
+  char spec [32];
+  
+  while (*s) {
+    char *b = s;
+    int   n;
+    word  a;
+    
+    if (*s != '%') {
+      while (*s && *s != '%') s++;
+      printStringBuf ("%.*s", (int) (s - b), b);
+      continue;
+    }
+    
+    if (s[1] == '%') {
+      printStringBuf ("%%");
+      s += 2;
+      continue;
+    }
+
+    s++;
+    while (*s && strchr ("#0- +'.0123456789hlLqjzt", *s)) s++;
+    if (*s == 0) {
+      printStringBuf ("%s", b);
+      break;
+    }
+
+    n = s - b;
+    while (n > 1 && strchr ("hlLqjzt", b[n-1])) n--;
+    if (n > (int) sizeof (spec) - 3) n = sizeof (spec) - 3;
+    memcpy (spec, b, n);
+    
+    a = va_arg (args, word);
+    if (UNBOXED(a)) a = UNBOX(a);
+    
+    if (strchr ("diouxXc", *s)) {
+      if (*s != 'c') spec[n++] = 'l';
+      spec[n++] = *s;
+      spec[n]   = 0;
+      if (*s == 'c') printStringBuf (spec, (int) a);
+      else           printStringBuf (spec, (long) a);
+    }
+    else {
+      spec[n++] = *s;
+      spec[n]   = 0;
+      printStringBuf (spec, (void*) a);
+    }
+    
+    s++;
+  }
+}
+
+extern void Lfailure (char *s, ...) {
+  va_list args;
+  
+  va_start (args, s);
+  createStringBuf ();
+  printFormatted  (s, args);
+  va_end   (args);
+  failure  ("%s", stringBuf.contents);
+}
+
+extern void Bmatch_failure (void *v, char *fname, word line, word col) {
+  createStringBuf ();
+  printValue (v);
+  failure ("match failure at %s:%d:%d, value '%s'\n",
+	   fname, UNBOX(line), UNBOX(col), stringBuf.contents);
+}
+
+extern void* /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
+  data *da = (data*) BOX (NULL);
+  data *db = (data*) BOX (NULL);
+  data *d  = (data*) BOX (NULL);
+
+  ASSERT_STRING("++:1", a);
+  ASSERT_STRING("++:2", b);
+  
+  da = TO_DATA(a);
+  db = TO_DATA(b);
+
+  __pre_gc () ;
+
+  push_extra_root (&a);
+  push_extra_root (&b);
+  d  = (data *) alloc (sizeof(word) + LEN(da->tag) + LEN(db->tag) + 1);
+  pop_extra_root (&b);
+  pop_extra_root (&a);
+
+  da = TO_DATA(a);
+  db = TO_DATA(b);
+  
+  d->tag = STRING_TAG | ((LEN(da->tag) + LEN(db->tag)) << 3);
+
+  strncpy (d->contents               , da->contents, LEN(da->tag));
+  strncpy (d->contents + LEN(da->tag), db->contents, LEN(db->tag));
+  
+  d->contents[LEN(da->tag) + LEN(db->tag)] = 0;
+
+  __post_gc();
+  
+  return d->contents;
+}
+
+extern void* Lsprintf (char * fmt, ...) {
+  va_list args;
+  void *s;
+
+  ASSERT_STRING("sprintf:1", fmt);
+  
+  va_start (args, fmt);
+  
+  createStringBuf ();
+
+  printFormatted (fmt, args);
+  va_end (args);
+
+  __pre_gc ();
+
+  push_extra_root ((void**)&fmt);
+  s = Bstring (stringBuf.contents);
+  pop_extra_root ((void**)&fmt);
+
+  __post_gc ();
+  
+  deleteStringBuf ();
+
+  return s;
+}
+
+extern void* LgetEnv (char *var) {
+  char *e = getenv (var);
+  void *s;
+  
+  if (e == NULL)
+    return (void*) BOX(0);
+
+  __pre_gc ();
+
+  s = Bstring (e);
+
+  __post_gc ();
+
+  return s;
+}
+
+/* Output.
+
+   Unless it is a terminal, the standard output is fully buffered with a
+   large buffer. It is flushed at exit, before failure reports and child
+   processes, and by the "flush" builtin.
+*/
+
+# define OUT_BUFFER_SIZE (1 << 16)
+
+static int out_tty = 1;
+
+static void init_output (void) {
+  if (!(out_tty = isatty (STDOUT_FILENO)))
+    setvbuf (stdout, NULL, _IOFBF, OUT_BUFFER_SIZE);
+}
+
+/* Makes written data visible when the output is interactive */
+static inline void out_sync (void) {
+  if (out_tty) fflush (stdout);
+}
+
+extern void Lflush () {
+  fflush (stdout);
+}
+
+extern word Lsystem (char *cmd) {
+  fflush (stdout);
+  
+  return BOX (system (cmd));
+}
+
+extern void Lfprintf (FILE *f, char *s, ...) {
+  va_list args;
+  int     ok;
+
+  ASSERT_BOXED("fprintf:1", f);
+  ASSERT_STRING("fprintf:2", s);  
+  
+  va_start (args, s);
+  createStringBuf ();
+  printFormatted  (s, args);
+  va_end   (args);
+
+  ok = fwrite (stringBuf.contents, 1, stringBuf.ptr, f) == stringBuf.ptr;
+  deleteStringBuf ();
+  
+  if (! ok) {
+    failure ("fprintf (...): %s\n", strerror (errno));
+  }
+}
+
+extern void Lprintf (char *s, ...) {
+  va_list args;
+  int     ok;
+
+  ASSERT_STRING("printf:1", s);
+
+  va_start (args, s);
+  createStringBuf ();
+  printFormatted  (s, args);
+  va_end   (args);
+
+  ok = fwrite (stringBuf.contents, 1, stringBuf.ptr, stdout) == stringBuf.ptr;
+  deleteStringBuf ();
+  
+  if (! ok) {
+    failure ("printf (...): %s\n", strerror (errno));
+  }
+
+  out_sync ();
+}
+
+/* Buffered input.
+
+   Each file descriptor read by the runtime gets a buffer, filled with
+   read(2) in large chunks; lines are split with memchr and copied
+   directly into freshly allocated strings. Standard input is never read
+   through stdio, so the two never compete for the same bytes.
+*/
+
+# define IN_BUFFER_SIZE (1 << 16)
+
+typedef struct in_buffer {
+  int   fd;
+  char *buf;
+  int   size, start, end, eof;
+} in_buffer;
+
+/* The input buffers are not shared by the threads of a parallel operation
+   (see "Parallel array combinators"): the order of reads would be arbitrary
+   anyway */
+static void in_serial (void) {
+  if (rt->par_active) failure ("input can not be used in parallel array combinators\n");
+}
+
+static in_buffer *in_buffer_of (int fd) {
+  in_serial ();
+  
+  if (fd >= rt->in_buffers_size) {
+    int n = rt->in_buffers_size ? rt->in_buffers_size : 16;
+
+    while (n <= fd) n *= 2;
+
+    if ((rt->in_buffers = (in_buffer**) realloc (rt->in_buffers, n * sizeof (in_buffer*))) == NULL)
+      failure ("input: out of memory\n");
+
+    memset (rt->in_buffers + rt->in_buffers_size, 0, (n - rt->in_buffers_size) * sizeof (in_buffer*));
+    rt->in_buffers_size = n;
+  }
+
+  if (rt->in_buffers[fd] == NULL) {
+    in_buffer *b = (in_buffer*) calloc (1, sizeof (in_buffer));
+
+    if (b == NULL || (b->buf = (char*) malloc (IN_BUFFER_SIZE)) == NULL)
+      failure ("input: out of memory\n");
+
+    b->fd         = fd;
+    b->size       = IN_BUFFER_SIZE;
+    rt->in_buffers[fd] = b;
+  }
+
+  return rt->in_buffers[fd];
+}
+
+static void in_buffer_drop (int fd) {
+  in_serial ();
+  
+  if (fd < rt->in_buffers_size && rt->in_buffers[fd]) {
+    free (rt->in_buffers[fd]->buf);
+    free (rt->in_buffers[fd]);
+    rt->in_buffers[fd] = NULL;
+  }
+}
+
+/* Reads the next chunk after the buffered data, making room for it first;
+   returns the number of bytes read (0 at end of input) */
+static int in_fill (in_buffer *b) {
+  int n;
+
+  if (b->eof) return 0;
+
+  if (b->start == b->end) b->start = b->end = 0;
+
+  if (b->end == b->size) {
+    if (b->start > 0) {
+      memmove (b->buf, b->buf + b->start, b->end - b->start);
+      b->end  -= b->start;
+      b->start = 0;
+    }
+    else if ((b->buf = (char*) realloc (b->buf, b->size *= 2)) == NULL)
+      failure ("input: out of memory\n");
+  }
+
+  while ((n = read (b->fd, b->buf + b->end, b->size - b->end)) < 0)
+    if (errno != EINTR) failure ("input: %s\n", strerror (errno));
+
+  if (n == 0) b->eof = 1;
+
+  b->end += n;
+
+  return n;
+}
+
+static inline int in_peek (in_buffer *b) {
+  if (b->start == b->end && in_fill (b) == 0) return EOF;
+
+  return (unsigned char) b->buf[b->start];
+}
+
+/* Returns the next line (without the newline) as a string, or 0 at end of input */
+static void* in_line (in_buffer *b) {
+  int   scan = 0, len;
+  char *nl;
+  data *r;
+
+  for (;;) {
+    if ((nl = memchr (b->buf + b->start + scan, '\n', b->end - b->start - scan)) != NULL) {
+      len = nl - (b->buf + b->start);
+      break;
+    }
+
+    scan = b->end - b->start;
+
+    if (in_fill (b) == 0) {
+      if ((len = b->end - b->start) == 0) return (void*) BOX (0);
+      break;
+    }
+  }
+
+  __pre_gc ();
+
+  r = (data*) alloc (len + 1 + sizeof (word));
+  r->tag = STRING_TAG | (len << 3);
+
+  memcpy (r->contents, b->buf + b->start, len);
+  r->contents[len] = 0;
+
+  b->start += nl ? len + 1 : len;
+
+  __post_gc ();
+
+  return r->contents;
+}
+
+/* Reads an integer as scanf ("%d") does; returns 0 if there is none */
+static int in_int (in_buffer *b, word *n) {
+  int  c, sign = 1;
+  word r = 0;
+
+  while ((c = in_peek (b)) != EOF && isspace (c)) b->start++;
+
+  if (c == '-' || c == '+') {
+    sign = c == '-' ? -1 : 1;
+    b->start++;
+    c = in_peek (b);
+  }
+
+  if (c == EOF || !isdigit (c)) return 0;
+
+  do {
+    r = r * 10 + (c - '0');
+    b->start++;
+  } while ((c = in_peek (b)) != EOF && isdigit (c));
+
+  *n = sign * r;
+
+  return 1;
+}
+
+extern FILE* Lfopen (char *f, char *m) {
+  FILE* h;
+
+  ASSERT_STRING("fopen:1", f);
+  ASSERT_STRING("fopen:2", m);
+
+  h = fopen (f, m);
+  
+  if (h) {
+    setvbuf (h, NULL, _IOFBF, OUT_BUFFER_SIZE);
+    return h;
+  }
+
+  failure ("fopen (\"%s\", \"%s\"): %s, %s, %s\n", f, m, strerror (errno));
+}
+
+extern void Lfclose (FILE *f) {
+  ASSERT_BOXED("fclose", f);
+
+  in_buffer_drop (fileno (f));
+  fclose (f);
+}
+
+extern void* LreadLine () {
+  return in_line (in_buffer_of (STDIN_FILENO));
+}
+
+extern void* LfreadLine (FILE *f) {
+  ASSERT_BOXED("freadLine", f);
+
+  return in_line (in_buffer_of (fileno (f)));
+}
+
+/* Reads up to n integers from the standard input into an array;
+   the array is shorter if the input ends earlier. The integers are
+   collected aside, since the array has to be allocated with its exact
+   size: the heap is a sequence of whole objects */
+extern void* LreadInts (word n) {
+  in_buffer *b = in_buffer_of (STDIN_FILENO);
+  int        i, k = UNBOX(n), size = 0;
+  word      *xs = NULL, x;
+  data      *r;
+
+  ASSERT_UNBOXED("readInts:1", n);
+
+  if (k < 0) failure ("readInts: negative count %d\n", k);
+
+  for (i = 0; i < k && in_int (b, &x); i++) {
+    if (i == size && (xs = (word*) realloc (xs, (size = size ? 2 * size : 64) * sizeof (word))) == NULL)
+      failure ("readInts: out of memory\n");
+
+    xs[i] = BOX(x);
+  }
+
+  __pre_gc ();
+
+  r = (data*) alloc (sizeof (word) * (i + 1));
+  r->tag = ARRAY_TAG | (i << 3);
+
+  if (i > 0) memcpy (r->contents, xs, i * sizeof (word));
+
+  __post_gc ();
+
+  free (xs);
+
+  return r->contents;
+}
+
+extern void* Lfread (char *fname) {
+  FILE *f;
+
+  ASSERT_STRING("fread", fname);
+
+  f = fopen (fname, "r");
+  
+  if (f) {
+    if (fseek (f, 0l, SEEK_END) >= 0) {
+      long size = ftell (f);
+      void *s   = LmakeString (BOX(size));
+      
+      rewind (f);
+
+      if (fread (s, 1, size, f) == size) {
+	fclose (f);
+	return s;
+      }
+    }
+  }
+
+  failure ("fread (\"%s\"): %s\n", fname, strerror (errno));
+}
+
+extern void Lfwrite (char *fname, char *contents) {
+  FILE *f;
+
+  ASSERT_STRING("fwrite:1", fname);
+  ASSERT_STRING("fwrite:2", contents);
+  
+  f = fopen (fname, "w");
+
+  if (f) {
+    if (fwrite (contents, 1, LEN(TO_DATA(contents)->tag), f) < LEN(TO_DATA(contents)->tag));
+    else {
+      fclose (f);
+      return;
+    }
+  }
+
+  failure ("fwrite (\"%s\"): %s\n", fname, strerror (errno));
+}
+
+/* Reads up to n bytes from a file acquired by fopen; returns 0 at end of file.
+   Buffered bytes left by freadLine are taken first, the rest is read
+   directly into the resulting string. */
+extern void* LfreadChunk (FILE *f, word n) {
+  in_buffer *b;
+  int        k = UNBOX(n), len, m;
+  data      *r;
+
+  ASSERT_BOXED("freadChunk:1", f);
+  ASSERT_UNBOXED("freadChunk:2", n);
+
+  if (k < 0) failure ("freadChunk: negative size %d\n", k);
+
+  b = in_buffer_of (fileno (f));
+
+  __pre_gc ();
+
+  r   = (data*) alloc (k + 1 + sizeof (word));
+  len = b->end - b->start < k ? b->end - b->start : k;
+
+  memcpy (r->contents, b->buf + b->start, len);
+  b->start += len;
+
+  while (len < k && !b->eof) {
+    if ((m = read (b->fd, r->contents + len, k - len)) < 0) {
+      if (errno == EINTR) continue;
+      failure ("freadChunk: %s\n", strerror (errno));
+    }
+
+    if (m == 0) b->eof = 1;
+
+    len += m;
+  }
+
+  r->tag = STRING_TAG | (k << 3);
+
+  /* at the end of file the bytes read are copied into a string of the exact
+     size, since the heap is a sequence of whole objects */
+  if (len > 0 && len < k) {
+    void *s = r->contents;
+
+    push_extra_root (&s);
+    r = (data*) alloc (len + 1 + sizeof (word));
+    pop_extra_root (&s);
+
+    r->tag = STRING_TAG | (len << 3);
+    memcpy (r->contents, s, len);
+  }
+
+  r->contents[len] = 0;
+
+  __post_gc ();
+
+  return len == 0 && k > 0 ? (void*) BOX (0) : r->contents;
+}
+
+extern void LfwriteChunk (FILE *f, char *s) {
+  ASSERT_BOXED("fwriteChunk:1", f);
+  ASSERT_STRING("fwriteChunk:2", s);
+
+  if (fwrite (s, 1, LEN(TO_DATA(s)->tag), f) != LEN(TO_DATA(s)->tag))
+    failure ("fwriteChunk: %s\n", strerror (errno));
+}
+
+extern void Lfseek (FILE *f, word pos) {
+  ASSERT_BOXED("fseek:1", f);
+  ASSERT_UNBOXED("fseek:2", pos);
+
+  in_buffer_drop (fileno (f));
+
+  if (fseeko (f, (off_t) UNBOX(pos), SEEK_SET) < 0)
+    failure ("fseek: %s\n", strerror (errno));
+}
+
+extern word Lftell (FILE *f) {
+  in_buffer *b = NULL;
+  off_t      pos;
+
+  ASSERT_BOXED("ftell:1", f);
+
+  in_serial ();
+  
+  if (fileno (f) < rt->in_buffers_size) b = rt->in_buffers[fileno (f)];
+
+  /* the input buffer reads the descriptor past the stream, which may keep
+     a stale position after fseek; the bytes read ahead are not consumed yet */
+  if ((pos = b ? lseek (fileno (f), 0, SEEK_CUR) : ftello (f)) < 0)
+    failure ("ftell: %s\n", strerror (errno));
+
+  if (b) pos -= b->end - b->start;
+
+  if (pos > (off_t) (INTPTR_MAX >> 1))
+    failure ("ftell: the position %lld does not fit in an integer\n", (long long) pos);
+  
+  return BOX((word) pos);
+}
+
+/* External strings.
+
+   fmap maps a file into memory as a read-only string: the mapping is
+   preceded by a page holding the string header, and the pages past the
+   end of the file provide the terminating zero. The mapping lies outside
+   the heap, so the GC neither scans nor copies it; it is read-only, and an
+   attempt to modify the string faults. The string lives until funmap.
+*/
+
+/* the largest length the header holds: all the bits of a word but the tag */
+# define MAX_EXTERNAL_SIZE (((size_t) 1 << (sizeof (word) * 8 - 3)) - 1)
+
+typedef struct external {
+  char            *begin;
+  size_t           size;
+  struct external *next;
+} external;
+
+static int is_external (void *p) {
+  external *e;
+
+  for (e = rt->externals; e; e = e->next)
+    if (e->begin <= (char*) p && (char*) p < e->begin + e->size) return 1;
+
+  return 0;
+}
+
+extern void* Lfmap (char *fname) {
+  size_t       page = sysconf (_SC_PAGESIZE), size;
+  struct stat  st;
+  char        *base;
+  external    *e;
+  data        *d;
+  int          fd;
+
+  ASSERT_STRING("fmap:1", fname);
+
+  in_serial ();
+  
+  if ((fd = open (fname, O_RDONLY)) < 0 || fstat (fd, &st) < 0)
+    failure ("fmap (\"%s\"): %s\n", fname, strerror (errno));
+
+  if ((unsigned long long) st.st_size > MAX_EXTERNAL_SIZE)
+    failure ("fmap (\"%s\"): file too large (%lld bytes)\n", fname, (long long) st.st_size);
+
+  size = (page + st.st_size + 1 + page - 1) / page * page;
+  base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HEAP, -1, 0);
+
+  if (base == MAP_FAILED ||
+      (st.st_size > 0 &&
+       mmap (base + page, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED))
+    failure ("fmap (\"%s\"): %s\n", fname, strerror (errno));
+
+  close (fd);
+
+  d = (data*) (base + page - sizeof (word));
+  d->tag = STRING_TAG | ((word) st.st_size << 3);
+
+  /* the header and the terminating zeroes become read-only as well */
+  if (mprotect (base, size, PROT_READ) < 0)
+    failure ("fmap (\"%s\"): %s\n", fname, strerror (errno));
+
+  if ((e = (external*) malloc (sizeof (external))) == NULL)
+    failure ("fmap: out of memory\n");
+
+  e->begin  = base;
+  e->size   = size;
+  e->next   = rt->externals;
+  rt->externals = e;
+
+  return d->contents;
+}
+
+extern void Lfunmap (char *s) {
+  external **e;
+
+  for (e = &rt->externals; *e; e = &(*e)->next)
+    if ((*e)->begin <= s && s < (*e)->begin + (*e)->size) {
+      external *d = *e;
+
+      *e = d->next;
+      munmap (d->begin, d->size);
+      free (d);
+      return;
+    }
+
+  failure ("funmap: not a mapped string\n");
+}
+
+extern void* Lfst (void *v) {
+  return Belem (v, BOX(0));  
+}
+
+extern void* Lsnd (void *v) {
+  return Belem (v, BOX(1));  
+}
+
+extern void* Lhd (void *v) {
+  return Belem (v, BOX(0));  
+}
+
+extern void* Ltl (void *v) {
+  return Belem (v, BOX(1));  
+}
+
+/* Lread is an implementation of the "read" construct */
+extern word Lread () {
+  word result = 0;
+
+  printf ("> "); 
+  out_sync ();
+  in_int (in_buffer_of (STDIN_FILENO), &result);
+
+  return BOX(result);
+}
+
+/* Lwrite is an implementation of the "write" construct */
+extern word Lwrite (word n) {
+  char      buf[16], *p = buf + sizeof (buf);
+  int       x = UNBOX(n);
+  unsigned  u = x < 0 ? - (unsigned) x : (unsigned) x;
+
+  *--p = '\n';
+
+  do {
+    *--p = '0' + u % 10;
+  } while (u /= 10);
+
+  if (x < 0) *--p = '-';
+
+  fwrite (p, 1, buf + sizeof (buf) - p, stdout);
+  out_sync ();
+
+  return 0;
+}
+
+extern word Lrandom (word n) {
+  ASSERT_UNBOXED("Lrandom, 0", n);
+
+  if (UNBOX(n) <= 0) {
+    failure ("invalid range in random: %d\n", UNBOX(n));
+  }
+  
+  return BOX (random () % UNBOX(n));
+}
+
+extern word Ltime () {
+  struct timespec t;
+  
+  clock_gettime (CLOCK_MONOTONIC_RAW, &t);
+  
+  return BOX(t.tv_sec * 1000000 + t.tv_nsec / 1000);
+}
+
+extern void set_args (int argc, char *argv[]) {
+  data *a;
+  int   n = argc, i;
+  word *p = NULL;
+  
+  __pre_gc ();
+
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+  printf ("set_args: call: n=%i &p=%p p=%p: ", n, &p, p); fflush(stdout);
+  for (i = 0; i < n; i++)
+    printf("%s ", argv[i]);
+  printf("EE\n");
+#endif
+
+  p = LmakeArray (BOX(n));
+  push_extra_root ((void**)&p);
+  
+  for (i=0; i<n; i++) {
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("set_args: iteration %i %p %p ->\n", i, &p, p); fflush(stdout);
+#endif
+    ((word*)p) [i] = (word) Bstring (argv[i]);
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("set_args: iteration %i <- %p %p\n", i, &p, p); fflush(stdout);
+#endif
+  }
+
+  pop_extra_root ((void**)&p);
+  __post_gc ();
+
+  global_sysargs = p; /* the main instance works with the section itself */
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("set_args: end\n", n, &p, p); fflush(stdout);
+  indent--;
+#endif
+}
+
+/* Native part of Collection.lama: persistent AVL trees of MNode (key, values,
+   balance factor, left, right) nodes; the shapes of the trees are exactly
+   the same as the ones built by the original Lama implementation */
+
+# define COLL_MAX_DEPTH 64
+# define MNODE_SIZE     7 /* in words: sexp tag, data tag and five fields */
+# define CONS_SIZE      4
+
+# define MNODE_KEY(n)   (((void**) (n))[0])
+# define MNODE_VALS(n)  (((void**) (n))[1])
+# define MNODE_BF(n)    (((word*)   (n))[2])
+# define MNODE_LEFT(n)  (((void**) (n))[3])
+# define MNODE_RIGHT(n) (((void**) (n))[4])
+
+static int mnode_tag = 0, cons_tag = 0;
+
+/* On x86-64 the closure of compare points to a thunk (see "Thunks" in
+   X86.ml) and is called as any other one */
+static int coll_compare (void *compare, void *x, void *y) {
+  void *args [2];
+  
+  if (((void**) compare)[0] == (void*) Lcompare) return UNBOX(Lcompare (x, y));
+
+  args[0] = x;
+  args[1] = y;
+
+  return UNBOX(call_closure (compare, 2, args));
+}
+
+/* Carves an S-expression of n fields from a preallocated chunk */
+static void* coll_sexp (size_t **chunk, int tag, int n) {
+  sexp *s = (sexp*) *chunk;
+
+  *chunk += n + 2;
+#ifndef DEBUG_PRINT
+  s->tag = tag;
+#else
+  s->tag = SEXP_TAG | (tag << 3);
+#endif
+  s->contents.tag = SEXP_TAG | (n << 3);
+
+  return s->contents.contents;
+}
+
+static void* coll_node (size_t **chunk, void *k, void *vs, int bf, void *l, void *r) {
+  void *n = coll_sexp (chunk, mnode_tag, 5);
+
+  MNODE_KEY(n)   = k;
+  MNODE_VALS(n)  = vs;
+  MNODE_BF(n)    = BOX(bf);
+  MNODE_LEFT(n)  = l;
+  MNODE_RIGHT(n) = r;
+
+  return n;
+}
+
+/* Allocates a chunk for nodes and cons cells; all the pointers to be preserved
+   have to be in extra roots */
+static void init_sexp_tags (void) {
+  if (mnode_tag == 0) {
+    mnode_tag = UNBOX(LtagHash ("MNode"));
+    cons_tag  = UNBOX(LtagHash ("cons"));
+  }
+}
+
+static size_t* coll_alloc (int nodes, int conses) {
+  init_sexp_tags ();
+  
+  return (size_t*) alloc (sizeof (word) * (nodes * MNODE_SIZE + conses * CONS_SIZE));
+}
+
+/* Searches for a key; returns the length of the path to the node found (or to
+   an empty subtree), records the directions (1 for left) in dirs and the last
+   node in *last. The compare closure may trigger GC, thus the arguments are
+   passed via extra roots of the caller */
+static int coll_path (void **compare, void **t, void **k, char *dirs, void **last) {
+  void *node = *t;
+  int   h    = 0, c;
+
+  push_extra_root (&node);
+
+  while (! UNBOXED(node)) {
+    if ((c = coll_compare (*compare, *k, MNODE_KEY(node))) == 0) break;
+    if (h == COLL_MAX_DEPTH) failure ("Collection: the tree is too deep\n");
+    
+    dirs[h++] = c < 0;
+    node      = c < 0 ? MNODE_LEFT(node) : MNODE_RIGHT(node);
+  }
+
+  pop_extra_root (&node);
+
+  *last = node;
+  
+  return h;
+}
+
+/* Restores the nodes along a path recorded by coll_path */
+static void coll_restore_path (void *t, char *dirs, int h, void **path) {
+  for (int i = 0; i < h; i++) {
+    path[i] = t;
+    t = dirs[i] ? MNODE_LEFT(t) : MNODE_RIGHT(t);
+  }
+
+  path[h] = t;
+}
+
+/* Rotates a freshly built node in place; its child has to be fresh as well */
+static void* coll_rot (int left, void *node) {
+  int   x = UNBOX(MNODE_BF(node)), y, x0, y0;
+  void *c;
+
+  if (left) {
+    c  = MNODE_RIGHT(node);
+    y  = UNBOX(MNODE_BF(c));
+    x0 = y > 0 ? x + 1 : x - y + 1;
+    y0 = x0 > 0 ? (y > 0 ? x + y + 2 : x + 2) : y + 1;
+    
+    MNODE_RIGHT(node) = MNODE_LEFT(c);
+    MNODE_LEFT(c)     = node;
+  }
+  else {
+    c  = MNODE_LEFT(node);
+    y  = UNBOX(MNODE_BF(c));
+    x0 = y < 0 ? x - 1 : x - y - 1;
+    y0 = x0 > 0 ? y - 1 : (y < 0 ? y + x - 2 : x - 2);
+
+    MNODE_LEFT(node) = MNODE_RIGHT(c);
+    MNODE_RIGHT(c)   = node;
+  }
+
+  MNODE_BF(node) = BOX(x0);
+  MNODE_BF(c)    = BOX(y0);
+
+  return c;
+}
+
+static void* coll_insert (void *compare, void *t, void *k, void *v, int is_map) {
+  char    dirs [COLL_MAX_DEPTH];
+  void   *path [COLL_MAX_DEPTH + 1];
+  void   *node, *nn, *vs;
+  size_t *chunk;
+  int     h, i, bf, grew;
+
+  push_extra_root (&compare);
+  push_extra_root (&t);
+  push_extra_root (&k);
+  push_extra_root (&v);
+
+  h     = coll_path (&compare, &t, &k, dirs, &node);
+  chunk = coll_alloc (h + 1, is_map);
+  
+  pop_extra_root (&v);
+  pop_extra_root (&k);
+  pop_extra_root (&t);
+  pop_extra_root (&compare);
+
+  coll_restore_path (t, dirs, h, path);
+  node = path[h];
+
+  if (is_map) {
+    vs = coll_sexp (&chunk, cons_tag, 2);
+    ((void**) vs)[0] = v;
+    ((void**) vs)[1] = UNBOXED(node) ? (void*) BOX(0) : MNODE_VALS(node);
+  }
+  else vs = v;
+
+  if (UNBOXED(node)) {
+    nn   = coll_node (&chunk, k, vs, 0, (void*) BOX(0), (void*) BOX(0));
+    grew = 1;
+  }
+  else {
+    nn   = coll_node (&chunk, MNODE_KEY(node), vs, UNBOX(MNODE_BF(node)), MNODE_LEFT(node), MNODE_RIGHT(node));
+    grew = 0;
+  }
+
+  for (i = h-1; i >= 0; i--) {
+    node = path[i];
+    bf   = UNBOX(MNODE_BF(node));
+    
+    if (dirs[i]) {
+      if (! grew) nn = coll_node (&chunk, MNODE_KEY(node), MNODE_VALS(node), bf, nn, MNODE_RIGHT(node));
+      else if (bf < 0) {
+        nn   = coll_node (&chunk, MNODE_KEY(node), MNODE_VALS(node), bf + 1, nn, MNODE_RIGHT(node));
+        grew = 0;
+      }
+      else if (bf == 1) {
+        if (UNBOX(MNODE_BF(nn)) <= 0) nn = coll_rot (1, nn);
+        nn   = coll_rot (0, coll_node (&chunk, MNODE_KEY(node), MNODE_VALS(node), 2, nn, MNODE_RIGHT(node)));
+        grew = 0;
+      }
+      else nn = coll_node (&chunk, MNODE_KEY(node), MNODE_VALS(node), bf + 1, nn, MNODE_RIGHT(node));
+    }
+    else {
+      if (! grew) nn = coll_node (&chunk, MNODE_KEY(node), MNODE_VALS(node), bf, MNODE_LEFT(node), nn);
+      else if (bf > 0) {
+        nn   = coll_node (&chunk, MNODE_KEY(node), MNODE_VALS(node), bf - 1, MNODE_LEFT(node), nn);
+        grew = 0;
+      }
+      else if (bf == -1) {
+        if (UNBOX(MNODE_BF(nn)) >= 0) nn = coll_rot (0, nn);
+        nn   = coll_rot (1, coll_node (&chunk, MNODE_KEY(node), MNODE_VALS(node), -2, MNODE_LEFT(node), nn));
+        grew = 0;
+      }
+      else nn = coll_node (&chunk, MNODE_KEY(node), MNODE_VALS(node), bf - 1, MNODE_LEFT(node), nn);
+    }
+  }
+
+  return nn;
+}
+
+static void* coll_remove (void *compare, void *t, void *k, int is_map) {
+  char    dirs [COLL_MAX_DEPTH];
+  void   *path [COLL_MAX_DEPTH + 1];
+  void   *node, *nn, *vs;
+  size_t *chunk;
+  int     h, i;
+
+  push_extra_root (&compare);
+  push_extra_root (&t);
+  push_extra_root (&k);
+
+  h = coll_path (&compare, &t, &k, dirs, &node);
+
+  if (UNBOXED(node)) {
+    pop_extra_root (&k);
+    pop_extra_root (&t);
+    pop_extra_root (&compare);
+    return t;
+  }
+  
+  chunk = coll_alloc (h + 1, 0);
+  
+  pop_extra_root (&k);
+  pop_extra_root (&t);
+  pop_extra_root (&compare);
+
+  coll_restore_path (t, dirs, h, path);
+  node = path[h];
+  
+  if (is_map) {
+    vs = MNODE_VALS(node);
+    if (! UNBOXED(vs)) vs = ((void**) vs)[1];
+  }
+  else vs = (void*) BOX(0);
+
+  nn = coll_node (&chunk, MNODE_KEY(node), vs, UNBOX(MNODE_BF(node)), MNODE_LEFT(node), MNODE_RIGHT(node));
+  
+  for (i = h-1; i >= 0; i--) {
+    node = path[i];
+    nn   = dirs[i]
+      ? coll_node (&chunk, MNODE_KEY(node), MNODE_VALS(node), UNBOX(MNODE_BF(node)), nn, MNODE_RIGHT(node))
+      : coll_node (&chunk, MNODE_KEY(node), MNODE_VALS(node), UNBOX(MNODE_BF(node)), MNODE_LEFT(node), nn);
+  }
+
+  return nn;
+}
+
+/* Collects the elements of a set in order into dst (if not NULL); returns
+   their number */
+static int coll_elements (void *t, void **dst) {
+  void *stack [COLL_MAX_DEPTH];
+  int   sp = 0, n = 0;
+
+  while (! UNBOXED(t) || sp) {
+    while (! UNBOXED(t)) {
+      if (sp == COLL_MAX_DEPTH) failure ("Collection: the tree is too deep\n");
+      stack[sp++] = t;
+      t = MNODE_LEFT(t);
+    }
+
+    t = stack[--sp];
+    
+    if (UNBOX(MNODE_VALS(t))) {
+      if (dst) dst[n] = MNODE_KEY(t);
+      n++;
+    }
+    
+    t = MNODE_RIGHT(t);
+  }
+
+  return n;
+}
+
+/* Finds a node for a given key; returns 0 if there is no such node */
+extern void* LcollFind (void *t, void *compare, void *k) {
+  char  dirs [COLL_MAX_DEPTH];
+  void *node;
+
+  __pre_gc ();
+  
+  push_extra_root (&compare);
+  push_extra_root (&t);
+  push_extra_root (&k);
+  coll_path (&compare, &t, &k, dirs, &node);
+  pop_extra_root (&k);
+  pop_extra_root (&t);
+  pop_extra_root (&compare);
+
+  __post_gc ();
+
+  return node;
+}
+
+/* Adds a key with a value; for maps the value is prepended to the list of
+   values of the key, for sets it replaces the existing one */
+extern void* LcollAdd (void *t, void *compare, void *k, void *v, word is_map) {
+  void *r;
+  
+  __pre_gc ();
+
+  r = coll_insert (compare, t, k, v, UNBOX(is_map));
+  
+  __post_gc ();
+
+  return r;
+}
+
+/* Removes a key; for maps the last added value is removed */
+extern void* LcollRemove (void *t, void *compare, void *k, word is_map) {
+  void *r;
+  
+  __pre_gc ();
+
+  r = coll_remove (compare, t, k, UNBOX(is_map));
+  
+  __post_gc ();
+
+  return r;
+}
+
+/* Adds (removes) all the elements of a set s to (from) a set t */
+static void* coll_bulk (void *t, void *compare, void *s, int add) {
+  void *a;
+  int   n, i;
+
+  push_extra_root (&compare);
+  push_extra_root (&t);
+  
+  n = coll_elements (s, NULL);
+  push_extra_root (&s);
+  a = LmakeArray (BOX(n));
+  pop_extra_root (&s);
+  
+  coll_elements (s, (void**) a);
+  push_extra_root (&a);
+
+  for (i = 0; i < n; i++) {
+    t = add
+      ? coll_insert (compare, t, ((void**) a)[i], (void*) BOX(1), 0)
+      : coll_remove (compare, t, ((void**) a)[i], 0);
+  }
+
+  pop_extra_root (&a);
+  pop_extra_root (&t);
+  pop_extra_root (&compare);
+
+  return t;
+}
+
+extern void* LcollUnion (void *t, void *compare, void *s) {
+  void *r;
+  
+  __pre_gc ();
+
+  r = coll_bulk (t, compare, s, 1);
+
+  __post_gc ();
+
+  return r;
+}
+
+extern void* LcollDiff (void *t, void *compare, void *s) {
+  void *r;
+  
+  __pre_gc ();
+
+  r = coll_bulk (t, compare, s, 0);
+
+  __post_gc ();
+
+  return r;
+}
+
+/* Sorting: a stable merge sort; the elements are kept in Lama arrays only, thus
+   a comparison closure is allowed to trigger GC */
+
+# define SORT_INTS    0 /* builtin compare, unboxed elements only */
+# define SORT_COMPARE 1 /* builtin compare                        */
+# define SORT_CLOSURE 2 /* arbitrary closure                      */
+
+# define SORT_RUN     16        /* ranges sorted by insertion          */
+# define SORT_PAR_MIN (1 << 14) /* minimal range per a parallel worker */
+# define SORT_THREADS 64
+
+typedef struct {
+  void  *compare;
+  void **buf [2];
+  void  *tmp;
+  int    kind;
+} sort_ctx;
+
+static int sort_cmp (sort_ctx *c, void *x, void *y) {
+  void *args [2];
+  
+  switch (c->kind) {
+  case SORT_INTS:
+    return (word) x < (word) y ? -1 : (word) x > (word) y;
+
+  case SORT_COMPARE:
+    return UNBOX(Lcompare (x, y));
+
+  default:
+    args[0] = x;
+    args[1] = y;
+    return UNBOX(call_closure (c->compare, 2, args));
+  }
+}
+
+static void sort_kind (sort_ctx *c, int n) {
+  if (((void**) c->compare)[0] != (void*) Lcompare) {
+    c->kind = SORT_CLOSURE;
+    return;
+  }
+  
+  c->kind = SORT_INTS;
+  
+  for (int i = 0; i < n; i++)
+    if (! UNBOXED(c->buf[0][i])) {
+      c->kind = SORT_COMPARE;
+      return;
+    }
+}
+
+/* Merges [lo, mid) and [mid, hi) of buffer "from" into the other one */
+static void sort_merge (sort_ctx *c, int lo, int mid, int hi, int from) {
+  int i = lo, j = mid, k = lo, to = 1 - from;
+
+  if (sort_cmp (c, c->buf[from][mid-1], c->buf[from][mid]) <= 0) {
+    memcpy (c->buf[to] + lo, c->buf[from] + lo, (hi - lo) * sizeof (void*));
+    return;
+  }
+  
+  while (i < mid && j < hi) {
+    if (sort_cmp (c, c->buf[from][i], c->buf[from][j]) <= 0) c->buf[to][k++] = c->buf[from][i++];
+    else c->buf[to][k++] = c->buf[from][j++];
+  }
+
+  while (i < mid) c->buf[to][k++] = c->buf[from][i++];
+  while (j < hi)  c->buf[to][k++] = c->buf[from][j++];
+}
+
+/* Sorts [lo, hi) into buffer "to"; both buffers have to contain the same
+   elements in this range */
+static void sort_range (sort_ctx *c, int lo, int hi, int to) {
+  int i, j, mid;
+  
+  if (hi - lo <= SORT_RUN) {
+    for (i = lo + 1; i < hi; i++) {
+      c->tmp = c->buf[to][i];
+      
+      for (j = i; j > lo && sort_cmp (c, c->buf[to][j-1], c->tmp) > 0; j--)
+        c->buf[to][j] = c->buf[to][j-1];
+      
+      c->buf[to][j] = c->tmp;
+    }
+
+    c->tmp = (void*) BOX(0);
+    return;
+  }
+
+  mid = lo + (hi - lo) / 2;
+  
+  sort_range (c, lo, mid, 1 - to);
+  sort_range (c, mid, hi, 1 - to);
+  sort_merge (c, lo, mid, hi, 1 - to);
+}
+
+typedef struct {
+  sort_ctx  *c;
+  int        lo, mid, hi;
+  int        to;
+  pthread_t  thread;
+} sort_task;
+
+static void* sort_worker (void *p) {
+  sort_task *t = (sort_task*) p;
+
+  if (t->mid < 0) sort_range (t->c, t->lo, t->hi, t->to);
+  else if (t->mid < t->hi) sort_merge (t->c, t->lo, t->mid, t->hi, 1 - t->to);
+  else memcpy (t->c->buf[t->to] + t->lo, t->c->buf[1 - t->to] + t->lo, (t->hi - t->lo) * sizeof (void*));
+
+  return NULL;
+}
+
+static void sort_run_tasks (sort_task *tasks, int n) {
+  for (int i = 0; i < n; i++)
+    if (pthread_create (&tasks[i].thread, NULL, sort_worker, &tasks[i]))
+      failure ("sort: can not create a thread: %s\n", strerror (errno));
+
+  for (int i = 0; i < n; i++)
+    pthread_join (tasks[i].thread, NULL);
+}
+
+/* Sorts n elements with p workers (no GC may happen, thus the comparison
+   has to be the builtin one); returns the index of the resulting buffer */
+static int sort_parallel (sort_ctx *c, int n, int p) {
+  sort_task tasks [SORT_THREADS];
+  int       bounds [SORT_THREADS + 1];
+  int       cur = 0, i, m;
+
+  for (i = 0; i <= p; i++) bounds[i] = (int) ((long long) n * i / p);
+
+  for (i = 0; i < p; i++) {
+    tasks[i].c   = c;
+    tasks[i].lo  = bounds[i];
+    tasks[i].mid = -1;
+    tasks[i].hi  = bounds[i+1];
+    tasks[i].to  = cur;
+  }
+
+  sort_run_tasks (tasks, p);
+
+  while (p > 1) {
+    for (i = 0, m = 0; i < p; i += 2, m++) {
+      tasks[m].c   = c;
+      tasks[m].lo  = bounds[i];
+      tasks[m].mid = bounds[i+1];
+      tasks[m].hi  = bounds[i+1 < p ? i+2 : i+1];
+      tasks[m].to  = 1 - cur;
+    }
+
+    sort_run_tasks (tasks, m);
+    
+    for (i = 0; i < m; i++) bounds[i] = tasks[i].lo;
+    bounds[m] = n;
+    
+    p   = m;
+    cur = 1 - cur;
+  }
+
+  return cur;
+}
+
+/* Sorts the contents of c->buf[0] (c->buf[1] has to be its copy), returns
+   the sorted buffer */
+static void* sort_buffers (sort_ctx *c, int n, int par) {
+  int p = 1;
+
+  sort_kind (c, n);
+  
+  if (par && c->kind != SORT_CLOSURE) {
+    p = (int) sysconf (_SC_NPROCESSORS_ONLN);
+    if (p > SORT_THREADS)     p = SORT_THREADS;
+    if (p > n / SORT_PAR_MIN) p = n / SORT_PAR_MIN;
+  }
+
+  if (p > 1) return c->buf[sort_parallel (c, n, p)];
+
+  push_extra_root (&c->compare);
+  push_extra_root ((void**) &c->buf[0]);
+  push_extra_root ((void**) &c->buf[1]);
+  push_extra_root (&c->tmp);
+
+  sort_range (c, 0, n, 0);
+  
+  pop_extra_root (&c->tmp);
+  pop_extra_root ((void**) &c->buf[1]);
+  pop_extra_root ((void**) &c->buf[0]);
+  pop_extra_root (&c->compare);
+
+  return c->buf[0];
+}
+
+static void* sort_array (void *a, void *compare, int par) {
+  sort_ctx c;
+  void    *r;
+
+  ASSERT_BOXED("sortArray:1", a);
+  
+  if (TAG(TO_DATA(a)->tag) != ARRAY_TAG) failure ("array expected in sortArray\n");
+
+  __pre_gc ();
+
+  c.compare = compare;
+  c.tmp     = (void*) BOX(0);
+  
+  push_extra_root (&c.compare);
+  c.buf[0] = (void**) Lclone (a);
+  push_extra_root ((void**) &c.buf[0]);
+  c.buf[1] = (void**) Lclone (c.buf[0]);
+  pop_extra_root ((void**) &c.buf[0]);
+  pop_extra_root (&c.compare);
+
+  r = sort_buffers (&c, LEN(TO_DATA(c.buf[0])->tag), par);
+  
+  __post_gc ();
+
+  return r;
+}
+
+/* Returns a sorted copy of an array; the order is defined by a comparison
+   function, equal elements keep their relative order */
+extern void* LsortArray (void *a, void *compare) {
+  return sort_array (a, compare, 0);
+}
+
+/* The same as sortArray, but sorts large arrays in parallel if the
+   comparison function is the builtin compare */
+extern void* LparSortArray (void *a, void *compare) {
+  return sort_array (a, compare, 1);
+}
+
+/* Returns a sorted copy of a list */
+extern void* LsortList (void *l, void *compare) {
+  sort_ctx c;
+  size_t  *chunk;
+  void    *p, *r;
+  int      n = 0, i;
+
+  for (p = l; ! UNBOXED(p); p = ((void**) p)[1]) n++;
+
+  if (n == 0) return l;
+  
+  __pre_gc ();
+
+  c.compare = compare;
+  c.tmp     = (void*) BOX(0);
+
+  push_extra_root (&c.compare);
+  push_extra_root (&l);
+  c.buf[0] = (void**) LmakeArray (BOX(n));
+  pop_extra_root (&l);
+  
+  for (p = l, i = 0; ! UNBOXED(p); p = ((void**) p)[1]) c.buf[0][i++] = ((void**) p)[0];
+  
+  push_extra_root ((void**) &c.buf[0]);
+  c.buf[1] = (void**) Lclone (c.buf[0]);
+  pop_extra_root ((void**) &c.buf[0]);
+  pop_extra_root (&c.compare);
+
+  p = sort_buffers (&c, n, 0);
+
+  init_sexp_tags ();
+  
+  push_extra_root (&p);
+  chunk = (size_t*) alloc (sizeof (word) * n * CONS_SIZE);
+  pop_extra_root (&p);
+
+  for (r = (void*) BOX(0), i = n-1; i >= 0; i--) {
+    void *cell = coll_sexp (&chunk, cons_tag, 2);
+
+    ((void**) cell)[0] = ((void**) p)[i];
+    ((void**) cell)[1] = r;
+    r = cell;
+  }
+  
+  __post_gc ();
+
+  return r;
+}
+
+/* GC starts here */
+
+extern void LenableGC () {
+  rt->enable_GC = 1;
+}
+
+extern void LdisableGC () {
+  rt->enable_GC = 0;
+}
+
+# ifdef __ENABLE_GC__
+
+extern void __gc_init ();
+
+# else
+
+# define __gc_init __gc_init_subst
+void __gc_init_subst () {}
+
+# endif
+
+extern void __gc_root_scan_stack ();
+
+/* ======================================== */
+/*           Mark-and-copy                  */
+/* ======================================== */
+
+static int free_pool (pool * p) {
+  size_t *a = p->begin, b = p->size;
+  p->begin   = NULL;
+  p->size    = 0;
+  p->end     = NULL;
+  p->current = NULL;
+  return munmap((void *)a, b * sizeof(size_t));
+}
+
+static void init_to_space (int flag) {
+  size_t space_size = 0;
+  if (flag) rt->space_size = rt->space_size << 1;
+  if (rt->inc_spare.begin != NULL) {
+    if (rt->inc_spare.size == rt->space_size) {
+      rt->to_space         = rt->inc_spare;
+      rt->to_space.current = rt->to_space.begin;
+      rt->inc_spare.begin  = NULL;
+      return;
+    }
+    free_pool (&rt->inc_spare);
+  }
+  space_size     = rt->space_size * sizeof(size_t);
+  rt->to_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HEAP, -1, 0);
+  if (rt->to_space.begin == MAP_FAILED) {
+    perror ("EROOR: init_to_space: mmap failed\n");
+    exit   (1);
+  }
+  rt->to_space.current = rt->to_space.begin;
+  rt->to_space.end     = rt->to_space.begin + rt->space_size;
+  rt->to_space.size    = rt->space_size;
+}
+
+static void gc_swap_spaces (void) {
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+  printf ("gc_swap_spaces\n"); fflush (stdout);
+#endif
+  /* unmapping a large space takes a while, thus it is kept for the next
+     incremental cycle */
+  if (rt->inc_pause) rt->inc_spare = rt->from_space;
+  else free_pool (&rt->from_space);
+  rt->from_space.begin   = rt->to_space.begin;
+  rt->from_space.current = current;
+  rt->from_space.end     = rt->to_space.end;
+  rt->from_space.size    = rt->to_space.size;
+  rt->to_space.begin   = NULL;
+  rt->to_space.current = NULL;
+  rt->to_space.end     = NULL;
+  rt->to_space.size    = 0;
+#ifdef DEBUG_PRINT
+  indent--;
+#endif
+}
+
+# define IN_PASSIVE_SPACE(p)	\
+  ((size_t)rt->to_space.begin <= (size_t)p	&&	\
+   (size_t)rt->to_space.end   >  (size_t)p)
+
+# define IS_FORWARD_PTR(p)			\
+  (!UNBOXED(p) && IN_PASSIVE_SPACE(p))
+
+int is_valid_heap_pointer (void *p)  {
+  return IS_VALID_HEAP_POINTER(p);
+}
+
+extern size_t * gc_copy (size_t *obj);
+static size_t*  inc_forward (size_t *obj);
+
+static void copy_elements (size_t *where, size_t *from, int len) {
+  int    i = 0;
+  void * p = NULL;
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+  printf ("copy_elements: start; len = %d\n", len); fflush (stdout);
+#endif
+  for (i = 0; i < len; i++) {
+    size_t elem = from[i];
+    if (!IS_VALID_HEAP_POINTER(elem)) {
+      *where = elem;
+      where++;
+#ifdef DEBUG_PRINT
+      print_indent ();	
+      printf ("copy_elements: copy NON ptr: %zu %p \n", elem, elem); fflush (stdout);
+#endif
+    }
+    else {
+#ifdef DEBUG_PRINT
+      print_indent ();	
+      printf ("copy_elements: fix element: %p -> %p\n", elem, *where);
+      fflush (stdout);
+#endif
+      p = gc_copy ((size_t*) elem);
+      *where = (size_t) p;
+      where ++;
+    }
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("copy_elements: iteration end: where = %p, *where = %p, i = %d, \
+             len = %d\n", where, *where, i, len); fflush (stdout);
+#endif
+
+  }
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("\tcopy_elements: end\n"); fflush (stdout);
+  indent--;
+#endif
+
+}
+
+static int extend_spaces (void) {
+  void *p = (void *) BOX (NULL);
+  size_t old_space_size = rt->space_size        * sizeof(size_t),
+         new_space_size = (rt->space_size << 1) * sizeof(size_t);
+  p = mremap(rt->to_space.begin, old_space_size, new_space_size, 0);
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+#endif
+  if (p == MAP_FAILED) {
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("extend: extend_spaces: mremap failed\n"); fflush (stdout);
+#endif
+    return 1;
+  }
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("extend: %p %p %p %p\n", p, rt->to_space.begin, rt->to_space.end, current);
+  fflush (stdout);
+  indent--;
+#endif
+  rt->to_space.end    += rt->space_size;
+  rt->space_size      =  rt->space_size << 1;
+  rt->to_space.size   =  rt->space_size;
+  return 0;
+}
+
+extern size_t * gc_copy (size_t *obj) {
+  data   *d    = TO_DATA(obj);
+  sexp   *s    = NULL;
+  size_t *copy = NULL;
+  int     i    = 0;
+#ifdef DEBUG_PRINT
+  int len1, len2, len3;
+  void * objj;
+  void * newobjj = (void*)current;
+  indent++; print_indent ();
+  printf ("gc_copy: %p cur = %p starts\n", obj, current);
+  fflush (stdout);
+#endif
+
+  if (!IS_VALID_HEAP_POINTER(obj)) {
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("gc_copy: invalid ptr: %p\n", obj); fflush (stdout);
+    indent--;
+#endif
+    return obj;
+  }
+
+  if (rt->inc_phase && (copy = inc_forward (obj)) != NULL) {
+#ifdef DEBUG_PRINT
+    indent--;
+#endif
+    return copy;
+  }
+
+  if (!IN_PASSIVE_SPACE(current) && current != rt->to_space.end) {
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf("ERROR: gc_copy: out-of-space %p %p %p\n",
+	   current, rt->to_space.begin, rt->to_space.end);
+    fflush(stdout);
+#endif
+    perror("ERROR: gc_copy: out-of-space\n");
+    exit (1);
+  }
+
+  if (IS_FORWARD_PTR(d->tag)) {
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("gc_copy: IS_FORWARD_PTR: return! %p -> %p\n", obj, (size_t *) d->tag);
+    fflush(stdout);
+    indent--;
+#endif
+    return (size_t *) d->tag;
+  }
+
+  copy = current;
+#ifdef DEBUG_PRINT
+  objj = d;
+#endif
+  switch (TAG(d->tag)) {
+    case CLOSURE_TAG:
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("gc_copy:closure_tag; len =  %zu\n", LEN(d->tag)); fflush (stdout);
+#endif
+      i = LEN(d->tag);
+      // current += LEN(d->tag) + 1;
+      // current += ((LEN(d->tag) + 1) * sizeof(word) -1) / sizeof(size_t) + 1;
+      current += i+1;
+      *copy = d->tag;
+      copy++;
+      d->tag = (word) copy;
+      copy_elements (copy, obj, i);
+      break;
+    
+    case ARRAY_TAG:
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("gc_copy:array_tag; len =  %zu\n", LEN(d->tag)); fflush (stdout);
+#endif
+      current += ((LEN(d->tag) + 1) * sizeof (word) - 1) / sizeof (size_t) + 1;
+      *copy = d->tag;
+      copy++;
+      i = LEN(d->tag);
+      d->tag = (word) copy;
+      copy_elements (copy, obj, i);
+      break;
+
+    case STRING_TAG:
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("gc_copy:string_tag; len = %d\n", LEN(d->tag) + 1); fflush (stdout);
+#endif
+      current += (LEN(d->tag) + sizeof(word)) / sizeof(size_t) + 1;
+      *copy = d->tag;
+      copy++;
+      d->tag = (word) copy;
+      strcpy ((char*)&copy[0], (char*) obj);
+      break;
+
+  case SEXP_TAG  :
+      s = TO_SEXP(obj);
+#ifdef DEBUG_PRINT
+      objj = s;
+      len1 = LEN(s->contents.tag);
+      len2 = LEN(s->tag);
+      len3 = LEN(d->tag);
+      print_indent ();
+      printf ("gc_copy:sexp_tag; len1 = %li, len2=%li, len3 = %li\n",
+	      len1, len2, len3);
+      fflush (stdout);
+#endif
+      i = LEN(s->contents.tag);
+      current += i + 2;
+      *copy = s->tag;
+      copy++;
+      *copy = d->tag;
+      copy++;
+      d->tag = (word) copy;
+      copy_elements (copy, obj, i);
+      break;
+
+  default:
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("ERROR: gc_copy: weird tag: %p", TAG(d->tag)); fflush (stdout);
+    indent--;
+#endif
+    perror ("ERROR: gc_copy: weird tag");
+    exit (1);
+    return (obj);
+  }
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("gc_copy: %p(%p) -> %p (%p); new-current = %p\n",
+	  obj, objj, copy, newobjj, current);
+  fflush (stdout);
+  indent--;
+#endif
+  return copy;
+}
+
+extern void gc_test_and_copy_root (size_t ** root) {
+#ifdef DEBUG_PRINT
+    indent++;
+#endif
+  if (IS_VALID_HEAP_POINTER(*root)) {
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("gc_test_and_copy_root: root %p top=%p bot=%p  *root %p \n", root, __gc_stack_top, __gc_stack_bottom, *root);
+    fflush (stdout);
+#endif
+    *root = gc_copy (*root);
+  }
+#ifdef DEBUG_PRINT
+  else {
+    print_indent ();
+    printf ("gc_test_and_copy_root: INVALID HEAP POINTER root %p  *root %p\n", root, *root);
+    fflush (stdout);
+  }
+  indent--;
+#endif
+}
+
+static void gc_root_scan_stack_segments (void) {
+  for (int i = 0; i < stack_segments_number; i++) {
+    size_t * p = (size_t*) stack_segments[i].top;
+    while (++p < (size_t*) stack_segments[i].bottom) {
+      gc_test_and_copy_root ((size_t**)p);
+    }
+  }
+}
+
+extern void gc_root_scan_data (void) {
+  size_t * p = rt->globals;
+  while  (p < globals_end (rt)) {
+    gc_test_and_copy_root ((size_t**)p);
+    p++;
+  }
+}
+
+/* Sampling profiler.
+
+   Enabled when the environment variable LAMA_PROFILE names an output file;
+   LAMA_PROFILE_HZ sets the sampling frequency (1000 per second of CPU time
+   by default). On each SIGPROF the handler walks the frame pointer chain
+   of the interrupted code and counts the sampled stack of code addresses.
+   At exit the addresses are mapped to Lama functions and source lines with
+   the tables which the compiler emits into the sections "lama_functions"
+   and "lama_lines", and the stacks are written in the folded format of
+   flamegraph.pl, one per line with the outermost frame first:
+
+     main (test.lama:12);fib (test.lama:3) 125
+
+   Frames of the runtime and the C library are shown as "[runtime]".
+*/
+
+typedef struct {
+  size_t start, end; /* the code range of the function    */
+  size_t closure;    /* if the frame keeps a closure      */
+  char  *name;
+  char  *file;
+} prof_function;
+
+typedef struct {
+  size_t address, line;
+} prof_line;
+
+extern prof_function __start_lama_functions[] __attribute__((weak));
+extern prof_function __stop_lama_functions[]  __attribute__((weak));
+extern prof_line     __start_lama_lines[]     __attribute__((weak));
+extern prof_line     __stop_lama_lines[]      __attribute__((weak));
+
+# define PROF_DEPTH  64
+# define PROF_STACKS 4096
+
+typedef struct {
+  size_t count;
+  int    depth;
+  size_t pcs[PROF_DEPTH];
+} prof_stack;
+
+static prof_stack      prof_stacks[PROF_STACKS];
+static size_t          prof_lost      = 0;
+static char           *prof_file      = NULL;
+static prof_function **prof_functions = NULL;
+static int             prof_nfunctions = 0;
+static prof_line      *prof_lines     = NULL;
+static int             prof_nlines    = 0;
+static pthread_t       prof_thread;   /* only the main thread is sampled */
+
+static int prof_compare_functions (const void *a, const void *b) {
+  size_t x = (*(prof_function**) a)->start, y = (*(prof_function**) b)->start;
+  return x < y ? -1 : x > y;
+}
+
+static int prof_compare_lines (const void *a, const void *b) {
+  size_t x = ((prof_line*) a)->address, y = ((prof_line*) b)->address;
+  return x < y ? -1 : x > y;
+}
+
+static prof_function *prof_find (size_t pc) {
+  int l = 0, r = prof_nfunctions - 1;
+
+  while (l <= r) {
+    int m = (l + r) / 2;
+    prof_function *f = prof_functions[m];
+
+    if      (pc <  f->start) r = m - 1;
+    else if (pc >= f->end)   l = m + 1;
+    else return f;
+  }
+
+  return NULL;
+}
+
+/* The line of the last line label at or before pc in the function f */
+static size_t prof_find_line (prof_function *f, size_t pc) {
+  int l = 0, r = prof_nlines - 1, found = -1;
+
+  while (l <= r) {
+    int m = (l + r) / 2;
+
+    if (prof_lines[m].address <= pc) found = m, l = m + 1;
+    else r = m - 1;
+  }
+
+  return found >= 0 && prof_lines[found].address >= f->start ? prof_lines[found].line : 0;
+}
+
+static void prof_handler (int sig, siginfo_t *info, void *context) {
+  mcontext_t *mc = &((ucontext_t*) context)->uc_mcontext;
+# ifdef __x86_64__
+  size_t  pc = mc->gregs[REG_RIP];
+  size_t *fp = (size_t*) mc->gregs[REG_RBP];
+  size_t  sp = mc->gregs[REG_RSP];
+# else
+  size_t  pc = mc->gregs[REG_EIP];
+  size_t *fp = (size_t*) mc->gregs[REG_EBP];
+  size_t  sp = mc->gregs[REG_ESP];
+# endif
+  size_t pcs[PROF_DEPTH], hash = pc;
+  int    depth = 0;
+
+  if (! pthread_equal (pthread_self (), prof_thread)) return;
+
+  pcs[depth++] = pc;
+
+  /* the return address is above the saved frame pointer and the closure,
+     if any; the walk stops at the frame of main. The frame pointer of code
+     in the C library or the runtime may be a general register, so each frame
+     has to be aligned, lie between the interrupted stack pointer and the
+     bottom of the stack and be above the former one */
+# define PROF_FRAME(p) ((size_t) (p) % sizeof (size_t) == 0 && (size_t) (p) >= sp && (size_t) (p) < __gc_stack_bottom)
+  while (depth < PROF_DEPTH && PROF_FRAME(fp)) {
+    prof_function *f    = prof_find (pc);
+    size_t        *next = (size_t*) fp[0];
+
+    pc = f != NULL && f->closure ? fp[2] : fp[1];
+    if (next <= fp || ! PROF_FRAME(next)) break;
+    pcs[depth++] = pc;
+    hash = hash * 31 + pc;
+    fp   = next;
+  }
+# undef PROF_FRAME
+
+  for (size_t i = 0, h = hash % PROF_STACKS; i < PROF_STACKS; i++, h = (h + 1) % PROF_STACKS) {
+    prof_stack *s = &prof_stacks[h];
+
+    if (s->count == 0) {
+      s->depth = depth;
+      memcpy (s->pcs, pcs, depth * sizeof (size_t));
+      s->count = 1;
+      return;
+    }
+
+    if (s->depth == depth && memcmp (s->pcs, pcs, depth * sizeof (size_t)) == 0) {
+      s->count++;
+      return;
+    }
+  }
+
+  prof_lost++;
+}
+
+static void prof_dump (void) {
+  struct itimerval stop = {{0, 0}, {0, 0}};
+  FILE *out;
+
+  setitimer (ITIMER_PROF, &stop, NULL);
+
+  if ((out = fopen (prof_file, "w")) == NULL) {
+    perror ("ERROR: profiler: can not open the output file");
+    return;
+  }
+
+  for (int i = 0; i < PROF_STACKS; i++) {
+    prof_stack *s = &prof_stacks[i];
+    int runtime = 0, first = 1;
+
+    if (s->count == 0) continue;
+
+    for (int j = s->depth - 1; j >= 0; j--) {
+      /* a return address follows the call, so it is looked up one byte back */
+      size_t pc = j == 0 ? s->pcs[j] : s->pcs[j] - 1;
+      prof_function *f = prof_find (pc);
+
+      if (f == NULL) {
+        if (!runtime) fprintf (out, "%s[runtime]", first ? "" : ";");
+        runtime = 1;
+      }
+      else {
+        fprintf (out, "%s%s (%s:%zu)", first ? "" : ";", f->name, f->file, prof_find_line (f, pc));
+        runtime = 0;
+      }
+
+      first = 0;
+    }
+
+    fprintf (out, " %zu\n", s->count);
+  }
+
+  if (prof_lost)
+    fprintf (stderr, "WARNING: profiler: %zu samples lost, the stack table is full\n", prof_lost);
+
+  fclose (out);
+}
+
+static void init_profiler (void) {
+  struct sigaction sa;
+  struct itimerval timer;
+  char *hz_env;
+  long  hz = 1000;
+
+  if ((prof_file = getenv ("LAMA_PROFILE")) == NULL || __start_lama_functions == NULL) return;
+
+  if ((hz_env = getenv ("LAMA_PROFILE_HZ")) != NULL && atol (hz_env) > 0)
+    hz = atol (hz_env);
+  if (hz > 1000000) hz = 1000000;
+
+  prof_nfunctions = __stop_lama_functions - __start_lama_functions;
+  prof_functions  = malloc (prof_nfunctions * sizeof (prof_function*));
+  prof_nlines     = __stop_lama_lines - __start_lama_lines;
+  prof_lines      = malloc (prof_nlines * sizeof (prof_line));
+
+  if (prof_functions == NULL || prof_lines == NULL) {
+    perror ("ERROR: profiler: malloc failed\n");
+    exit   (1);
+  }
+
+  for (int i = 0; i < prof_nfunctions; i++) prof_functions[i] = &__start_lama_functions[i];
+  memcpy (prof_lines, __start_lama_lines, prof_nlines * sizeof (prof_line));
+  qsort  (prof_functions, prof_nfunctions, sizeof (prof_function*), prof_compare_functions);
+  qsort  (prof_lines, prof_nlines, sizeof (prof_line), prof_compare_lines);
+
+  prof_thread = pthread_self ();
+  atexit (prof_dump);
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_sigaction = prof_handler;
+  sa.sa_flags     = SA_SIGINFO | SA_RESTART;
+  sigemptyset (&sa.sa_mask);
+  sigaction   (SIGPROF, &sa, NULL);
+
+  timer.it_interval.tv_sec  = hz == 1 ? 1 : 0;
+  timer.it_interval.tv_usec = hz == 1 ? 0 : 1000000 / hz;
+  timer.it_value            = timer.it_interval;
+  setitimer (ITIMER_PROF, &timer, NULL);
+}
+
+/* GC statistics, written at exit to the file named by LAMA_GC_STATS */
+static char  *gc_stats_file  = NULL;
+
+static void gc_dump_stats (void) {
+  FILE *f;
+
+  if ((f = fopen (gc_stats_file, "w")) == NULL) {
+    perror ("ERROR: can not open the GC statistics file");
+    return;
+  }
+
+  fprintf (f, "collections %zu\nheap %zu\nmax-pause %llu\n", main_instance.gc_collections,
+           main_instance.from_space.size * sizeof (size_t), main_instance.gc_max_pause / 1000);
+  fclose  (f);
+}
+
+/* Benchmarking.
+
+   Times and counters which may exceed the range of integers are "long"
+   values: arrays [h, l] which stand for h * 10^9 + l with 0 <= l < 10^9;
+   times are in nanoseconds. Allocated words are counted without touching
+   the allocation fast path: the words allocated before alloc_mark are
+   accumulated in allocated_words when a collection starts.
+*/
+
+# define LONG_BASE 1000000000ULL
+
+static void* make_long (unsigned long long n) {
+  return Barray (BOX(2), BOX(n / LONG_BASE), BOX(n % LONG_BASE));
+}
+
+static unsigned long long get_long (char *memo, void *p) {
+  word *a = (word*) p;
+
+  if (UNBOXED(p) || TAG(TO_DATA(p)->tag) != ARRAY_TAG || LEN(TO_DATA(p)->tag) != 2
+      || !UNBOXED(a[0]) || !UNBOXED(a[1]) || UNBOX(a[0]) < 0 || UNBOX(a[1]) < 0 || UNBOX(a[1]) >= LONG_BASE)
+    failure ("long value expected in %s\n", memo);
+
+  return (unsigned long long) UNBOX(a[0]) * LONG_BASE + UNBOX(a[1]);
+}
+
+static unsigned long long clock_ns (void) {
+  struct timespec t;
+
+  clock_gettime (CLOCK_MONOTONIC_RAW, &t);
+
+  return (unsigned long long) t.tv_sec * LONG_BASE + t.tv_nsec;
+}
+
+static unsigned long long allocated_now (void) {
+  return rt->allocated_words + (rt->from_space.current - rt->alloc_mark);
+}
+
+extern void* Lclock () {
+  return make_long (clock_ns ());
+}
+
+extern void* Lallocated () {
+  return make_long (allocated_now ());
+}
+
+extern word Lcollections () {
+  return BOX(rt->gc_collections);
+}
+
+extern void* LlongAdd (void *a, void *b) {
+  return make_long (get_long ("longAdd:1", a) + get_long ("longAdd:2", b));
+}
+
+extern void* LlongSub (void *a, void *b) {
+  unsigned long long x = get_long ("longSub:1", a), y = get_long ("longSub:2", b);
+
+  if (x < y) failure ("negative result in longSub\n");
+
+  return make_long (x - y);
+}
+
+extern void* LlongDiv (void *a, word n) {
+  ASSERT_UNBOXED ("longDiv:2", n);
+
+  if (UNBOX(n) <= 0) failure ("non-positive divisor in longDiv\n");
+
+  return make_long (get_long ("longDiv:1", a) / UNBOX(n));
+}
+
+/* Calls a zero-argument closure n times; returns [time, words, collections] */
+extern void* Lmeasure (void *f, word n) {
+  unsigned long long t, w;
+  size_t             c = rt->gc_collections;
+  void              *time, *words, *r;
+
+  ASSERT_BOXED   ("measure:1", f);
+  ASSERT_UNBOXED ("measure:2", n);
+
+  __pre_gc ();
+
+  push_extra_root (&f);
+
+  w = allocated_now ();
+  t = clock_ns ();
+
+  for (word i = 0; i < UNBOX(n); i++) call_closure (f, 0, NULL);
+
+  t = clock_ns () - t;
+  w = allocated_now () - w;
+  c = rt->gc_collections - c;
+
+  time  = make_long (t);
+  push_extra_root (&time);
+  words = make_long (w);
+  push_extra_root (&words);
+  r     = Barray (BOX(3), time, words, BOX(c));
+  pop_extra_root (&words);
+  pop_extra_root (&time);
+  pop_extra_root (&f);
 
   __post_gc ();
 
-  return s;
+  return r;
 }
 
-extern void* Bclosure (int bn, void *entry, ...) {
-  va_list args; 
-  int     i, ai;
-  register int * ebp asm ("ebp");
-  size_t  *argss;
-  data    *r; 
-  int     n = UNBOX(bn);
-  
-  __pre_gc ();
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf ("Bclosure: create n = %d\n", n); fflush(stdout);
-#endif
-  argss = (ebp + 12);
-  for (i = 0; i<n; i++, argss++) {
-    push_extra_root ((void**)argss);
-  }
+/* Incremental collection.
+
+   When the environment variable LAMA_GC_PAUSE sets a pause target in
+   microseconds, the heap is collected incrementally by replication (after
+   Nettles and O'Toole). A cycle starts when half of the free space is
+   allocated; then each allocation copies the objects reachable from the
+   global variables into the to-space and scans the copies, INC_RATIO
+   words per allocated word but no longer than the pause target. The
+   program goes on using the originals, thus the compiled code needs no
+   read barrier; the forwarding addresses are kept in a table aside.
+
+   The write barrier in Bsta logs the updates of the replicated objects
+   (of large arrays and S-expressions by chunks of INC_CHUNK fields); the
+   logged replicas are refreshed from their originals and scanned again.
+   Closures, whose captured variables the compiled code updates directly,
+   are refreshed in the flip. When the scan and the log are exhausted the
+   next allocation flips: the ordinary collection copies what is reachable
+   from the roots reusing the replicas, and fixes the replicas which are
+   logged or not scanned yet. Thus the final pause depends on the stacks,
+   the live data allocated during the cycle and the recent updates rather
+   than on the whole heap.
+
+   The spaces are doubled when the heap is more than half full of live
+   data, so that a cycle has room to finish, and the tables and the last
+   from-space are kept for the next cycle. A parallel operation abandons a
+   cycle in progress.
+*/
+
+# define INC_RATIO 4   /* words scanned per allocated word          */
+# define INC_CHUNK 256 /* words scanned between the checks of time  */
+
+# define INC_IDLE  0
+# define INC_COPY  1   /* replicating                               */
+# define INC_FLIP  2   /* the scan and the log are exhausted        */
+
+# define INC_NONE  ((size_t) -1)
+
+typedef struct inc_entry {
+  size_t *from, *to;
+  size_t  cards;  /* the flags of the logged chunks of a large object (index + 1) */
+  int     logged;
+} inc_entry;
+
+/* The table is not cleared between cycles: a slot is used if its epoch
+   is the current one */
+typedef struct inc_slot {
+  size_t   index;
+  unsigned epoch;
+} inc_slot;
+
+static void inc_set_trigger (lama_instance *inst) {
+  inst->inc_live    = inst->from_space.current - inst->from_space.begin;
+  inst->inc_trigger = inst->inc_pause == 0 ? inst->from_space.end
+    : inst->from_space.current + (inst->from_space.end - inst->from_space.current) / 2;
+}
 
-  r = (data*) alloc (sizeof(int) * (n+2));
-  
-  r->tag = CLOSURE_TAG | ((n + 1) << 3);
-  ((void**) r->contents)[0] = entry;
-  
-  va_start(args, entry);
+/* The number of words of an object and the beginning of its header */
+static size_t inc_object (size_t *obj, size_t **start) {
+  data *d = TO_DATA(obj);
+
+  *start = (size_t*) d;
   
-  for (i = 0; i<n; i++) {
-    ai = va_arg(args, int);
-    ((int*)r->contents)[i+1] = ai;
+  switch (TAG(d->tag)) {
+  case CLOSURE_TAG: return LEN(d->tag) + 1;
+  case ARRAY_TAG  : return ((LEN(d->tag) + 1) * sizeof (word) - 1) / sizeof (size_t) + 1;
+  case STRING_TAG : return (LEN(d->tag) + sizeof (word)) / sizeof (size_t) + 1;
+  case SEXP_TAG   : *start = (size_t*) TO_SEXP(obj); return LEN(d->tag) + 2;
+  default         : failure ("incremental collection: weird tag %d\n", TAG(d->tag));
   }
-  
-  va_end(args);
 
-  __post_gc();
-
-  argss--;
-  for (i = 0; i<n; i++, argss--) {
-    pop_extra_root ((void**)argss);
-  }
+  return 0;
+}
 
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("Bclosure: ends\n", n); fflush(stdout);
-  indent--;
-#endif
+/* The number of fields which may refer to other objects */
+static size_t inc_fields (size_t *obj) {
+  data *d = TO_DATA(obj);
 
-  return r->contents;
+  return TAG(d->tag) == STRING_TAG ? 0 : LEN(d->tag);
 }
 
-extern void* Barray (int bn, ...) {
-  va_list args; 
-  int     i, ai; 
-  data    *r; 
-  int     n = UNBOX(bn);
-    
-  __pre_gc ();
+static void* inc_grow (void *v, size_t *size, size_t item) {
+  *size = *size == 0 ? 1024 : 2 * *size;
   
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf ("Barray: create n = %d\n", n); fflush(stdout);
-#endif
-  r = (data*) alloc (sizeof(int) * (n+1));
+  if ((v = realloc (v, *size * item)) == NULL) failure ("incremental collection: out of memory\n");
 
-  r->tag = ARRAY_TAG | (n << 3);
-  
-  va_start(args, bn);
-  
-  for (i = 0; i<n; i++) {
-    ai = va_arg(args, int);
-    ((int*)r->contents)[i] = ai;
-  }
-  
-  va_end(args);
+  return v;
+}
 
-  __post_gc();
-#ifdef DEBUG_PRINT
-  indent--;
-#endif
-  return r->contents;
+static void inc_push (size_t **v, size_t *number, size_t *size, size_t x) {
+  if (*number == *size) *v = (size_t*) inc_grow (*v, size, sizeof (size_t));
+
+  (*v)[(*number)++] = x;
 }
 
-extern void* Bsexp (int bn, ...) {
-  va_list args; 
-  int     i;    
-  int     ai;  
-  size_t *p;  
-  sexp   *r;  
-  data   *d;  
-  int n = UNBOX(bn); 
+static size_t inc_hash (size_t *p) {
+  return ((size_t) p / sizeof (size_t) * 2654435761u) & (2 * rt->inc_size - 1);
+}
 
-  __pre_gc () ;
-  
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf("Bsexp: allocate %zu!\n",sizeof(int) * (n+1)); fflush (stdout);
-#endif
-  r = (sexp*) alloc (sizeof(int) * (n+1));
-  d = &(r->contents);
-  r->tag = 0;
-    
-  d->tag = SEXP_TAG | ((n-1) << 3);
-  
-  va_start(args, bn);
-  
-  for (i=0; i<n-1; i++) {
-    ai = va_arg(args, int);
-    
-    p = (size_t*) ai;
-    ((int*)d->contents)[i] = ai;
-  }
+static inc_entry* inc_lookup (size_t *p) {
+  inc_slot *s;
+  size_t    h;
 
-  r->tag = UNBOX(va_arg(args, int));
+  if (rt->inc_table == NULL) return NULL;
 
-#ifdef DEBUG_PRINT
-  r->tag = SEXP_TAG | ((r->tag) << 3);
-  print_indent ();
-  printf("Bsexp: ends\n"); fflush (stdout);
-  indent--;
-#endif
+  for (h = inc_hash (p); (s = &rt->inc_table[h])->epoch == rt->inc_epoch; h = (h + 1) & (2 * rt->inc_size - 1))
+    if (rt->inc_entries[s->index].from == p) return &rt->inc_entries[s->index];
 
-  va_end(args);
+  return NULL;
+}
 
-  __post_gc();
+static void inc_add (size_t i) {
+  size_t h;
 
-  return d->contents;
+  for (h = inc_hash (rt->inc_entries[i].from); rt->inc_table[h].epoch == rt->inc_epoch; h = (h + 1) & (2 * rt->inc_size - 1));
+
+  rt->inc_table[h].index = i;
+  rt->inc_table[h].epoch = rt->inc_epoch;
 }
 
-extern int Btag (void *d, int t, int n) {
-  data *r; 
-  
-  if (UNBOXED(d)) return BOX(0);
-  else {
-    r = TO_DATA(d);
-#ifndef DEBUG_PRINT
-    return BOX(TAG(r->tag) == SEXP_TAG && TO_SEXP(d)->tag == UNBOX(t) && LEN(r->tag) == UNBOX(n));
-#else
-    return BOX(TAG(r->tag) == SEXP_TAG &&
-               GET_SEXP_TAG(TO_SEXP(d)->tag) == UNBOX(t) && LEN(r->tag) == UNBOX(n));
-#endif
-  }
+/* The replica of an object during a cycle, NULL if none */
+static size_t* inc_forward (size_t *obj) {
+  inc_entry *e = inc_lookup (obj);
+
+  return e == NULL ? NULL : e->to;
 }
 
-extern int Barray_patt (void *d, int n) {
-  data *r; 
-  
-  if (UNBOXED(d)) return BOX(0);
+/* The write barrier: the field i of p is updated */
+static void inc_barrier (void *p, size_t i) {
+  inc_entry *e = inc_lookup ((size_t*) p);
+  size_t     n, c = i / INC_CHUNK;
+
+  if (e == NULL) return;
+
+  if ((n = inc_fields (e->to)) <= INC_CHUNK) {
+    if (e->logged) return;
+    e->logged = 1;
+    c         = 0;
+  }
   else {
-    r = TO_DATA(d);
-    return BOX(TAG(r->tag) == ARRAY_TAG && LEN(r->tag) == UNBOX(n));
+    if (e->cards == 0) {
+      n = (n - 1) / INC_CHUNK + 1;
+      while (rt->inc_cards_number + n > rt->inc_cards_size)
+        rt->inc_cards = (unsigned char*) inc_grow (rt->inc_cards, &rt->inc_cards_size, 1);
+      memset (rt->inc_cards + rt->inc_cards_number, 0, n);
+      e->cards = rt->inc_cards_number + 1;
+      rt->inc_cards_number += n;
+    }
+    if (rt->inc_cards[e->cards - 1 + c]) return;
+    rt->inc_cards[e->cards - 1 + c] = 1;
   }
+  
+  inc_push (&rt->inc_log, &rt->inc_log_number, &rt->inc_log_size, e - rt->inc_entries);
+  inc_push (&rt->inc_log, &rt->inc_log_number, &rt->inc_log_size, c);
 }
 
-extern int Bstring_patt (void *x, void *y) {
-  data *rx = (data *) BOX (NULL),
-       *ry = (data *) BOX (NULL);
+static inc_entry* inc_insert (size_t *from, size_t *to) {
+  inc_entry *e;
   
-  ASSERT_STRING(".string_patt:2", y);
-      
-  if (UNBOXED(x)) return BOX(0);
-  else {
-    rx = TO_DATA(x); ry = TO_DATA(y);
-
-    if (TAG(rx->tag) != STRING_TAG) return BOX(0);
+  if (rt->inc_number == rt->inc_size) {
+    rt->inc_entries = (inc_entry*) inc_grow (rt->inc_entries, &rt->inc_size, sizeof (inc_entry));
+    free (rt->inc_table);
     
-    return BOX(strcmp (rx->contents, ry->contents) == 0 ? 1 : 0);
+    if ((rt->inc_table = (inc_slot*) calloc (2 * rt->inc_size, sizeof (inc_slot))) == NULL)
+      failure ("incremental collection: out of memory\n");
+
+    rt->inc_epoch = 1;
+    for (size_t i = 0; i < rt->inc_number; i++) inc_add (i);
   }
+
+  e = &rt->inc_entries[rt->inc_number];
+  e->from   = from;
+  e->to     = to;
+  e->cards  = 0;
+  e->logged = 0;
+
+  inc_add (rt->inc_number++);
+
+  return e;
 }
 
-extern int Bclosure_tag_patt (void *x) {
-  if (UNBOXED(x)) return BOX(0);
+/* Replicates an object (if it has not been yet) without scanning it */
+static size_t* inc_copy (size_t *obj) {
+  inc_entry *e;
+  size_t    *start, *copy, n;
+
+  if (!IS_VALID_HEAP_POINTER(obj)) return obj;
+  if ((e = inc_lookup (obj)) != NULL) return e->to;
+
+  n    = inc_object (obj, &start);
+  copy = rt->to_space.current + (obj - start);
+  memcpy (rt->to_space.current, start, n * sizeof (size_t));
+  rt->to_space.current += n;
+
+  e = inc_insert (obj, copy);
   
-  return BOX(TAG(TO_DATA(x)->tag) == CLOSURE_TAG);
+  if (TAG(TO_DATA(obj)->tag) == CLOSURE_TAG)
+    inc_push (&rt->inc_closures, &rt->inc_closures_number, &rt->inc_closures_size, e - rt->inc_entries);
+
+  return copy;
 }
 
-extern int Bboxed_patt (void *x) {
-  return BOX(UNBOXED(x) ? 0 : 1);
+/* Ends a cycle; the tables are kept for the next one, as freeing them
+   takes a while */
+static void inc_release (void) {
+  rt->inc_phase           = INC_IDLE;
+  rt->inc_number          = 0;
+  rt->inc_scan            = 0;
+  rt->inc_log_number      = 0;
+  rt->inc_closures_number = 0;
+  rt->inc_cards_number    = 0;
 }
 
-extern int Bunboxed_patt (void *x) {
-  return BOX(UNBOXED(x) ? 1 : 0);
+/* Abandons a cycle */
+static void inc_abort (void) {
+  if (rt->inc_phase == INC_IDLE) return;
+
+  free_pool   (&rt->to_space);
+  inc_release ();
 }
 
-extern int Barray_tag_patt (void *x) {
-  if (UNBOXED(x)) return BOX(0);
+static void inc_start (void) {
+  init_to_space (2 * rt->inc_live > rt->space_size);
   
-  return BOX(TAG(TO_DATA(x)->tag) == ARRAY_TAG);
-}
+  rt->inc_phase = INC_COPY;
+  rt->inc_item  = INC_NONE;
 
-extern int Bstring_tag_patt (void *x) {
-  if (UNBOXED(x)) return BOX(0);
+  if (rt->inc_table != NULL && ++rt->inc_epoch == 0) {
+    memset (rt->inc_table, 0, 2 * rt->inc_size * sizeof (inc_slot));
+    rt->inc_epoch = 1;
+  }
   
-  return BOX(TAG(TO_DATA(x)->tag) == STRING_TAG);
+  for (size_t *p = rt->globals; p < globals_end (rt); p++)
+    inc_copy ((size_t*) *p);
 }
 
-extern int Bsexp_tag_patt (void *x) {
-  if (UNBOXED(x)) return BOX(0);
+/* Copies a string or the fields [from, to) of an original into the replica */
+static void inc_refresh (inc_entry *e, size_t from, size_t to) {
+  size_t *start, n;
   
-  return BOX(TAG(TO_DATA(x)->tag) == SEXP_TAG);
+  if (TAG(TO_DATA(e->from)->tag) == STRING_TAG) {
+    n = inc_object (e->from, &start);
+    memcpy (e->to - (e->from - start), start, n * sizeof (size_t));
+  }
+  else memcpy (e->to + from, e->from + from, (to - from) * sizeof (size_t));
 }
 
-extern void* Bsta (void *v, int i, void *x) {
-  if (UNBOXED(i)) {
-    ASSERT_BOXED(".sta:3", x);
-    //    ASSERT_UNBOXED(".sta:2", i);
+/* Takes the fields to scan next, either of a new replica or logged ones;
+   returns 0 if there are none */
+static int inc_next (void) {
+  inc_entry *e;
+  size_t     c;
   
-    if (TAG(TO_DATA(x)->tag) == STRING_TAG)((char*) x)[UNBOX(i)] = (char) UNBOX(v);
-    else ((int*) x)[UNBOX(i)] = (int) v;
-
-    return v;
+  if (rt->inc_scan < rt->inc_number) {
+    rt->inc_item   = rt->inc_scan++;
+    rt->inc_offset = 0;
+    rt->inc_end    = inc_fields (rt->inc_entries[rt->inc_item].to);
+    rt->inc_fresh  = 0;
+    return 1;
   }
 
-  * (void**) x = v;
+  if (rt->inc_log_number == 0) return 0;
 
-  return v;
-}
+  c              = rt->inc_log[--rt->inc_log_number];
+  rt->inc_item   = rt->inc_log[--rt->inc_log_number];
+  e              = &rt->inc_entries[rt->inc_item];
+  rt->inc_offset = c * INC_CHUNK;
+  rt->inc_end    = inc_fields (e->to);
+  rt->inc_fresh  = 1;
 
-static void fix_unboxed (char *s, va_list va) {
-  size_t *p = (size_t*)va;
-  int i = 0;
-  
-  while (*s) {
-    if (*s == '%') {
-      size_t n = p [i];
-      if (UNBOXED (n)) {
-	p[i] = UNBOX(n);
-      }
-      i++;
-    }
-    s++;
+  if (e->cards == 0) e->logged = 0;
+  else {
+    rt->inc_cards[e->cards - 1 + c] = 0;
+    if (rt->inc_end > rt->inc_offset + INC_CHUNK) rt->inc_end = rt->inc_offset + INC_CHUNK;
   }
-}
 
-extern void Lfailure (char *s, ...) {
-  va_list args;
-  
-  va_start    (args, s);
-  fix_unboxed (s, args);
-  vfailure    (s, args);
-}
+  if (rt->inc_end == 0) inc_refresh (e, 0, 0);
 
-extern void Bmatch_failure (void *v, char *fname, int line, int col) {
-  createStringBuf ();
-  printValue (v);
-  failure ("match failure at %s:%d:%d, value '%s'\n",
-	   fname, UNBOX(line), UNBOX(col), stringBuf.contents);
+  return 1;
 }
 
-extern void* /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
-  data *da = (data*) BOX (NULL);
-  data *db = (data*) BOX (NULL);
-  data *d  = (data*) BOX (NULL);
+/* Makes a step of a cycle on an allocation of size words, starting the
+   cycle if needed; returns 0 if it is time to flip */
+static int inc_step (size_t size) {
+  unsigned long long t    = 0;
+  size_t             work = 0, next = INC_CHUNK, *p, *o, k;
 
-  ASSERT_STRING("++:1", a);
-  ASSERT_STRING("++:2", b);
+  if (rt->inc_phase == INC_FLIP) return 0;
+  if (! rt->enable_GC) return 1;
   
-  da = TO_DATA(a);
-  db = TO_DATA(b);
+  if (rt->inc_phase == INC_IDLE) {
+    t = clock_ns ();
+    inc_start ();
+  }
 
-  __pre_gc () ;
+  while (work < size * INC_RATIO) {
+    if (rt->inc_item == INC_NONE && !inc_next ()) {
+      rt->inc_phase = INC_FLIP;
+      break;
+    }
 
-  push_extra_root (&a);
-  push_extra_root (&b);
-  d  = (data *) alloc (sizeof(int) + LEN(da->tag) + LEN(db->tag) + 1);
-  pop_extra_root (&b);
-  pop_extra_root (&a);
+    /* a large object is scanned in chunks */
+    p = rt->inc_entries[rt->inc_item].to;
+    o = rt->inc_entries[rt->inc_item].from;
+    k = rt->inc_end - rt->inc_offset > INC_CHUNK ? rt->inc_offset + INC_CHUNK : rt->inc_end;
+    
+    for (size_t j = rt->inc_offset; j < k; j++)
+      p[j] = (size_t) inc_copy ((size_t*) (rt->inc_fresh ? o[j] : p[j]));
 
-  da = TO_DATA(a);
-  db = TO_DATA(b);
-  
-  d->tag = STRING_TAG | ((LEN(da->tag) + LEN(db->tag)) << 3);
+    work += k - rt->inc_offset + 1;
+    
+    if (k == rt->inc_end) rt->inc_item = INC_NONE;
+    else rt->inc_offset = k;
 
-  strncpy (d->contents               , da->contents, LEN(da->tag));
-  strncpy (d->contents + LEN(da->tag), db->contents, LEN(db->tag));
-  
-  d->contents[LEN(da->tag) + LEN(db->tag)] = 0;
+    if (work >= next) {
+      next = work + INC_CHUNK;
+      if (t == 0) t = clock_ns ();
+      else if (clock_ns () - t >= rt->inc_pause) break;
+    }
+  }
 
-  __post_gc();
+  if (t != 0 && (t = clock_ns () - t) > rt->gc_max_pause) rt->gc_max_pause = t;
   
-  return d->contents;
+  return 1;
 }
 
-extern void* Lsprintf (char * fmt, ...) {
-  va_list args;
-  void *s;
-
-  ASSERT_STRING("sprintf:1", fmt);
-  
-  va_start (args, fmt);
-  fix_unboxed (fmt, args);
-  
-  createStringBuf ();
-
-  vprintStringBuf (fmt, args);
-
-  __pre_gc ();
-
-  push_extra_root ((void**)&fmt);
-  s = Bstring (stringBuf.contents);
-  pop_extra_root ((void**)&fmt);
+/* Fixes the fields [from, to) of a replica which may refer to the
+   from-space, refreshing them first if needed */
+static void inc_fix (size_t i, size_t from, size_t to, int refresh) {
+  size_t *p = rt->inc_entries[i].to;
 
-  __post_gc ();
-  
-  deleteStringBuf ();
+  if (refresh) inc_refresh (&rt->inc_entries[i], from, to);
 
-  return s;
+  for (size_t j = from; j < to; j++)
+    if (IS_VALID_HEAP_POINTER(p[j])) p[j] = (size_t) gc_copy ((size_t*) p[j]);
 }
 
-extern void* LgetEnv (char *var) {
-  char *e = getenv (var);
-  void *s;
+/* Finishes a cycle in the flip once the roots are copied; the originals
+   of the replicas are intact as gc_copy forwards them to the replicas */
+static void inc_finish (void) {
+  size_t i, c, n;
   
-  if (e == NULL)
-    return BOX(0);
-
-  __pre_gc ();
-
-  s = Bstring (e);
+  if (rt->inc_item != INC_NONE) inc_fix (rt->inc_item, rt->inc_offset, rt->inc_end, rt->inc_fresh);
 
-  __post_gc ();
+  while (rt->inc_log_number > 0) {
+    c = rt->inc_log[--rt->inc_log_number];
+    i = rt->inc_log[--rt->inc_log_number];
+    n = inc_fields (rt->inc_entries[i].to);
+    
+    if (rt->inc_entries[i].cards == 0) inc_fix (i, 0, n, 1);
+    else inc_fix (i, c * INC_CHUNK, n - c * INC_CHUNK > INC_CHUNK ? (c + 1) * INC_CHUNK : n, 1);
+  }
+  
+  for (i = 0; i < rt->inc_closures_number; i++) {
+    c = rt->inc_closures[i];
+    inc_fix (c, 0, inc_fields (rt->inc_entries[c].to), 1);
+  }
+  
+  for (i = rt->inc_scan; i < rt->inc_number; i++) inc_fix (i, 0, inc_fields (rt->inc_entries[i].to), 0);
 
-  return s;
+  inc_release ();
 }
 
-extern int Lsystem (char *cmd) {
-  return BOX (system (cmd));
+/* Parallel array combinators.
+
+   parMapArray, parInitArray and parReduce run a closure over the chunks of
+   an array on a pool of worker threads together with the calling thread;
+   the threads take chunks in turn. Everything the GC needs to know about
+   a thread (its stack bounds, extra roots and stack segments) is
+   thread-local and registered in the table of mutators. While a parallel
+   operation runs, threads allocate from thread-local allocation buffers
+   (TLABs) carved out of the shared heap under a lock. A thread which finds
+   the heap full stops the world: it waits until every other thread has
+   reached a safepoint (a refill, the end of its work or a wait for a
+   collection) and collects, scanning the roots of all threads. Thus a
+   thread which neither allocates nor finishes delays a collection. The
+   closures must not use fibers or read input (see "Buffered input");
+   regexps are matched one thread at a time (see "Regular expressions");
+   output from several threads may interleave. Nested parallel operations
+   run sequentially.
+*/
+
+# define PAR_THREADS 64
+# define TLAB_SIZE   4096   /* in words */
+
+typedef struct mutator {
+  pthread_t          thread;
+  size_t            *top;
+  size_t            *bottom;
+  stack_segment     *segments;
+  int               *segments_number;
+  extra_roots_pool  *roots;
+  size_t           **tlab_current;
+  size_t           **tlab_end;
+} mutator;
+
+enum {PAR_MAP, PAR_INIT, PAR_REDUCE};
+
+typedef struct par_job {
+  int   kind;
+  void *f;       /* the closure                                    */
+  void *src;     /* the source array (PAR_MAP and PAR_REDUCE)      */
+  void *dst;     /* the result array or the results of the chunks  */
+  int   n;       /* the number of elements                         */
+  int   chunks;
+  int   next;    /* the next chunk to take                         */
+} par_job;
+
+static __thread int     mutator_id   = 0;
+static __thread int     par_worker   = 0;
+static __thread size_t *tlab_current = NULL;
+static __thread size_t *tlab_end     = NULL;
+
+static void* gc (size_t size);
+
+/* Registers the current thread as the mutator i */
+static void par_register (int i) {
+  mutator *m = &rt->mutators[i];
+
+  m->top             = &__gc_stack_top;
+  m->bottom          = &__gc_stack_bottom;
+  m->segments        = stack_segments;
+  m->segments_number = &stack_segments_number;
+  m->roots           = &extra_roots;
+  m->tlab_current    = &tlab_current;
+  m->tlab_end        = &tlab_end;
+  mutator_id         = i;
 }
 
-extern void Lfprintf (FILE *f, char *s, ...) {
-  va_list args = (va_list) BOX (NULL);
+static void par_reset_tlabs (void) {
+  for (int i = 0; i < rt->mutators_number; i++)
+    if (rt->mutators[i].top != NULL) {
+      *rt->mutators[i].tlab_current = NULL;
+      *rt->mutators[i].tlab_end     = NULL;
+    }
+}
 
-  ASSERT_BOXED("fprintf:1", f);
-  ASSERT_STRING("fprintf:2", s);  
+/* Stops the world and collects; called with par_lock held out of a
+   safepoint */
+static size_t* par_collect (size_t size) {
+  size_t *p;
   
-  va_start    (args, s);
-  fix_unboxed (s, args);
+  rt->par_collecting = 1;
+
+  while (rt->par_running > 0) pthread_cond_wait (&rt->par_cond, &rt->par_lock);
+
+  par_reset_tlabs ();
+  rt->allocated_words += rt->from_space.current - rt->alloc_mark;
+  init_to_space (0);
+  p = gc (size);
+  rt->alloc_mark = p;
   
-  if (vfprintf (f, s, args) < 0) {
-    failure ("fprintf (...): %s\n", strerror (errno));
-  }
-}
+  rt->par_collecting = 0;
+  pthread_cond_broadcast (&rt->par_cond);
 
-extern void Lprintf (char *s, ...) {
-  va_list args = (va_list) BOX (NULL);
+  return p;
+}
 
-  ASSERT_STRING("printf:1", s);
+/* Allocates size words while a parallel operation runs; large objects
+   are allocated in the shared heap directly */
+static void* par_alloc (size_t size) {
+  size_t *p;
 
-  va_start    (args, s);
-  fix_unboxed (s, args);
-  
-  if (vprintf (s, args) < 0) {
-    failure ("fprintf (...): %s\n", strerror (errno));
+  if (tlab_current + size < tlab_end) {
+    p = tlab_current;
+    tlab_current += size;
+    return p;
   }
 
-  fflush (stdout);
-}
-
-extern FILE* Lfopen (char *f, char *m) {
-  FILE* h;
+  pthread_mutex_lock (&rt->par_lock);
+  
+  rt->par_running--;
+  pthread_cond_broadcast (&rt->par_cond);
+  
+  while (rt->par_collecting) pthread_cond_wait (&rt->par_cond, &rt->par_lock);
 
-  ASSERT_STRING("fopen:1", f);
-  ASSERT_STRING("fopen:2", m);
+  if (size >= TLAB_SIZE / 4) {
+    if (rt->from_space.current + size < rt->from_space.end) {
+      p = rt->from_space.current;
+      rt->from_space.current += size;
+    }
+    else p = par_collect (size);
+  }
+  else {
+    if (rt->from_space.current + TLAB_SIZE < rt->from_space.end) {
+      tlab_current = rt->from_space.current;
+      rt->from_space.current += TLAB_SIZE;
+    }
+    else tlab_current = par_collect (TLAB_SIZE);
 
-  h = fopen (f, m);
+    tlab_end      = tlab_current + TLAB_SIZE;
+    p             = tlab_current;
+    tlab_current += size;
+  }
   
-  if (h)
-    return h;
+  rt->par_running++;
+  
+  pthread_mutex_unlock (&rt->par_lock);
 
-  failure ("fopen (\"%s\", \"%s\"): %s, %s, %s\n", f, m, strerror (errno));
+  return p;
 }
 
-extern void Lfclose (FILE *f) {
-  ASSERT_BOXED("fclose", f);
+/* Scans the roots of the other threads; they are at safepoints. Idle
+   workers hold no roots, and their stale stacks may point into a reused
+   space */
+static void gc_root_scan_mutators (void) {
+  if (! rt->par_active) return;
+  
+  for (int i = 0; i < rt->mutators_number; i++) {
+    mutator *m = &rt->mutators[i];
+    size_t  *p;
 
-  fclose (f);
-}
+    if (i == mutator_id || m->top == NULL) continue;
 
-extern void* LreadLine () {
-  char *buf;
+    p = (size_t*) *m->top;
 
-  if (scanf ("%m[^\n]", &buf) == 1) {
-    void * s = Bstring (buf);
+    if (p != NULL)
+      while (++p < (size_t*) *m->bottom) gc_test_and_copy_root ((size_t**) p);
 
-    getchar ();
-    
-    free (buf);
-    return s;
-  }
-  
-  if (errno != 0)
-    failure ("readLine (): %s\n", strerror (errno));
+    for (int j = 0; j < *m->segments_number; j++) {
+      p = (size_t*) m->segments[j].top;
+      while (++p < (size_t*) m->segments[j].bottom) gc_test_and_copy_root ((size_t**) p);
+    }
 
-  return (void*) BOX (0);
+    for (int j = 0; j < m->roots->current_free; j++)
+      gc_test_and_copy_root ((size_t**) m->roots->roots[j]);
+  }
 }
 
-extern void* Lfread (char *fname) {
-  FILE *f;
+/* The main thread runs a closure from inside a built-in, while a worker
+   has no Lama frames below */
+static void* par_call (void *f, int n, void *x, void *y) {
+  void *args [2] = {x, y};
 
-  ASSERT_STRING("fread", fname);
+  return par_worker ? __call_closure (f, n, args) : call_closure (f, n, args);
+}
 
-  f = fopen (fname, "r");
+static void par_work (par_job *job) {
+  int c;
   
-  if (f) {
-    if (fseek (f, 0l, SEEK_END) >= 0) {
-      long size = ftell (f);
-      void *s   = LmakeString (BOX(size));
-      
-      rewind (f);
+  while ((c = __sync_fetch_and_add (&job->next, 1)) < job->chunks) {
+    int   lo = (int) ((long long) job->n * c / job->chunks),
+          hi = (int) ((long long) job->n * (c + 1) / job->chunks);
+    void *r;
+    
+    switch (job->kind) {
+    case PAR_MAP:
+      for (int i = lo; i < hi; i++) {
+        r = par_call (job->f, 1, ((void**) job->src)[i], NULL);
+        ((void**) job->dst)[i] = r;
+      }
+      break;
 
-      if (fread (s, 1, size, f) == size) {
-	fclose (f);
-	return s;
+    case PAR_INIT:
+      for (int i = lo; i < hi; i++) {
+        r = par_call (job->f, 1, (void*) BOX(i), NULL);
+        ((void**) job->dst)[i] = r;
       }
+      break;
+
+    case PAR_REDUCE:
+      r = ((void**) job->src)[lo];
+      for (int i = lo + 1; i < hi; i++) r = par_call (job->f, 2, r, ((void**) job->src)[i]);
+      ((void**) job->dst)[c] = r;
+      break;
     }
   }
-
-  failure ("fread (\"%s\"): %s\n", fname, strerror (errno));
 }
 
-extern void Lfwrite (char *fname, char *contents) {
-  FILE *f;
+static void* par_worker_loop (void *instance) {
+  unsigned epoch = 0;
 
-  ASSERT_STRING("fwrite:1", fname);
-  ASSERT_STRING("fwrite:2", contents);
+  rt         = (lama_instance*) instance;
+  par_worker = 1;
+  set_globals (rt);
   
-  f = fopen (fname, "w");
+  pthread_mutex_lock (&rt->par_lock);
+  par_register (rt->mutators_number++);
 
-  if (f) {
-    if (fprintf (f, "%s", contents) < 0);
-    else {
-      fclose (f);
-      return;
-    }
+  for (;;) {
+    while ((rt->par_epoch == epoch || rt->par_collecting) && ! rt->par_exit)
+      pthread_cond_wait (&rt->par_cond, &rt->par_lock);
+
+    if (rt->par_exit) break;
+    
+    epoch = rt->par_epoch;
+    rt->par_running++;
+    pthread_mutex_unlock (&rt->par_lock);
+
+    par_work (rt->par_current);
+
+    pthread_mutex_lock (&rt->par_lock);
+    rt->par_running--;
+    rt->par_pending--;
+    pthread_cond_broadcast (&rt->par_cond);
   }
 
-  failure ("fwrite (\"%s\"): %s\n", fname, strerror (errno));
+  pthread_mutex_unlock (&rt->par_lock);
+  
+  return NULL;
 }
 
-extern void* Lfst (void *v) {
-  return Belem (v, BOX(0));  
-}
+/* Creates the pool of the current instance; its size is the number of
+   processors less one (the calling thread works too) or LAMA_THREADS. The
+   mutator 0 is the thread which runs a parallel operation */
+static void par_init (void) {
+  char *env = getenv ("LAMA_THREADS");
+  int   n   = env != NULL ? atoi (env) - 1 : (int) sysconf (_SC_NPROCESSORS_ONLN) - 1;
 
-extern void* Lsnd (void *v) {
-  return Belem (v, BOX(1));  
-}
+  if (n > PAR_THREADS) n = PAR_THREADS;
+  if (n < 0)           n = 0;
 
-extern void* Lhd (void *v) {
-  return Belem (v, BOX(0));  
+  if ((rt->mutators = (mutator*) calloc (n + 1, sizeof (mutator))) == NULL)
+    failure ("parallel: out of memory\n");
+  
+  pthread_mutex_lock (&rt->par_lock);
+  
+  rt->mutators_number = 1;
+  
+  for (rt->par_threads = 0; rt->par_threads < n; rt->par_threads++)
+    if (pthread_create (&rt->mutators[rt->par_threads + 1].thread, NULL, par_worker_loop, rt)) break;
+  
+  pthread_mutex_unlock (&rt->par_lock);
 }
 
-extern void* Ltl (void *v) {
-  return Belem (v, BOX(1));  
+/* Stops the pool of an instance */
+static void par_shutdown (lama_instance *inst) {
+  if (inst->par_threads <= 0) return;
+  
+  pthread_mutex_lock (&inst->par_lock);
+  inst->par_exit = 1;
+  pthread_cond_broadcast (&inst->par_cond);
+  pthread_mutex_unlock (&inst->par_lock);
+
+  for (int i = 1; i <= inst->par_threads; i++) pthread_join (inst->mutators[i].thread, NULL);
 }
 
-/* Lread is an implementation of the "read" construct */
-extern int Lread () {
-  int result = BOX(0);
+static void* par_run (par_job *job) {
+  __pre_gc ();
 
-  printf ("> "); 
-  fflush (stdout);
-  scanf  ("%d", &result);
+  push_extra_root (&job->f);
+  push_extra_root (&job->src);
+  job->dst = LmakeArray (BOX(job->kind == PAR_REDUCE ? job->chunks : job->n));
+  push_extra_root (&job->dst);
 
-  return BOX(result);
+  if (rt->par_active || par_worker || rt->par_threads == 0 || job->chunks < 2) par_work (job);
+  else {
+    inc_abort ();
+    
+    pthread_mutex_lock (&rt->par_lock);
+
+    par_register (0);
+    rt->par_current = job;
+    rt->par_active  = 1;
+    rt->par_running = 1;
+    rt->par_pending = rt->par_threads;
+    rt->par_epoch++;
+    
+    pthread_cond_broadcast (&rt->par_cond);
+    pthread_mutex_unlock (&rt->par_lock);
+
+    par_work (job);
+
+    pthread_mutex_lock (&rt->par_lock);
+    
+    rt->par_running--;
+    pthread_cond_broadcast (&rt->par_cond);
+
+    while (rt->par_pending > 0) pthread_cond_wait (&rt->par_cond, &rt->par_lock);
+    
+    par_reset_tlabs ();
+    rt->par_active  = 0;
+    rt->par_current = NULL;
+    
+    pthread_mutex_unlock (&rt->par_lock);
+  }
+  
+  pop_extra_root (&job->dst);
+  pop_extra_root (&job->src);
+  pop_extra_root (&job->f);
+  
+  __post_gc ();
+
+  return job->dst;
 }
 
-/* Lwrite is an implementation of the "write" construct */
-extern int Lwrite (int n) {
-  printf ("%d\n", UNBOX(n));
-  fflush (stdout);
+static int par_chunks (int n) {
+  int c = 8 * (rt->par_threads > 0 ? rt->par_threads + 1 : 1);
 
-  return 0;
+  return n < c ? n : c;
 }
 
-extern int Lrandom (int n) {
-  ASSERT_UNBOXED("Lrandom, 0", n);
+/* Maps a closure over an array in parallel */
+extern void* LparMapArray (void *f, void *a) {
+  par_job job;
+  
+  ASSERT_BOXED ("parMapArray:1", f);
+  ASSERT_BOXED ("parMapArray:2", a);
 
-  if (UNBOX(n) <= 0) {
-    failure ("invalid range in random: %d\n", UNBOX(n));
-  }
+  if (TAG(TO_DATA(a)->tag) != ARRAY_TAG) failure ("array expected in parMapArray\n");
+
+  job.kind = PAR_MAP;
+  job.f    = f;
+  job.src  = a;
+  job.n    = LEN(TO_DATA(a)->tag);
   
-  return BOX (random () % UNBOX(n));
+  if (rt->par_threads < 0 && ! par_worker) par_init ();
+
+  job.chunks = par_chunks (job.n);
+  job.next   = 0;
+  
+  return par_run (&job);
 }
 
-extern int Ltime () {
-  struct timespec t;
+/* Creates an array [f (0), ..., f (n-1)] in parallel */
+extern void* LparInitArray (word n, void *f) {
+  par_job job;
   
-  clock_gettime (CLOCK_MONOTONIC_RAW, &t);
+  ASSERT_UNBOXED ("parInitArray:1", n);
+  ASSERT_BOXED   ("parInitArray:2", f);
+
+  job.kind = PAR_INIT;
+  job.f    = f;
+  job.src  = (void*) BOX(0);
+  job.n    = UNBOX(n);
   
-  return BOX(t.tv_sec * 1000000 + t.tv_nsec / 1000);
+  if (rt->par_threads < 0 && ! par_worker) par_init ();
+
+  job.chunks = par_chunks (job.n);
+  job.next   = 0;
+  
+  return par_run (&job);
 }
 
-extern void set_args (int argc, char *argv[]) {
-  data *a;
-  int n = argc, *p = NULL;
-  int i;
+/* Folds an array with an associative closure: the chunks are folded in
+   parallel, then their results are folded from left to right starting
+   with z */
+extern void* LparReduce (void *f, void *z, void *a) {
+  par_job job;
+  void   *r;
   
-  __pre_gc ();
+  ASSERT_BOXED ("parReduce:1", f);
+  ASSERT_BOXED ("parReduce:3", a);
 
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf ("set_args: call: n=%i &p=%p p=%p: ", n, &p, p); fflush(stdout);
-  for (i = 0; i < n; i++)
-    printf("%s ", argv[i]);
-  printf("EE\n");
-#endif
+  if (TAG(TO_DATA(a)->tag) != ARRAY_TAG) failure ("array expected in parReduce\n");
 
-  p = LmakeArray (BOX(n));
-  push_extra_root ((void**)&p);
+  job.kind = PAR_REDUCE;
+  job.f    = f;
+  job.src  = a;
+  job.n    = LEN(TO_DATA(a)->tag);
   
-  for (i=0; i<n; i++) {
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("set_args: iteration %i %p %p ->\n", i, &p, p); fflush(stdout);
-#endif
-    ((int*)p) [i] = (int) Bstring (argv[i]);
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("set_args: iteration %i <- %p %p\n", i, &p, p); fflush(stdout);
-#endif
-  }
+  if (rt->par_threads < 0 && ! par_worker) par_init ();
 
-  pop_extra_root ((void**)&p);
-  __post_gc ();
+  job.chunks = par_chunks (job.n);
+  job.next   = 0;
 
-  global_sysargs = p;
-  push_extra_root ((void**)&global_sysargs);
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("set_args: end\n", n, &p, p); fflush(stdout);
-  indent--;
-#endif
-}
+  __pre_gc ();
 
-/* GC starts here */
+  push_extra_root (&z);
+  
+  r = par_run (&job);
 
-static int enable_GC = 1;
+  push_extra_root (&job.f);
+  push_extra_root (&r);
+  
+  for (int c = 0; c < job.chunks; c++) z = call_closure (job.f, 2, (void*[]) {z, ((void**) r)[c]});
+  
+  pop_extra_root (&r);
+  pop_extra_root (&job.f);
+  pop_extra_root (&z);
 
-extern void LenableGC () {
-  enable_GC = 1;
-}
+  __post_gc ();
 
-extern void LdisableGC () {
-  enable_GC = 0;
+  return z;
 }
 
-extern const size_t __start_custom_data, __stop_custom_data;
-
-# ifdef __ENABLE_GC__
+/* end */
 
-extern void __gc_init ();
+/* Fibers.
+
+   A fiber runs a zero-argument closure on its own stack; fibers share the
+   heap and are switched cooperatively in "yield" and "join" only, thus the
+   runtime never sees two of them at once. The main program is the fiber 0.
+   Ready fibers wait in a FIFO run queue. While a fiber is suspended, the part
+   of its stack with Lama frames (from the frame of yield or join up to the
+   frame of its closure) is recorded in its descriptor and scanned by the GC
+   along with the closure and the result. Extra roots and stack segments are
+   not per fiber, so a fiber can not be switched out inside a callback from
+   a built-in.
+
+   A finished fiber is released when it is joined (by the last of the fibers
+   waiting for it) or detached; its number is reused then. The lowest part
+   of each stack is a guard area, thus a stack overflow faults instead of
+   overwriting the neighbouring mappings.
+
+   A fiber is identified in the Lama code by its number and the generation
+   of the number, which is advanced when the fiber is released; thus a stale
+   identifier is rejected rather than taken for a new fiber. The generation
+   takes the bits of a non-negative integer above the number and wraps
+   around (on x86 after 2^14 fibers with the same number).
+
+   There is no M:N scheduling: all fibers of an instance run on the thread
+   which created them. Outside of the parallel array combinators the
+   allocator, the incremental collector, the input buffers and the globals
+   of units are not synchronized, and the table of mutators only covers the
+   threads of a parallel operation. */
+
+# define FIBER_STACK_SIZE (1 << 20)
+# define FIBER_GUARD_SIZE (1 << 16)
+# define FIBER_BITS       16  /* the bits of the number of a fiber */
+# define FIBER_MAX        (1 << FIBER_BITS)
+# define FIBER_GEN_MASK   (((word) 1 << (sizeof (word) * 8 - 2 - FIBER_BITS)) - 1)
+
+enum {FIBER_READY, FIBER_RUNNING, FIBER_BLOCKED, FIBER_DONE};
+
+typedef struct fiber {
+  ucontext_t  context;
+  int         state;
+  int         waits;      /* the fiber being joined while blocked          */
+  void       *closure;    /* the closure to run                            */
+  void       *result;     /* its result when done                          */
+  void       *stack;      /* the stack; NULL for the main fiber            */
+  size_t      top;        /* the saved __gc_stack_top while suspended;     */
+  size_t      bottom;     /* 0 if the fiber has not started yet            */
+  int         joiners;    /* the number of fibers waiting for this one     */
+  int         detached;
+} fiber;
+
+static void run_enqueue (int id) {
+  if (rt->run_length == rt->run_size) {
+    int  size = rt->run_size ? 2 * rt->run_size : 16;
+    int *q    = (int*) malloc (size * sizeof (int));
+
+    if (q == NULL) failure ("fibers: out of memory\n");
+    
+    for (int i = 0; i < rt->run_length; i++) q[i] = rt->run_queue[(rt->run_head + i) % rt->run_size];
+    
+    free (rt->run_queue);
+    rt->run_queue = q;
+    rt->run_head  = 0;
+    rt->run_size  = size;
+  }
 
-# else
+  rt->run_queue[(rt->run_head + rt->run_length++) % rt->run_size] = id;
+}
 
-# define __gc_init __gc_init_subst
-void __gc_init_subst () {}
+static int run_dequeue (void) {
+  int id;
+  
+  if (rt->run_length == 0) return -1;
 
-# endif
+  id       = rt->run_queue[rt->run_head];
+  rt->run_head = (rt->run_head + 1) % rt->run_size;
+  rt->run_length--;
+  
+  return id;
+}
 
-extern void __gc_root_scan_stack ();
+static int fiber_new (void *closure, void *stack) {
+  fiber *f = (fiber*) calloc (1, sizeof (fiber));
+  int    id;
 
-/* ======================================== */
-/*           Mark-and-copy                  */
-/* ======================================== */
+  if (f == NULL) failure ("fibers: out of memory\n");
+  
+  if (rt->fibers_free_number == 0 && rt->fibers_number == FIBER_MAX)
+    failure ("spawn: too many fibers\n");
+  
+  if (rt->fibers_number == rt->fibers_size) {
+    rt->fibers_size = rt->fibers_size ? 2 * rt->fibers_size : 16;
+    rt->fibers      = (fiber**) realloc (rt->fibers, rt->fibers_size * sizeof (fiber*));
+    rt->fibers_free = (int*) realloc (rt->fibers_free, rt->fibers_size * sizeof (int));
+    rt->fibers_gen  = (word*) realloc (rt->fibers_gen, rt->fibers_size * sizeof (word));
+    
+    if (rt->fibers == NULL || rt->fibers_free == NULL || rt->fibers_gen == NULL)
+      failure ("fibers: out of memory\n");
 
-//static size_t SPACE_SIZE = 16;
-static size_t SPACE_SIZE = 256 * 1024 * 1024;
-// static size_t SPACE_SIZE = 128;
-// static size_t SPACE_SIZE = 1024 * 1024;
+    memset (rt->fibers_gen + rt->fibers_number, 0, (rt->fibers_size - rt->fibers_number) * sizeof (word));
+  }
 
-static int free_pool (pool * p) {
-  size_t *a = p->begin, b = p->size;
-  p->begin   = NULL;
-  p->size    = 0;
-  p->end     = NULL;
-  p->current = NULL;
-  return munmap((void *)a, b);
-}
+  f->closure = closure;
+  f->result  = (void*) BOX(0);
+  f->stack   = stack;
 
-static void init_to_space (int flag) {
-  size_t space_size = 0;
-  if (flag) SPACE_SIZE = SPACE_SIZE << 1;
-  space_size     = SPACE_SIZE * sizeof(size_t);
-  to_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
-			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
-  if (to_space.begin == MAP_FAILED) {
-    perror ("EROOR: init_to_space: mmap failed\n");
-    exit   (1);
-  }
-  to_space.current = to_space.begin;
-  to_space.end     = to_space.begin + SPACE_SIZE;
-  to_space.size    = SPACE_SIZE;
+  id = rt->fibers_free_number > 0 ? rt->fibers_free[--rt->fibers_free_number] : rt->fibers_number++;
+  rt->fibers[id] = f;
+  
+  return id;
 }
 
-static void gc_swap_spaces (void) {
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf ("gc_swap_spaces\n"); fflush (stdout);
-#endif
-  free_pool (&from_space);
-  from_space.begin   = to_space.begin;
-  from_space.current = current;
-  from_space.end     = to_space.end;
-  from_space.size    = to_space.size;
-  to_space.begin   = NULL;
-  to_space.current = NULL;
-  to_space.end     = NULL;
-  to_space.size    = 0;
-#ifdef DEBUG_PRINT
-  indent--;
-#endif
-}
+/* Frees the descriptor of a finished fiber and makes its number free */
+static void fiber_free (int id) {
+  fiber *f = rt->fibers[id];
 
-# define IS_VALID_HEAP_POINTER(p)\
-  (!UNBOXED(p) &&		 \
-   (size_t)from_space.begin <= (size_t)p &&	 \
-   (size_t)from_space.end   >  (size_t)p)
+  if (f->stack != NULL) munmap (f->stack, FIBER_GUARD_SIZE + FIBER_STACK_SIZE);
+  free (f);
 
-# define IN_PASSIVE_SPACE(p)	\
-  ((size_t)to_space.begin <= (size_t)p	&&	\
-   (size_t)to_space.end   >  (size_t)p)
+  rt->fibers[id] = NULL;
+  rt->fibers_gen[id] = (rt->fibers_gen[id] + 1) & FIBER_GEN_MASK;
+  rt->fibers_free[rt->fibers_free_number++] = id;
+}
 
-# define IS_FORWARD_PTR(p)			\
-  (!UNBOXED(p) && IN_PASSIVE_SPACE(p))
+/* Frees the stack of a fiber which has just finished, and the fiber if it
+   is detached; called on the stack of the fiber switched to */
+static void fiber_release (void) {
+  if (rt->fiber_finished >= 0) {
+    fiber *f = rt->fibers[rt->fiber_finished];
+    
+    munmap (f->stack, FIBER_GUARD_SIZE + FIBER_STACK_SIZE);
+    f->stack = NULL;
 
-int is_valid_heap_pointer (void *p)  {
-  return IS_VALID_HEAP_POINTER(p);
+    if (f->detached && f->joiners == 0) fiber_free (rt->fiber_finished);
+    
+    rt->fiber_finished = -1;
+  }
 }
 
-extern size_t * gc_copy (size_t *obj);
+/* Passes control from the current fiber to the next ready one; returns
+   when the current fiber is resumed */
+static void fiber_switch (void) {
+  fiber *self = rt->fibers[rt->fiber_current];
+  int    next = run_dequeue ();
 
-static void copy_elements (size_t *where, size_t *from, int len) {
-  int    i = 0;
-  void * p = NULL;
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf ("copy_elements: start; len = %d\n", len); fflush (stdout);
-#endif
-  for (i = 0; i < len; i++) {
-    size_t elem = from[i];
-    if (!IS_VALID_HEAP_POINTER(elem)) {
-      *where = elem;
-      where++;
-#ifdef DEBUG_PRINT
-      print_indent ();	
-      printf ("copy_elements: copy NON ptr: %zu %p \n", elem, elem); fflush (stdout);
-#endif
-    }
-    else {
-#ifdef DEBUG_PRINT
-      print_indent ();	
-      printf ("copy_elements: fix element: %p -> %p\n", elem, *where);
-      fflush (stdout);
-#endif
-      p = gc_copy ((size_t*) elem);
-      *where = (size_t) p;
-      where ++;
-    }
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("copy_elements: iteration end: where = %p, *where = %p, i = %d, \
-             len = %d\n", where, *where, i, len); fflush (stdout);
-#endif
+  if (next < 0) failure ("join: deadlock, all fibers are blocked\n");
 
-  }
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("\tcopy_elements: end\n"); fflush (stdout);
-  indent--;
-#endif
+  self->top     = __gc_stack_top;
+  self->bottom  = __gc_stack_bottom;
+  rt->fiber_current = next;
+  rt->fibers[next]->state = FIBER_RUNNING;
+  
+  if (swapcontext (&self->context, &rt->fibers[next]->context) < 0)
+    failure ("fibers: can not switch: %s\n", strerror (errno));
 
+  __gc_stack_top    = self->top;
+  __gc_stack_bottom = self->bottom;
+  self->top         = 0;
+  self->bottom      = 0;
+  
+  fiber_release ();
 }
 
-static int extend_spaces (void) {
-  void *p = (void *) BOX (NULL);
-  size_t old_space_size = SPACE_SIZE        * sizeof(size_t),
-         new_space_size = (SPACE_SIZE << 1) * sizeof(size_t);
-  p = mremap(to_space.begin, old_space_size, new_space_size, 0);
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-#endif
-  if (p == MAP_FAILED) {
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("extend: extend_spaces: mremap failed\n"); fflush (stdout);
-#endif
-    return 1;
-  }
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("extend: %p %p %p %p\n", p, to_space.begin, to_space.end, current);
-  fflush (stdout);
-  indent--;
-#endif
-  to_space.end    += SPACE_SIZE;
-  SPACE_SIZE      =  SPACE_SIZE << 1;
-  to_space.size   =  SPACE_SIZE;
-  return 0;
+static void fiber_start (int id) {
+  fiber *self = rt->fibers[id];
+  int    next;
+
+  fiber_release ();
+  
+  self->result  = __call_closure (self->closure, 0, NULL);
+  self->closure = (void*) BOX(0);
+  self->state   = FIBER_DONE;
+
+  if (self->joiners > 0)
+    for (int i = 0; i < rt->fibers_number; i++)
+      if (rt->fibers[i] != NULL && rt->fibers[i]->state == FIBER_BLOCKED && rt->fibers[i]->waits == id) {
+	rt->fibers[i]->state = FIBER_READY;
+	run_enqueue (i);
+      }
+
+  if ((next = run_dequeue ()) < 0) failure ("join: deadlock, all fibers are blocked\n");
+
+  rt->fiber_finished = id;
+  rt->fiber_current  = next;
+  rt->fibers[next]->state = FIBER_RUNNING;
+  
+  setcontext (&rt->fibers[next]->context);
+  failure ("fibers: can not switch: %s\n", strerror (errno));
 }
 
-extern size_t * gc_copy (size_t *obj) {
-  data   *d    = TO_DATA(obj);
-  sexp   *s    = NULL;
-  size_t *copy = NULL;
-  int     i    = 0;
-#ifdef DEBUG_PRINT
-  int len1, len2, len3;
-  void * objj;
-  void * newobjj = (void*)current;
-  indent++; print_indent ();
-  printf ("gc_copy: %p cur = %p starts\n", obj, current);
-  fflush (stdout);
-#endif
+static void fiber_check (char *op) {
+  if (par_worker) failure ("%s: fibers can not be used in parallel array combinators\n", op);
+  
+  if (stack_segments_number != 0 || extra_roots.current_free != 0)
+    failure ("%s: can not switch fibers inside a callback from a built-in\n", op);
+}
 
-  if (!IS_VALID_HEAP_POINTER(obj)) {
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("gc_copy: invalid ptr: %p\n", obj); fflush (stdout);
-    indent--;
-#endif
-    return obj;
-  }
+/* Creates a fiber to run a zero-argument closure and returns its number;
+   the fiber starts when the current one yields or blocks */
+extern word Lspawn (void *f) {
+  void *stack;
+  int   id;
+  
+  ASSERT_BOXED ("spawn:1", f);
 
-  if (!IN_PASSIVE_SPACE(current) && current != to_space.end) {
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf("ERROR: gc_copy: out-of-space %p %p %p\n",
-	   current, to_space.begin, to_space.end);
-    fflush(stdout);
-#endif
-    perror("ERROR: gc_copy: out-of-space\n");
-    exit (1);
-  }
+  if (par_worker) failure ("spawn: fibers can not be used in parallel array combinators\n");
 
-  if (IS_FORWARD_PTR(d->tag)) {
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("gc_copy: IS_FORWARD_PTR: return! %p -> %p\n", obj, (size_t *) d->tag);
-    fflush(stdout);
-    indent--;
-#endif
-    return (size_t *) d->tag;
+  if (rt->fibers_number == 0) {
+    fiber_new ((void*) BOX(0), NULL);
+    rt->fibers[0]->state = FIBER_RUNNING;
   }
 
-  copy = current;
-#ifdef DEBUG_PRINT
-  objj = d;
-#endif
-  switch (TAG(d->tag)) {
-    case CLOSURE_TAG:
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("gc_copy:closure_tag; len =  %zu\n", LEN(d->tag)); fflush (stdout);
-#endif
-      i = LEN(d->tag);
-      // current += LEN(d->tag) + 1;
-      // current += ((LEN(d->tag) + 1) * sizeof(int) -1) / sizeof(size_t) + 1;
-      current += i+1;
-      *copy = d->tag;
-      copy++;
-      d->tag = (int) copy;
-      copy_elements (copy, obj, i);
-      break;
-    
-    case ARRAY_TAG:
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("gc_copy:array_tag; len =  %zu\n", LEN(d->tag)); fflush (stdout);
-#endif
-      current += ((LEN(d->tag) + 1) * sizeof (int) - 1) / sizeof (size_t) + 1;
-      *copy = d->tag;
-      copy++;
-      i = LEN(d->tag);
-      d->tag = (int) copy;
-      copy_elements (copy, obj, i);
-      break;
+  stack = mmap (NULL, FIBER_GUARD_SIZE + FIBER_STACK_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
 
-    case STRING_TAG:
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("gc_copy:string_tag; len = %d\n", LEN(d->tag) + 1); fflush (stdout);
-#endif
-      current += (LEN(d->tag) + sizeof(int)) / sizeof(size_t) + 1;
-      *copy = d->tag;
-      copy++;
-      d->tag = (int) copy;
-      strcpy ((char*)&copy[0], (char*) obj);
-      break;
+  if (stack == MAP_FAILED || mprotect (stack, FIBER_GUARD_SIZE, PROT_NONE) < 0)
+    failure ("spawn: can not allocate a stack: %s\n", strerror (errno));
 
-  case SEXP_TAG  :
-      s = TO_SEXP(obj);
-#ifdef DEBUG_PRINT
-      objj = s;
-      len1 = LEN(s->contents.tag);
-      len2 = LEN(s->tag);
-      len3 = LEN(d->tag);
-      print_indent ();
-      printf ("gc_copy:sexp_tag; len1 = %li, len2=%li, len3 = %li\n",
-	      len1, len2, len3);
-      fflush (stdout);
-#endif
-      i = LEN(s->contents.tag);
-      current += i + 2;
-      *copy = s->tag;
-      copy++;
-      *copy = d->tag;
-      copy++;
-      d->tag = (int) copy;
-      copy_elements (copy, obj, i);
-      break;
+  id = fiber_new (f, stack);
+  rt->fibers[id]->state = FIBER_READY;
 
-  default:
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("ERROR: gc_copy: weird tag: %p", TAG(d->tag)); fflush (stdout);
-    indent--;
-#endif
-    perror ("ERROR: gc_copy: weird tag");
-    exit (1);
-    return (obj);
-  }
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("gc_copy: %p(%p) -> %p (%p); new-current = %p\n",
-	  obj, objj, copy, newobjj, current);
-  fflush (stdout);
-  indent--;
-#endif
-  return copy;
+  getcontext (&rt->fibers[id]->context);
+  rt->fibers[id]->context.uc_stack.ss_sp   = (char*) stack + FIBER_GUARD_SIZE;
+  rt->fibers[id]->context.uc_stack.ss_size = FIBER_STACK_SIZE;
+  rt->fibers[id]->context.uc_link          = NULL;
+  makecontext (&rt->fibers[id]->context, (void (*) (void)) fiber_start, 1, id);
+
+  run_enqueue (id);
+  
+  return BOX(rt->fibers_gen[id] << FIBER_BITS | id);
 }
 
-extern void gc_test_and_copy_root (size_t ** root) {
-#ifdef DEBUG_PRINT
-    indent++;
-#endif
-  if (IS_VALID_HEAP_POINTER(*root)) {
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("gc_test_and_copy_root: root %p top=%p bot=%p  *root %p \n", root, __gc_stack_top, __gc_stack_bottom, *root);
-    fflush (stdout);
-#endif
-    *root = gc_copy (*root);
-  }
-#ifdef DEBUG_PRINT
-  else {
-    print_indent ();
-    printf ("gc_test_and_copy_root: INVALID HEAP POINTER root %p  *root %p\n", root, *root);
-    fflush (stdout);
+/* Lets the other ready fibers run */
+extern word Lyield () {
+  if (rt->run_length == 0) return BOX(0);
+
+  fiber_check ("yield");
+  
+  __pre_gc ();
+
+  rt->fibers[rt->fiber_current]->state = FIBER_READY;
+  run_enqueue (rt->fiber_current);
+  fiber_switch ();
+  
+  __post_gc ();
+
+  return BOX(0);
+}
+
+/* Gets the number of a fiber by its identifier */
+static int fiber_of (char *op, word n) {
+  word h  = UNBOX(n);
+  int  id = h & (FIBER_MAX - 1);
+  
+  if (h <= 0 || id >= rt->fibers_number || rt->fibers[id] == NULL ||
+      h >> FIBER_BITS != rt->fibers_gen[id] || rt->fibers[id]->detached)
+    failure ("%s: invalid fiber %ld\n", op, (long) h);
+
+  return id;
+}
+
+/* Waits until a fiber finishes and returns its result; the fiber is
+   released then */
+extern void* Ljoin (word n) {
+  fiber *f;
+  void  *r;
+  int    id;
+  
+  ASSERT_UNBOXED ("join:1", n);
+
+  id = fiber_of ("join", n);
+  f  = rt->fibers[id];
+
+  if (id == rt->fiber_current) failure ("join: a fiber can not join itself\n");
+
+  if (f->state != FIBER_DONE) {
+    fiber_check ("join");
+    
+    __pre_gc ();
+
+    rt->fibers[rt->fiber_current]->state = FIBER_BLOCKED;
+    rt->fibers[rt->fiber_current]->waits = id;
+    f->joiners++;
+    fiber_switch ();
+    f->joiners--;
+
+    __post_gc ();
   }
-  indent--;
-#endif
+
+  r = f->result;
+  
+  if (f->joiners == 0) fiber_free (id);
+
+  return r;
 }
 
-extern void gc_root_scan_data (void) {
-  size_t * p = (size_t*)&__start_custom_data;
-  while  (p < (size_t*)&__stop_custom_data) {
-    gc_test_and_copy_root ((size_t**)p);
-    p++;
+/* Releases a fiber without waiting for it; it can not be joined then */
+extern word Ldetach (word n) {
+  fiber *f;
+  int    id;
+  
+  ASSERT_UNBOXED ("detach:1", n);
+
+  id = fiber_of ("detach", n);
+  f  = rt->fibers[id];
+  f->detached = 1;
+
+  if (f->state == FIBER_DONE && f->joiners == 0) fiber_free (id);
+
+  return BOX(0);
+}
+
+static void gc_root_scan_fibers (void) {
+  for (int i = 0; i < rt->fibers_number; i++) {
+    fiber  *f = rt->fibers[i];
+    size_t *p;
+
+    if (f == NULL) continue;
+
+    gc_test_and_copy_root ((size_t**) &f->closure);
+    gc_test_and_copy_root ((size_t**) &f->result);
+
+    if ((p = (size_t*) f->top) != NULL)
+      while (++p < (size_t*) f->bottom) gc_test_and_copy_root ((size_t**) p);
   }
 }
 
+/* end */
+
 static inline void init_extra_roots (void) {
   extra_roots.current_free = 0;
 }
 
+/* Maps the from-space of an instance; returns 0 on success */
+static int init_heap (lama_instance *inst) {
+  char *pause;
+  
+  inst->from_space.begin = mmap (NULL, inst->space_size * sizeof(size_t), PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HEAP, -1, 0);
+  if (inst->from_space.begin == MAP_FAILED) return 1;
+  
+  inst->from_space.current = inst->from_space.begin;
+  inst->from_space.end     = inst->from_space.begin + inst->space_size;
+  inst->alloc_mark         = inst->from_space.begin;
+  inst->from_space.size    = inst->space_size;
+  inst->to_space.begin     = NULL;
+  inst->to_space.current   = NULL;
+  inst->to_space.end       = NULL;
+  inst->to_space.size      = 0;
+
+  /* the pause target of the incremental collection in microseconds */
+  if ((pause = getenv ("LAMA_GC_PAUSE")) != NULL && atol (pause) > 0)
+    inst->inc_pause = atol (pause) * 1000ULL;
+  inc_set_trigger (inst);
+
+  return 0;
+}
+
 extern void __init (void) {
-  size_t space_size = SPACE_SIZE * sizeof(size_t);
+  char *heap = getenv ("LAMA_HEAP_SIZE");
+
+  /* the initial size of a space in bytes can be set with LAMA_HEAP_SIZE */
+  if (heap != NULL && atol (heap) >= 4096) rt->space_size = atol (heap) / sizeof(size_t);
 
   srandom (time (NULL));
+  init_output ();
+  init_profiler ();
+
+  if ((gc_stats_file = getenv ("LAMA_GC_STATS")) != NULL) atexit (gc_dump_stats);
   
-  from_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
-    			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
-  to_space.begin   = NULL;
-  if (to_space.begin == MAP_FAILED) {
+  if (init_heap (rt)) {
     perror ("EROOR: init_pool: mmap failed\n");
     exit   (1);
   }
-  from_space.current = from_space.begin;
-  from_space.end     = from_space.begin + SPACE_SIZE;
-  from_space.size    = SPACE_SIZE;
-  to_space.current   = NULL;
-  to_space.end       = NULL;
-  to_space.size      = 0;
   init_extra_roots ();
+
+  pthread_once (&globals_once, globals_save);
+  set_globals  (rt);
+}
+
+/* Runtime instances.
+
+   An application which embeds Lama can run it in several isolated
+   instances, for example one per thread: each instance has its own heap,
+   fibers, pool of threads for the parallel combinators and the state of
+   the built-ins, and instances share no locks. A thread works with one
+   instance at a time (rt); an instance must not be run by two threads at
+   once. Each instance has its own global variables of units (see "Global
+   variables of units"), so the units have to be initialized in each
+   instance they are used in; sysargs is an empty array in the instances
+   made by lama_create.
+*/
+
+/* Creates an instance; the initial size of its spaces is heap_size bytes
+   (the default one if heap_size is 0). Returns NULL on failure */
+extern lama_instance* lama_create (size_t heap_size) {
+  lama_instance *inst = (lama_instance*) malloc (sizeof (lama_instance)),
+                *prev = rt;
+
+  if (inst == NULL) return NULL;
+
+  *inst = (lama_instance) INSTANCE_INITIALIZER;
+  
+  if (heap_size >= 4096) inst->space_size = heap_size / sizeof(size_t);
+
+  if (init_heap (inst)) {
+    free (inst);
+    return NULL;
+  }
+
+  pthread_once (&globals_once, globals_save);
+
+  if (globals_create (inst)) {
+    free_pool (&inst->from_space);
+    free (inst);
+    return NULL;
+  }
+
+  /* no collection can happen on a fresh heap */
+  rt = inst;
+  GLOBAL(inst, global_sysargs) = LmakeArray (BOX(0));
+  rt = prev;
+  
+  return inst;
+}
+
+/* Calls a Lama function (the code of a public function of a unit or the
+   initialization of a unit) with n arguments in an instance on the current
+   thread. The arguments have to be integers or values of the same instance;
+   the result is valid until the instance is run again */
+extern void* lama_run (lama_instance *inst, void *function, int n, void **args) {
+  lama_instance *prev        = rt;
+  size_t         top         = __gc_stack_top,
+                 bottom      = __gc_stack_bottom;
+  void          *closure [1] = {function}; /* a closure without free variables out of the heap */
+  void          *r;
+
+  rt = inst;
+  set_globals (inst);
+  r  = __call_closure (closure, n, args);
+  rt = prev;
+  set_globals (prev);
+
+  __gc_stack_top    = top;
+  __gc_stack_bottom = bottom;
+
+  return r;
+}
+
+/* Releases an instance with its heap and threads */
+extern void lama_destroy (lama_instance *inst) {
+  if (inst == &main_instance) failure ("lama_destroy: the main instance can not be destroyed\n");
+
+  par_shutdown (inst);
+  free (inst->mutators);
+
+  for (int i = 0; i < inst->fibers_number; i++) {
+    if (inst->fibers[i] == NULL) continue;
+    if (inst->fibers[i]->stack != NULL) munmap (inst->fibers[i]->stack, FIBER_GUARD_SIZE + FIBER_STACK_SIZE);
+    free (inst->fibers[i]);
+  }
+  free (inst->fibers);
+  free (inst->fibers_free);
+  free (inst->fibers_gen);
+  free (inst->run_queue);
+
+  if (inst->re_cache != NULL) {
+    for (int i = 0; i < RE_CACHE_SIZE; i++)
+      for (regexp *r = inst->re_cache[i], *next; r; r = next) {
+	next = r->next;
+	regfree (&r->gnu);
+	if (r->dfa != NULL) {
+	  free (r->dfa->states);
+	  free (r->dfa->index);
+	  free (r->dfa);
+	}
+	free (r->pattern);
+	free (r);
+      }
+    free (inst->re_cache);
+  }
+
+  for (int i = 0; i < inst->in_buffers_size; i++)
+    if (inst->in_buffers[i] != NULL) {
+      free (inst->in_buffers[i]->buf);
+      free (inst->in_buffers[i]);
+    }
+  free (inst->in_buffers);
+
+  for (external *e = inst->externals, *next; e; e = next) {
+    next = e->next;
+    munmap (e->begin, e->size);
+    free (e);
+  }
+  
+  free_pool (&inst->from_space);
+  if (inst->to_space.begin  != NULL) free_pool (&inst->to_space);
+  if (inst->inc_spare.begin != NULL) free_pool (&inst->inc_spare);
+  free (inst->inc_entries);
+  free (inst->inc_table);
+  free (inst->inc_log);
+  free (inst->inc_closures);
+  free (inst->inc_cards);
+  
+  if (rt == inst) rt = &main_instance;
+  if (globals_instance == inst) set_globals (rt);
+  globals_release (inst);
+
+  free (inst);
 }
 
+/* end */
+
 static void* gc (size_t size) {
-  if (! enable_GC) {
+  unsigned long long t = clock_ns ();
+  
+  if (! rt->enable_GC) {
     Lfailure ("GC disabled");
   }
-  
-  current = to_space.begin;
+
+  rt->gc_collections++;
+  current = rt->to_space.current; /* past the replicas if the cycle is incremental */
 #ifdef DEBUG_PRINT
   print_indent ();
   printf ("gc: current:%p; to_space.b =%p; to_space.e =%p; \
            f_space.b = %p; f_space.e = %p; __gc_stack_top=%p; __gc_stack_bottom=%p\n",
-	  current, to_space.begin, to_space.end, from_space.begin, from_space.end,
+	  current, rt->to_space.begin, rt->to_space.end, rt->from_space.begin, rt->from_space.end,
 	  __gc_stack_top, __gc_stack_bottom);
   fflush (stdout);
 #endif
@@ -1894,6 +5602,9 @@ static void* gc (size_t size) {
   printf ("gc: data is scanned\n"); fflush (stdout);
 #endif
   __gc_root_scan_stack ();
+  gc_root_scan_stack_segments ();
+  gc_root_scan_fibers ();
+  gc_root_scan_mutators ();
   for (int i = 0; i < extra_roots.current_free; i++) {
 #ifdef DEBUG_PRINT
     print_indent ();
@@ -1907,19 +5618,20 @@ static void* gc (size_t size) {
   print_indent ();
   printf ("gc: no more extra roots\n"); fflush (stdout);
 #endif
+  if (rt->inc_phase) inc_finish ();
 
   if (!IN_PASSIVE_SPACE(current)) {
     printf ("gc: ASSERT: !IN_PASSIVE_SPACE(current) to_begin = %p to_end = %p \
-             current = %p\n", to_space.begin, to_space.end, current);
+             current = %p\n", rt->to_space.begin, rt->to_space.end, current);
     fflush (stdout);
     perror ("ASSERT: !IN_PASSIVE_SPACE(current)\n");
     exit   (1);
   }
 
-  while (current + size >= to_space.end) {
+  while (current + size >= rt->to_space.end) {
 #ifdef DEBUG_PRINT
     print_indent ();
-    printf ("gc: pre-extend_spaces : %p %zu %p \n", current, size, to_space.end);
+    printf ("gc: pre-extend_spaces : %p %zu %p \n", current, size, rt->to_space.end);
     fflush (stdout);
 #endif
     if (extend_spaces ()) {
@@ -1929,20 +5641,22 @@ static void* gc (size_t size) {
     }
 #ifdef DEBUG_PRINT
     print_indent ();
-    printf ("gc: post-extend_spaces: %p %zu %p \n", current, size, to_space.end);
+    printf ("gc: post-extend_spaces: %p %zu %p \n", current, size, rt->to_space.end);
     fflush (stdout);
 #endif
   }
   assert (IN_PASSIVE_SPACE(current));
-  assert (current + size < to_space.end);
+  assert (current + size < rt->to_space.end);
 
   gc_swap_spaces ();
-  from_space.current = current + size;
+  rt->from_space.current = current + size;
+  inc_set_trigger (rt);
+  if ((t = clock_ns () - t) > rt->gc_max_pause) rt->gc_max_pause = t;
 #ifdef DEBUG_PRINT
   print_indent ();
   printf ("gc: end: (allocate!) return %p; from_space.current %p; \
            from_space.end %p \n\n",
-	  current, from_space.current, from_space.end);
+	  current, rt->from_space.current, rt->from_space.end);
   fflush (stdout);
   indent--;
 #endif
@@ -1951,15 +5665,15 @@ static void* gc (size_t size) {
 
 #ifdef DEBUG_PRINT
 static void printFromSpace (void) {
-  size_t * cur = from_space.begin, *tmp = NULL;
+  size_t * cur = rt->from_space.begin, *tmp = NULL;
   data   * d   = NULL;
   sexp   * s   = NULL;
   size_t   len = 0;
   size_t   elem_number = 0;
   
   printf ("\nHEAP SNAPSHOT\n===================\n");
-  printf ("f_begin = %p, f_end = %p,\n", from_space.begin, from_space.end);
-  while (cur < from_space.current) {
+  printf ("f_begin = %p, f_end = %p,\n", rt->from_space.begin, rt->from_space.end);
+  while (cur < rt->from_space.current) {
     printf ("data at %p", cur);
     d  = (data *) cur;
 
@@ -1968,16 +5682,16 @@ static void printFromSpace (void) {
     case STRING_TAG:
       printf ("(=>%p): STRING\n\t%s; len = %i %zu\n",
 	      d->contents, d->contents,
-	      LEN(d->tag), LEN(d->tag) + 1 + sizeof(int));
+	      LEN(d->tag), LEN(d->tag) + 1 + sizeof(word));
       fflush (stdout);
-      len = (LEN(d->tag) + sizeof(int)) / sizeof(size_t) + 1;
+      len = (LEN(d->tag) + sizeof(word)) / sizeof(size_t) + 1;
       break;
 
     case CLOSURE_TAG:
       printf ("(=>%p): CLOSURE\n\t", d->contents);
       len = LEN(d->tag);
       for (int i = 0; i < len; i++) {
-	int elem = ((int*)d->contents)[i];
+	int elem = ((word*)d->contents)[i];
 	if (UNBOXED(elem)) printf ("%d ", elem);
 	else printf ("%p ", elem);
       }
@@ -1990,7 +5704,7 @@ static void printFromSpace (void) {
       printf ("(=>%p): ARRAY\n\t", d->contents);
       len = LEN(d->tag);
       for (int i = 0; i < len; i++) {
-	int elem = ((int*)d->contents)[i];
+	int elem = ((word*)d->contents)[i];
 	if (UNBOXED(elem)) printf ("%d ", elem);
 	else printf ("%p ", elem);
       }
@@ -2007,7 +5721,7 @@ static void printFromSpace (void) {
       len = LEN(d->tag);
       tmp = (s->contents.contents);
       for (int i = 0; i < len; i++) {
-	int elem = ((int*)tmp)[i];
+	int elem = ((word*)tmp)[i];
 	if (UNBOXED(elem)) printf ("%d ", UNBOX(elem));
 	else printf ("%p ", elem);
       }
@@ -2042,36 +5756,40 @@ static void printFromSpace (void) {
 extern void * alloc (size_t size) {
   void * p = (void*)BOX(NULL);
   size = (size - 1) / sizeof(size_t) + 1; // convert bytes to words
+  if (rt->par_active) return par_alloc (size);
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
-  printf ("alloc: current: %p %zu words!", from_space.current, size);
+  printf ("alloc: current: %p %zu words!", rt->from_space.current, size);
   fflush (stdout);
 #endif
-  if (from_space.current + size < from_space.end) {
-    p = (void*) from_space.current;
-    from_space.current += size;
+  if (rt->from_space.current + size < rt->from_space.end &&
+      (rt->from_space.current < rt->inc_trigger || inc_step (size))) {
+    p = (void*) rt->from_space.current;
+    rt->from_space.current += size;
 #ifdef DEBUG_PRINT
     print_indent ();
-    printf (";new current: %p \n", from_space.current); fflush (stdout);
+    printf (";new current: %p \n", rt->from_space.current); fflush (stdout);
     indent--;
 #endif
     return p;
   }
   
-  init_to_space (0);
+  rt->allocated_words += rt->from_space.current - rt->alloc_mark;
+  if (rt->inc_phase == INC_IDLE) init_to_space (0);
 #ifdef DEBUG_PRINT
   print_indent ();
   printf ("alloc: call gc: %zu\n", size); fflush (stdout);
   printFromSpace(); fflush (stdout);
   p = gc (size);
   print_indent ();
-  printf("alloc: gc END %p %p %p %p\n\n", from_space.begin,
-	 from_space.end, from_space.current, p); fflush (stdout);
+  printf("alloc: gc END %p %p %p %p\n\n", rt->from_space.begin,
+	 rt->from_space.end, rt->from_space.current, p); fflush (stdout);
   printFromSpace(); fflush (stdout);
   indent--;
-  return p;
 #else
-  return gc (size);
+  p = gc (size);
 #endif
+  rt->alloc_mark = p;
+  return p;
 }
 # endif
@@ -1,21 +1,56 @@
 # ifndef __LAMA_RUNTIME__
 # define __LAMA_RUNTIME__
 
+# define _FILE_OFFSET_BITS 64
+
 # include <stdio.h>
 # include <stdio.h>
 # include <string.h>
 # include <stdarg.h>
 # include <stdlib.h>
 # include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
 # include <assert.h>
 # include <errno.h>
 # include <regex.h>
 # include <time.h>
 # include <limits.h>
 # include <ctype.h>
+# include <unistd.h>
+# include <pthread.h>
+# include <stdint.h>
+# include <signal.h>
+# include <ucontext.h>
+# include <sys/time.h>
+# include <sys/syscall.h>
+# include <sys/auxv.h>
+# ifdef __x86_64__
+#   include <asm/prctl.h>
+# else
+#   include <asm/ldt.h>
+# endif
+
+/* A machine word: values, object headers and fields have this size, so the
+   runtime works both for 32-bit (-m32) and 64-bit targets */
+typedef intptr_t word;
+
+/* The heap is kept in the low 2G on 32-bit targets only */
+# ifdef __x86_64__
+#   define MAP_HEAP 0
+# else
+#   define MAP_HEAP MAP_32BIT
+# endif
 
 # define WORD_SIZE (CHAR_BIT * sizeof(int))
 
 void failure (char *s, ...);
 
+/* Runtime instances for applications which embed Lama (see runtime.c) */
+typedef struct lama_instance lama_instance;
+
+lama_instance* lama_create  (size_t heap_size);
+void*          lama_run     (lama_instance *instance, void *function, int n, void **args);
+void           lama_destroy (lama_instance *instance);
+
 # endif
@@ -21,6 +21,10 @@ class options args =
     "  -ds       --- dump stack machine code (the output will be written into .sm file; has no\n" ^
     "                effect if -i option is specfied)\n" ^
     "  -b        --- compile to a stack machine bytecode\n" ^    
+    "  -O        --- optimize stack machine code (with -ds the optimized code is additionally\n" ^
+    "                written into .opt.sm file)\n" ^
+    "  -m64      --- generate x86-64 code (the runtime and the standard library have to be\n" ^
+    "                built with ARCH=64)\n" ^
     "  -v        --- show version\n" ^
     "  -h        --- show this help\n"
   in
@@ -34,6 +38,8 @@ class options args =
     val mode    = ref (`Default : [`Default | `Eval | `SM | `Compile | `BC])
     val curdir  = Unix.getcwd ()
     val debug   = ref false
+    val x64     = ref false
+    val optimize = ref false
     (* Workaround until Ostap starts to memoize properly *)
     val const  = ref false
     (* end of the workaround *)
@@ -58,6 +64,8 @@ class options args =
             | "-h"  -> self#set_help
             | "-v"  -> self#set_version
             | "-g"  -> self#set_debug
+            | "-m64" -> self#set_x64
+            | "-O"  -> self#set_optimize
             | _ ->
                if opt.[0] = '-'
                then raise (Commandline_error (Printf.sprintf "Invalid command line specifier ('%s')" opt))
@@ -137,6 +145,10 @@ class options args =
       if (!dump land dump_sm) > 0
       then self#dump_file "sm" (SM.show_prg sm)
       else ()
+    method dump_optimized_SM sm =
+      if (!dump land dump_sm) > 0
+      then self#dump_file "opt.sm" (SM.show_prg sm)
+      else ()
     method greet =
       (match !outfile with
        | None   -> ()
@@ -148,6 +160,12 @@ class options args =
       if !debug then "" else "-g"
     method set_debug =
       debug := true
+    method is_x64 = !x64
+    method private set_x64 =
+      x64 := true
+    method is_optimize = !optimize
+    method private set_optimize =
+      optimize := true
   end
 
 let main =
@@ -197,6 +197,8 @@ module ByteCode =
       (* 0x52 n:32 n:32       *) | BEGIN   (_, a, l, [], _, _) -> add_bytes [5*16 + 2]; add_ints [a; l] (* with no closure *)
       (* 0x53 n:32 n:32       *) | BEGIN   (_, a, l,  _, _, _) -> add_bytes [5*16 + 3]; add_ints [a; l] (* with a closure  *)
       (* 0x54 l:32 n:32 d*:32 *) | CLOSURE (s, ds)             -> add_bytes [5*16 + 4]; add_fixup s; add_ints [0; List.length ds]; add_designations None ds
+      (* 0x5b n:32            *) | CALLC   (n, true)           -> add_bytes [5*16 + 11]; add_ints [n]
+      (* 0x5c l:32 n:32       *) | CALL    (fn, n, true)       -> add_bytes [5*16 + 12]; add_fixup fn; add_ints [0; n]
       (* 0x55 n:32            *) | CALLC   (n, tail)           -> add_bytes [5*16 + 5]; add_ints [n]
       (* 0x56 l:32 n:32       *) | CALL    (fn, n, tail)       -> add_bytes [5*16 + 6]; add_fixup fn; add_ints [0; n]
       (* 0x57 s:32 n:32       *) | TAG     (s, n)              -> add_bytes [5*16 + 7]; add_strings [s]; add_ints [n]
@@ -246,7 +248,9 @@ let show_prg p =
 @type value = (string, value array) Value.t with show
       
 (* Local state of the SM *)
-@type local = { args : value array; locals : value array; closure : value array } with show
+(* base is the depth of the stack below the arguments of the call, tail calls
+   drop everything above it *)
+@type local = { args : value array; locals : value array; closure : value array; base : int } with show
 
 (* Global state of the SM *)
 @type global = (string, value) arrow 
@@ -298,6 +302,15 @@ let rec eval env (((cstack, stack, glob, loc, i, o) as conf) : config) = functio
    Printf.eprintf "   stack=%s\n" (show(list) (show(value)) stack);
    Printf.eprintf "end\n";
     *)
+   (* a tail call reuses the frame of the current function: the return point
+      is not saved and the values left on the stack by the function are dropped *)
+   let enter cstack stack tail =
+     if tail
+     then
+       let rec drop k stack = if k <= 0 then stack else drop (k-1) (List.tl stack) in
+       cstack, drop (List.length stack - loc.base) stack, loc.base
+     else (prg', loc) :: cstack, stack, List.length stack
+   in
    (match insn with   
     | IMPORT _ | PUBLIC _ | EXTERN _ | LINE _ -> eval env conf prg'
                                     
@@ -361,18 +374,21 @@ let rec eval env (((cstack, stack, glob, loc, i, o) as conf) : config) = functio
                                  in
                                  eval env (cstack, (Value.Closure ([], name, closure)) :: stack, glob, loc, i, o) prg'
                                  
-    | CALL (f, n, _)          -> let args, stack' = split n stack in
+    | CALL (f, n, tail)       -> let args, stack' = split n stack in
                                  if env#is_label f
-                                 then eval env ((prg', loc)::cstack, stack', glob, {args = Array.of_list (List.rev args); locals = [||]; closure = [||]}, i, o) (env#labeled f)
+                                 then
+                                   let cstack, stack', base = enter cstack stack' tail in
+                                   eval env (cstack, stack', glob, {args = Array.of_list (List.rev args); locals = [||]; closure = [||]; base = base}, i, o) (env#labeled f)
                                  else eval env (env#builtin f args ((cstack, stack', glob, loc, i, o) : config)) prg'
 
-    | CALLC (n, _)            -> let vs, stack' = split (n+1) stack in
+    | CALLC (n, tail)         -> let vs, stack' = split (n+1) stack in
                                  let f::args    = List.rev vs   in
                                  (match f with
                                   | Value.Builtin f ->
                                      eval env (env#builtin f (List.rev args) ((cstack, stack', glob, loc, i, o) : config)) prg'
                                   | Value.Closure (_, f, closure) ->
-                                     eval env ((prg', loc)::cstack, stack', glob, {args = Array.of_list args; locals = [||]; closure = closure}, i, o) (env#labeled f)
+                                     let cstack, stack', base = enter cstack stack' tail in
+                                     eval env (cstack, stack', glob, {args = Array.of_list args; locals = [||]; closure = closure; base = base}, i, o) (env#labeled f)
                                   | _ -> invalid_arg "not a closure (or a builtin) in CALL: %s\n" @@ show(value) f
                                  )
                                
@@ -448,11 +464,395 @@ let run p i =
            let (st, i, o, r) = Language.Builtin.eval (State.I, i, o, []) (List.map Obj.magic @@ List.rev args) f in
            (cstack, (match r with [r] -> (Obj.magic r)::stack | _ -> Value.Empty :: stack), glob, loc, i, o)
        end      
-      ([], [], (List.fold_left (fun s (name, value) -> State.bind name value s) glob (Builtin.bindings ())), {locals=[||]; args=[||]; closure=[||]}, i, [])
+      ([], [], (List.fold_left (fun s (name, value) -> State.bind name value s) glob (Builtin.bindings ())), {locals=[||]; args=[||]; closure=[||]; base=0}, i, [])
       p
   in
   o 
 
+(* Stack machine optimizer
+
+     val optimize : prg -> prg
+
+   Folds constant expressions and conditions, threads jumps to jumps, removes
+   unreachable code, unreferenced labels and useless stack shuffling. The passes
+   are repeated until the program stops changing. In between, the functions
+   which are only called directly are lambda-lifted, small functions are
+   inlined and the calls of known closures are made direct.
+*)
+module Optimizer =
+  struct
+
+    module S = Set.Make (String)
+
+    (* the folded results have to be representable as boxed integers on x86-32 *)
+    let fits n = n >= - (1 lsl 30) && n < 1 lsl 30
+
+    (* constant folding and local simplifications; after each rewrite we step one
+       instruction back to catch the newly exposed patterns *)
+    let simplify code =
+      let rec inner acc code =
+        let back code = match acc with i :: acc' -> inner acc' (i :: code) | [] -> inner [] code in
+        match code with
+        | [] -> List.rev acc
+        | CONST x :: CONST y :: BINOP op :: tl
+            when not ((op = "/" || op = "%") && y = 0) && fits (Expr.to_func op x y) ->
+           back (CONST (Expr.to_func op x y) :: tl)
+        | CONST x :: CJMP (c, l) :: tl                     -> back (if (c = "z") = (x = 0) then JMP l :: tl else tl)
+        | (CONST _ | LD _ | DUP | CLOSURE _) :: DROP :: tl -> back tl
+        | SWAP :: SWAP :: tl                               -> back tl
+        | ST x :: DROP :: LD y :: tl when x = y            -> back (ST x :: tl)
+        | JMP l :: (LABEL l' | FLABEL l' as i) :: tl
+            when l = l'                                    -> back (i :: tl)
+        | CJMP (_, l) :: (LABEL l' | FLABEL l' as i) :: tl
+            when l = l'                                    -> back (DROP :: i :: tl)
+        | i :: tl                                          -> inner (i :: acc) tl
+      in
+      inner [] code
+
+    (* redirects jumps to unconditional jumps to their final destinations *)
+    let thread code =
+      let labels =
+        let rec inner m = function
+        | []                           -> m
+        | (LABEL l | FLABEL l) :: tl   -> inner (M.add l tl m) tl
+        | _ :: tl                      -> inner m tl
+        in
+        inner M.empty code
+      in
+      let rec target visited l =
+        let rec first = function
+        | (LABEL _ | FLABEL _ | SLABEL _ | LINE _) :: tl -> first tl
+        | JMP l' :: _ when not (List.mem l' visited)     -> target (l' :: visited) l'
+        | _                                              -> l
+        in
+        try first (M.find l labels) with Not_found -> l
+      in
+      List.map
+        (function
+         | JMP l       -> JMP (target [l] l)
+         | CJMP (c, l) -> CJMP (c, target [l] l)
+         | i           -> i
+        )
+        code
+
+    (* removes the code between an unconditional transfer of control (a jump,
+       a return or the end of a function) and the next label *)
+    let unreachable code =
+      let rec inner acc dead = function
+      | []                                                  -> List.rev acc
+      | (LABEL _ | FLABEL _ | BEGIN _ as i) :: tl           -> inner (i :: acc) false tl
+      | (SLABEL _ | PUBLIC _ | EXTERN _ | IMPORT _ as i) :: tl -> inner (i :: acc) dead tl
+      | END :: tl                                           -> inner (END :: acc) true tl
+      | _ :: tl when dead                                   -> inner acc dead tl
+      | (JMP _ | RET as i) :: tl                            -> inner (i :: acc) true tl
+      | i :: tl                                             -> inner (i :: acc) false tl
+      in
+      inner [] false code
+
+    (* removes the labels nobody refers to; the labels of function entries and
+       exits are kept *)
+    let labels code =
+      let used =
+        List.fold_left
+          (fun s -> function
+           | JMP l | CJMP (_, l) | CALL (l, _, _) | CLOSURE (l, _) | PROTO (l, _) | PPROTO (l, _) | PUBLIC l
+           | BEGIN (l, _, _, _, _, _) -> S.add l s
+           | _ -> s
+          )
+          S.empty
+          code
+      in
+      let rec bound = function
+      | SLABEL _ :: tl      -> bound tl
+      | (BEGIN _ | END) :: _ -> true
+      | _                   -> false
+      in
+      let rec inner acc = function
+      | []                                                     -> List.rev acc
+      | LABEL l :: tl when not (S.mem l used) && not (bound tl) -> inner acc tl
+      | i :: tl                                                -> inner (i :: acc) tl
+      in
+      inner [] code
+
+    (* Inlining
+
+       A call of a small closure-free function of the same unit is replaced with
+       its body. The arguments and the locals of the callee become fresh locals of
+       the caller, the labels of the callee get a unique suffix per call site, and
+       the tail calls of the callee become ordinary ones. The call sites are counted
+       across all rounds of inlining, since a later round inlines the calls exposed
+       by the former one.
+    *)
+    let inline_limit = 24
+
+    let inlined = Pervasives.ref 0
+
+    type definition = {nargs : int; nlocals : int; body : prg}
+
+    (* applies f to each function of the program (from BEGIN to END) *)
+    let map_functions f code =
+      let rec inner acc = function
+      | [] -> List.rev acc
+      | BEGIN _ as b :: tl ->
+         let rec body def = function
+         | END :: tl -> List.rev (END :: def), tl
+         | i   :: tl -> body (i :: def) tl
+         | []        -> List.rev def, []
+         in
+         let def, tl = body [b] tl in
+         inner (List.rev_append (f def) acc) tl
+      | i :: tl -> inner (i :: acc) tl
+      in
+      inner [] code
+
+    (* closure-free functions: name -> definition *)
+    let functions code =
+      let m = Pervasives.ref M.empty in
+      ignore @@
+        map_functions
+          (fun def ->
+             (match def with
+              | BEGIN (f, nargs, nlocals, [], _, _) :: body ->
+                 m := M.add f {nargs; nlocals; body = List.filter (function END -> false | _ -> true) body} !m
+              | _ -> ()
+             );
+             def
+          )
+          code;
+      !m
+
+    let inlinable f d =
+      List.length (List.filter (function LINE _ | SLABEL _ | LABEL _ | FLABEL _ -> false | _ -> true) d.body) <= inline_limit &&
+      List.for_all (function CALL (g, _, _) -> g <> f | RET | BEGIN _ -> false | _ -> true) d.body
+
+    (* the instructions which push exactly one value and have no side effects *)
+    let is_push = function CONST _ | LD _ | LDA _ | STRING _ | CLOSURE _ -> true | _ -> false
+
+    let inline code =
+      let funs = M.filter inlinable (functions code) in
+      let expand k base d args =
+        let dsg = function
+        | Value.Arg   i -> Value.Local (base + i)
+        | Value.Local i -> Value.Local (base + d.nargs + i)
+        | x             -> x
+        in
+        let lab l = Printf.sprintf "%s_inl%d" l k in
+        let body =
+          List.fold_right
+            (fun i acc ->
+               match i with
+               | LINE _ | SLABEL _ -> acc
+               | LABEL  l          -> LABEL  (lab l) :: acc
+               | FLABEL l          -> FLABEL (lab l) :: acc
+               | JMP    l          -> JMP    (lab l) :: acc
+               | CJMP  (c, l)      -> CJMP   (c, lab l) :: acc
+               | LD     x          -> LD     (dsg x) :: acc
+               | LDA    x          -> LDA    (dsg x) :: acc
+               | ST     x          -> ST     (dsg x) :: acc
+               | CLOSURE (g, ds)   -> CLOSURE (g, List.map dsg ds) :: acc
+               | CALL  (g, n, _)   -> CALL   (g, n, false) :: acc
+               | CALLC (n, _)      -> CALLC  (n, false) :: acc
+               | i                 -> i :: acc
+            )
+            d.body
+            []
+        in
+        (* the arguments are either moved into the locals one by one as they are
+           pushed, or popped from the stack after they all are pushed *)
+        let prologue =
+          match args with
+          | Some args -> List.concat (List.mapi (fun i a -> [a; ST (Value.Local (base + i)); DROP]) args)
+          | None      ->
+             let rec pop i = if i < 0 then [] else ST (Value.Local (base + i)) :: DROP :: pop (i-1) in
+             pop (d.nargs - 1)
+        in
+        (* the locals get the filler value (0) on each entry, as in a fresh frame,
+           since the inlined body may be run in a loop *)
+        let locals = List.concat (List.init d.nlocals (fun i -> [CONST 0; ST (Value.Local (base + d.nargs + i)); DROP])) in
+        prologue @ locals @ body
+      in
+      (* takes the n last pushed arguments off the (reversed) code *)
+      let rec take_args n args = function
+      | acc when n = 0               -> Some (args, acc)
+      | LINE _ :: acc                -> take_args n args acc
+      | i :: acc when is_push i      -> take_args (n-1) (i :: args) acc
+      | _                            -> None
+      in
+      let rec body next acc = function
+      | CALL (f, n, _) :: tl when M.mem f funs && (M.find f funs).nargs = n ->
+         let d         = M.find f funs in
+         let args, acc = match take_args n [] acc with Some (args, acc) -> Some args, acc | None -> None, acc in
+         incr inlined;
+         body (next + d.nargs + d.nlocals) (List.rev_append (expand !inlined next d args) acc) tl
+      | i :: tl -> body next (i :: acc) tl
+      | []      -> next, List.rev acc
+      in
+      map_functions
+        (function
+         | BEGIN (f, nargs, nlocals, c, a, s) :: tl ->
+            let nlocals, tl = body nlocals [] tl in
+            BEGIN (f, nargs, nlocals, c, a, s) :: tl
+         | def -> def
+        )
+        code
+
+    (* Known calls
+
+       A closure of a closure-free function is called directly. This is the case
+       for a closure which is immediately called, or is loaded from a local
+       variable assigned only once with such a closure (for example, a functional
+       argument of an inlined function). The stores to these variables are removed
+       when they are not read any more.
+    *)
+    let known_calls code =
+      let closure_free = M.fold (fun f _ s -> S.add f s) (functions code) S.empty in
+      let rec direct g acc n = function
+      | (LINE _ as i) :: tl               -> direct g (i :: acc) n tl
+      | i :: tl when is_push i            -> direct g (i :: acc) (n+1) tl
+      | CALLC (m, t) :: tl when m = n     -> Some (List.rev (CALL (g, n, t) :: acc), tl)
+      | _                                 -> None
+      in
+      let function_code def =
+        let stores = Hashtbl.create 16 in
+        let add k v = Hashtbl.replace stores k (v :: try Hashtbl.find stores k with Not_found -> []) in
+        let rec collect = function
+        | CLOSURE (g, []) :: ST (Value.Local k) :: tl when S.mem g closure_free -> add k (Some g); collect tl
+        | (ST (Value.Local k) | LDA (Value.Local k)) :: tl                   -> add k None; collect tl
+        | _ :: tl                                                            -> collect tl
+        | []                                                                 -> ()
+        in
+        collect def;
+        let known k = match (try Hashtbl.find stores k with Not_found -> []) with [Some g] -> Some g | _ -> None in
+        let rec rewrite acc = function
+        | [] -> List.rev acc
+        | (CLOSURE (g, []) as i) :: tl when S.mem g closure_free ->
+           (match direct g [] 0 tl with
+            | Some (code, tl) -> rewrite (List.rev_append code acc) tl
+            | None            -> rewrite (i :: acc) tl
+           )
+        | (LD (Value.Local k) as i) :: tl ->
+           (match known k with
+            | Some g -> (match direct g [] 0 tl with
+                         | Some (code, tl) -> rewrite (List.rev_append code acc) tl
+                         | None            -> rewrite (i :: acc) tl
+                        )
+            | None   -> rewrite (i :: acc) tl
+           )
+        | i :: tl -> rewrite (i :: acc) tl
+        in
+        let def  = rewrite [] def in
+        let read k =
+          List.exists
+            (function LD (Value.Local j) -> j = k | CLOSURE (_, ds) -> List.mem (Value.Local k) ds | _ -> false)
+            def
+        in
+        List.fold_right
+          (fun i acc ->
+             match i, acc with
+             | ST (Value.Local k), DROP :: _ when known k <> None && not (read k) -> acc
+             | _ -> i :: acc
+          )
+          def
+          []
+      in
+      map_functions function_code code
+
+    (* Lambda lifting
+
+       A function with a non-empty closure, which is only called directly (that
+       is, its closure is created right before the call), receives the captured
+       values as extra arguments instead and becomes closure-free. This saves the
+       allocation of a closure at each call.
+    *)
+    let lift code =
+      let rec call_args acc n = function
+      | (LINE _ as i) :: tl                                     -> call_args (i :: acc) n tl
+      | (CONST _ | LD _ | LDA _ | STRING _ as i) :: tl          -> call_args (i :: acc) (n+1) tl
+      | CALLC (m, t) :: tl when m = n                           -> Some (List.rev acc, t, tl)
+      | _                                                       -> None
+      in
+      let candidates =
+        List.fold_left
+          (fun m -> function BEGIN (f, nargs, _, (_ :: _ as c), _, _) -> M.add f (nargs, List.length c) m | _ -> m)
+          M.empty
+          code
+      in
+      let rec check lifted = function
+      | [] -> lifted
+      | CLOSURE (f, _) :: tl when M.mem f lifted ->
+         (match call_args [] 0 tl with
+          | Some (args, _, _) when List.length (List.filter (function LINE _ -> false | _ -> true) args) = fst (M.find f lifted) -> check lifted tl
+          | _ -> check (M.remove f lifted) tl
+         )
+      | _ :: tl -> check lifted tl
+      in
+      let lifted = check candidates code in
+      (* the captured values become arguments named in the debug info as the
+         variables of the function which creates the closure *)
+      let captured =
+        let rec local i = function
+        | []      -> None
+        | s :: ss ->
+           (match List.find_opt (fun (_, j) -> j = i) s.names with
+            | Some (x, _) -> Some x
+            | None        -> (match local i s.subs with None -> local i ss | x -> x)
+           )
+        in
+        let name args scopes k d =
+          match d with
+          | Value.Local i -> (match local i scopes with Some x -> x | None -> Printf.sprintf "captured_%d" k)
+          | Value.Arg   i when i < List.length args -> List.nth args i
+          | _             -> Printf.sprintf "captured_%d" k
+        in
+        let rec names args scopes m = function
+        | [] -> m
+        | BEGIN (_, _, _, _, args, scopes) :: tl -> names args scopes m tl
+        | CLOSURE (f, ds) :: tl when M.mem f lifted && not (M.mem f m) ->
+           names args scopes (M.add f (List.mapi (name args scopes) ds) m) tl
+        | _ :: tl -> names args scopes m tl
+        in
+        names [] [] M.empty code
+      in
+      let rec rewrite acc = function
+      | [] -> List.rev acc
+      | (CLOSURE (f, ds) as i) :: tl when M.mem f lifted ->
+         (match call_args [] 0 tl with
+          | Some (args, t, tl) ->
+             let n = fst (M.find f lifted) in
+             rewrite (List.rev_append (args @ List.map (fun d -> LD d) ds @ [CALL (f, n + List.length ds, t)]) acc) tl
+          | None -> rewrite (i :: acc) tl
+         )
+      | i :: tl -> rewrite (i :: acc) tl
+      in
+      map_functions
+        (function
+         | BEGIN (f, nargs, nlocals, c, args, scopes) :: body when M.mem f lifted ->
+            let dsg = function Value.Access i -> Value.Arg (nargs + i) | d -> d in
+            let names = try M.find f captured with Not_found -> List.mapi (fun i _ -> Printf.sprintf "captured_%d" i) c in
+            BEGIN (f, nargs + List.length c, nlocals, [], args @ names, scopes) ::
+            List.map
+              (function
+               | LD  d           -> LD  (dsg d)
+               | LDA d           -> LDA (dsg d)
+               | ST  d           -> ST  (dsg d)
+               | CLOSURE (g, ds) -> CLOSURE (g, List.map dsg ds)
+               | i               -> i
+              )
+              body
+         | def -> def
+        )
+        (rewrite [] code)
+
+    let optimize code =
+      let pass code = labels @@ unreachable @@ thread @@ simplify code in
+      let rec fix n code =
+        let code' = pass code in
+        if n = 0 || code' = code then code' else fix (n-1) code'
+      in
+      fix 16 @@ inline @@ known_calls @@ inline @@ lift @@ fix 16 code
+
+  end
+
 (* Stack machine compiler
 
      val compile : Language.t -> prg
@@ -1146,4 +1546,10 @@ let compile cmd ((imports, infixes), p) =
   (*Printf.eprintf "Before fix:\n%s\n" (show_prg prg);  *)
   let prg = fix_closures env prg in
   cmd#dump_SM prg;
-  prg
+  if cmd#is_optimize
+  then (
+    let prg = Optimizer.optimize prg in
+    cmd#dump_optimized_SM prg;
+    prg
+  )
+  else prg
@@ -7,11 +7,21 @@ open SM
 (* The registers: *)
 let regs = [|"%ebx"; "%ecx"; "%esi"; "%edi"; "%eax"; "%edx"; "%ebp"; "%esp"|]
 
+(* Their x86-64 counterparts; the extra ones are used to call C functions and
+   to keep local variables *)
+let regs64 = [|"%rbx"; "%rcx"; "%rsi"; "%rdi"; "%rax"; "%rdx"; "%rbp"; "%rsp"; "%r8"; "%r9"; "%r12"; "%r13"; "%r14"; "%r15"; "%r10"; "%r11"|]
+
 (* We can not freely operate with all register; only 3 by now *)
 let num_of_regs = Array.length regs - 5
 
+(* The target: x86 by default, x86-64 with -m64 *)
+let x64 = Pervasives.ref false
+
+(* Places non-escaping arrays and closures in the frames (enabled with -O) *)
+let stack_objects = Pervasives.ref false
+
 (* We need to know the word size to calculate offsets correctly *)
-let word_size = 4;;
+let word_size () = if !x64 then 8 else 4;;
 
 (* We need to distinguish the following operand types: *)
 @type opnd =
@@ -35,6 +45,21 @@ let edx = R 5
 let ebp = R 6
 let esp = R 7
 
+(* x86-64 only *)
+let r8  = R 8
+let r9  = R 9
+let r12 = R 10
+let r13 = R 11
+let r14 = R 12
+let r15 = R 13
+let r10 = R 14
+let r11 = R 15
+
+(* A global variable of a unit; the variables are addressed through a segment
+   register which points to the copy of the current runtime instance (see
+   "Global variables of units" in runtime.c) *)
+let global x = M ((if !x64 then "%gs:" else "%fs:") ^ x)
+
 (* Now x86 instruction (we do not need all of them): *)
 type instr =
 (* copies a value from the first to the second operand   *) | Mov   of opnd * opnd
@@ -64,41 +89,43 @@ type instr =
 (* Instruction printer *)
 let stack_offset i =
   if i >= 0
-  then (i+1) * word_size
-  else 8 + (-i-1) * word_size
+  then (i+1) * word_size ()
+  else 2 * word_size () + (-i-1) * word_size ()
   
 let show instr =
+  let reg i = if !x64 then regs64.(i) else regs.(i) in
+  let sfx   = if !x64 then "q" else "l" in
   let rec opnd = function
-  | R i      -> regs.(i)
-  | C        -> "4(%ebp)"              
+  | R i      -> reg i
+  | C        -> Printf.sprintf "%d(%s)" (word_size ()) (reg 6)
   | S i      -> if i >= 0
-                then Printf.sprintf "-%d(%%ebp)" (stack_offset i)
-                else Printf.sprintf "%d(%%ebp)"  (stack_offset i)
+                then Printf.sprintf "-%d(%s)" (stack_offset i) (reg 6)
+                else Printf.sprintf "%d(%s)"  (stack_offset i) (reg 6)
   | M x      -> x
   | L i      -> Printf.sprintf "$%d" i
   | I (0, x) -> Printf.sprintf "(%s)" (opnd x)
   | I (n, x) -> Printf.sprintf "%d(%s)" n (opnd x)
   in
   let binop = function
-  | "+"    -> "addl"
-  | "-"    -> "subl"
-  | "*"    -> "imull"
-  | "&&"   -> "andl"
-  | "!!"   -> "orl"
-  | "^"    -> "xorl"
-  | "cmp"  -> "cmpl"
+  | "+"    -> "add"  ^ sfx
+  | "-"    -> "sub"  ^ sfx
+  | "*"    -> "imul" ^ sfx
+  | "&&"   -> "and"  ^ sfx
+  | "!!"   -> "or"   ^ sfx
+  | "^"    -> "xor"  ^ sfx
+  | "cmp"  -> "cmp"  ^ sfx
   | "test" -> "test"
   | _      -> failwith "unknown binary operator"
   in
   match instr with
-  | Cltd               -> "\tcltd"
+  | Cltd               -> if !x64 then "\tcqto" else "\tcltd"
   | Set   (suf, s)     -> Printf.sprintf "\tset%s\t%s"     suf s
-  | IDiv   s1          -> Printf.sprintf "\tidivl\t%s"     (opnd s1)
+  | IDiv   s1          -> Printf.sprintf "\tidiv%s\t%s"    sfx (opnd s1)
   | Binop (op, s1, s2) -> Printf.sprintf "\t%s\t%s,\t%s"   (binop op) (opnd s1) (opnd s2)
-  | Mov   (s1, s2)     -> Printf.sprintf "\tmovl\t%s,\t%s" (opnd s1) (opnd s2)
-  | Lea   (x,  y)      -> Printf.sprintf "\tleal\t%s,\t%s" (opnd x) (opnd y)
-  | Push   s           -> Printf.sprintf "\tpushl\t%s"     (opnd s)
-  | Pop    s           -> Printf.sprintf "\tpopl\t%s"      (opnd s)
+  | Mov   (s1, s2)     -> Printf.sprintf "\tmov%s\t%s,\t%s" sfx (opnd s1) (opnd s2)
+  | Lea   (x,  y)      -> Printf.sprintf "\tlea%s\t%s,\t%s" sfx (opnd x) (opnd y)
+  | Push   s           -> Printf.sprintf "\tpush%s\t%s"    sfx (opnd s)
+  | Pop    s           -> Printf.sprintf "\tpop%s\t%s"     sfx (opnd s)
   | Ret                -> "\tret"
   | Call   p           -> Printf.sprintf "\tcall\t%s" p
   | CallI  o           -> Printf.sprintf "\tcall\t*(%s)" (opnd o)
@@ -106,11 +133,248 @@ let show instr =
   | Jmp    l           -> Printf.sprintf "\tjmp\t%s" l
   | CJmp  (s , l)      -> Printf.sprintf "\tj%s\t%s" s l
   | Meta   s           -> Printf.sprintf "%s\n" s
-  | Dec    s           -> Printf.sprintf "\tdecl\t%s" (opnd s)
-  | Or1    s           -> Printf.sprintf "\torl\t$0x0001,\t%s" (opnd s)
-  | Sal1   s           -> Printf.sprintf "\tsall\t%s" (opnd s)
-  | Sar1   s           -> Printf.sprintf "\tsarl\t%s" (opnd s)
-  | Repmovsl           -> Printf.sprintf "\trep movsl\t"
+  | Dec    s           -> Printf.sprintf "\tdec%s\t%s" sfx (opnd s)
+  | Or1    s           -> Printf.sprintf "\tor%s\t$0x0001,\t%s" sfx (opnd s)
+  | Sal1   s           -> Printf.sprintf "\tsal%s\t%s" sfx (opnd s)
+  | Sar1   s           -> Printf.sprintf "\tsar%s\t%s" sfx (opnd s)
+  | Repmovsl           -> Printf.sprintf "\trep movs%s\t" sfx
+
+(* Peephole optimizer
+
+   Rewrites the instruction list right before emission: fuses comparisons
+   with conditional jumps, folds constant operands into tagged arithmetic,
+   forwards values through %eax, reuses register contents within basic
+   blocks (local CSE) and removes dead stores. The comments ("# ..."
+   meta instructions) are transparent for the patterns; labels, jumps,
+   calls and other directives are barriers.
+
+   The patterns rely on the invariants of the code generator: the operands
+   consumed by an instruction of the stack machine are dead after it, and
+   %eax is only live across labels and jumps on the way to the epilogue.
+*)
+module Peephole =
+  struct
+
+    let is_comment = function Meta s -> String.length s > 0 && s.[0] = '#' | _ -> false
+
+    let is_reg = function R _ -> true | _ -> false
+
+    let is_mem = function S _ | C | I _ -> true | M x -> x.[0] <> '$' | _ -> false
+
+    (* checks if the operand o refers to x (directly or as an address base) *)
+    let rec mentions x o =
+      o = x ||
+      match o with
+      | I (_, y) -> mentions x y
+      | S _ | C  -> x = ebp
+      | _        -> false
+
+    (* operands read by an instruction *)
+    let reads = function
+    | Binop ("^", a, b) when a = b -> []
+    | Mov   (a, b)                 -> a :: (match b with I (_, x) -> [x] | _ -> [])
+    | Lea   (a, _)                 -> (match a with I (_, x) -> [x] | _ -> [])
+    | Binop (_, a, b)              -> [a; b]
+    | IDiv   a                     -> [a; eax; edx]
+    | Cltd                         -> [eax]
+    | Push   a                     -> [a; esp]
+    | Pop    a                     -> esp :: (match a with I (_, x) -> [x] | _ -> [])
+    | Dec a | Or1 a | Sal1 a | Sar1 a | CallI a -> [a]
+    | _                            -> []
+
+    (* operands written by an instruction; None for the barriers *)
+    let writes = function
+    | Mov (_, b) | Lea (_, b)               -> Some [b]
+    | Pop  b                                -> Some [b; esp]
+    | Binop (("cmp" | "test"), _, _)        -> Some []
+    | Binop (_, _, b)                       -> Some [b]
+    | IDiv  _                               -> Some [eax; edx]
+    | Cltd                                  -> Some [edx]
+    | Set  (_, r)                           -> Some [if r = "%dl" then edx else eax]
+    | Push _                                -> Some [esp]
+    | Dec a | Or1 a | Sal1 a | Sar1 a       -> Some [a]
+    | CJmp _                                -> Some []
+    | i when is_comment i                   -> Some []
+    | _                                     -> None
+
+    let epilogue l = Filename.check_suffix l "_epilogue"
+
+    (* annotates each instruction with the liveness of %eax after it *)
+    let eax_liveness code =
+      fst @@
+      List.fold_left
+        (fun (acc, live) i ->
+          let live' =
+            match i with
+            | Ret                   -> true
+            | Jmp   l               -> l = "*%eax" || l = "*%rax" || epilogue l
+            | CJmp (_, l)           -> live || epilogue l
+            | Label l               -> live || epilogue l
+            | Call  _               -> false
+            | CallI a               -> mentions eax a
+            | Meta  _               -> live
+            | Set (_, _)            -> live
+            | i                     ->
+               List.exists (mentions eax) (reads i) ||
+               (live && not (match writes i with Some ws -> List.mem eax ws | None -> false))
+          in
+          (i, live) :: acc, live'
+        )
+        ([], false)
+        (List.rev code)
+
+    let negate = function
+    | "l"  -> "ge"
+    | "le" -> "g"
+    | "e"  -> "ne"
+    | "ne" -> "e"
+    | "ge" -> "l"
+    | "g"  -> "le"
+    | s    -> failwith (Printf.sprintf "unknown condition suffix %s" s)
+
+    (* splits off at most n instructions skipping the comments *)
+    let window n code =
+      let rec inner n comments acc = function
+      | (i, _) :: code when is_comment i       -> inner n (i :: comments) acc code
+      | x :: code when n > 0                   -> inner (n-1) comments (x :: acc) code
+      | code                                   -> List.rev comments, List.rev acc, code
+      in
+      inner n [] [] code
+
+    (* rewrites a prefix of instructions; returns the replacement and the
+       number of instructions consumed *)
+    let rewrite w =
+      let dead_eax k = not (snd (List.nth w (k-1))) in
+      match List.map fst w with
+      (* fused comparison and conditional jump *)
+      | Binop ("^", R 4, R 4) :: Binop ("cmp", x, y) :: Set (suf, "%al") :: Sal1 (R 4) :: Or1 (R 4) :: Mov (R 4, y1) ::
+        Sar1 y2 :: Binop ("cmp", L 0, y3) :: CJmp (c, l) :: _
+          when y = y1 && y = y2 && y = y3 && dead_eax 9 ->
+         Some ([Binop ("cmp", x, y); CJmp ((if c = "nz" then suf else negate suf), l)], 9)
+      | Binop ("^", R 4, R 4) :: Mov (x, R 5) :: Binop ("cmp", R 5, y) :: Set (suf, "%al") :: Sal1 (R 4) :: Or1 (R 4) :: Mov (R 4, y1) ::
+        Mov (C, R 5) :: Sar1 y2 :: Binop ("cmp", L 0, y3) :: CJmp (c, l) :: _
+          when y = y1 && y = y2 && y = y3 && dead_eax 11 ->
+         Some ([Mov (x, edx); Binop ("cmp", edx, y); Mov (C, edx); CJmp ((if c = "nz" then suf else negate suf), l)], 11)
+      | Binop ("^", R 4, R 4) :: Mov (x, R 5) :: Binop ("cmp", R 5, y) :: Set (suf, "%al") :: Sal1 (R 4) :: Or1 (R 4) :: Mov (R 4, y1) ::
+        Sar1 y2 :: Binop ("cmp", L 0, y3) :: CJmp (c, l) :: _
+          when y = y1 && y = y2 && y = y3 && dead_eax 10 ->
+         Some ([Mov (x, edx); Binop ("cmp", edx, y); CJmp ((if c = "nz" then suf else negate suf), l)], 10)
+      (* a boxed condition is false iff it is equal to box 0 *)
+      | Sar1 x :: Binop ("cmp", L 0, x1) :: CJmp (c, l) :: _ when x = x1 ->
+         Some ([Binop ("cmp", L 1, x); CJmp (c, l)], 3)
+      (* constant operands of tagged arithmetic *)
+      | Mov (L c, s) :: Binop ("+", s1, y) :: Dec y1 :: _ when s = s1 && y = y1 && s <> y ->
+         Some ((if c = 1 then [] else [Binop ("+", L (c-1), y)]), 3)
+      | Mov (L c, s) :: Binop ("-", s1, y) :: Or1 y1 :: _ when s = s1 && y = y1 && s <> y ->
+         Some ((if c = 1 then [] else [Binop ("-", L (c-1), y)]), 3)
+      | Mov (L c, s) :: Dec y :: Mov (s1, R 4) :: Sar1 (R 4) :: Binop ("*", R 4, y1) :: Or1 y2 :: _
+          when s = s1 && y = y1 && y = y2 && s <> y && is_reg y && dead_eax 6 ->
+         Some ([Dec y; Binop ("*", L (c asr 1), y); Or1 y], 6)
+      (* forwarding through %eax *)
+      | Mov (a, R 4) :: Mov (R 4, b) :: _
+          when not (is_mem a && is_mem b) && not (mentions eax a) && not (mentions eax b) && dead_eax 2 ->
+         Some ([Mov (a, b)], 2)
+      (* redundant moves *)
+      | Mov (x, y) :: _ when x = y -> Some ([], 1)
+      | Mov (x, y) :: Mov (y1, x1) :: _ when x = x1 && y = y1 && not (mentions y x) -> Some ([Mov (x, y)], 2)
+      (* restoring a register just to save it again *)
+      | Pop r :: Push r1 :: _ when r = r1 && is_reg r -> Some ([Mov (I (0, esp), r)], 2)
+      | _ -> None
+
+    let patterns code =
+      let rec inner acc code =
+        match window 11 code with
+        | _, [], _ -> List.rev_append acc (List.map fst code)
+        | comments, w, rest ->
+           match rewrite w with
+           | Some (w', k) ->
+              let rec drop k = function x :: l when k > 0 -> drop (k-1) l | l -> l in
+              inner (List.rev_append w' (List.rev_append comments acc)) (drop k w @ rest)
+           | None ->
+              (* emit the comments preceding the first instruction and the instruction itself *)
+              let rec first acc = function
+              | (i, _) :: code when is_comment i -> first (i :: acc) code
+              | (i, _) :: code                   -> i :: acc, code
+              | []                               -> acc, []
+              in
+              let acc, code = first acc code in
+              inner acc code
+      in
+      inner [] (eax_liveness code)
+
+    (* local CSE: tracks the operands kept in registers within a basic block *)
+    let cse code =
+      let kill w state =
+        List.filter
+          (fun (r, c) -> r <> w && c <> w && not (mentions w c) && not (match w with I _ -> is_mem c | _ -> false))
+          state
+      in
+      let rec inner acc state = function
+      | [] -> List.rev acc
+      | i :: code when is_comment i -> inner (i :: acc) state code
+      | (Mov (a, r) as i) :: code when is_reg r ->
+         if List.mem (r, a) state
+         then inner acc state code
+         else
+           let state = kill r state in
+           let state = match a with I _ -> state | _ when a = r -> state | _ -> (r, a) :: state in
+           inner (i :: acc) state code
+      | (Mov (r, m) as i) :: code when is_reg r && is_mem m && (match m with I _ -> false | _ -> true) ->
+         if List.mem (r, m) state
+         then inner acc state code
+         else inner (i :: acc) ((r, m) :: kill m state) code
+      | i :: code ->
+         let state =
+           match writes i with
+           | Some ws -> List.fold_left (fun s w -> kill w s) state ws
+           | None    -> []
+         in
+         inner (i :: acc) state code
+      in
+      inner [] [] code
+
+    (* dead stores: a store immediately overwritten *)
+    let dse code =
+      let rec inner acc = function
+      | [] -> List.rev acc
+      | (Mov (_, x) as i) :: code when (is_reg x || is_mem x) && x <> esp && (match x with I _ -> false | _ -> true) ->
+         let rec next = function
+         | j :: code when is_comment j -> next code
+         | Mov (b, x1) :: _ when x = x1 && not (mentions x b) && not (is_mem x && match b with I _ -> true | _ -> false) -> true
+         | _ -> false
+         in
+         if next code then inner acc code else inner (i :: acc) code
+      | i :: code -> inner (i :: acc) code
+      in
+      inner [] code
+
+    let optimize code = dse (cse (patterns code))
+
+  end
+
+(* Thunks for the closures of built-ins (x86-64 only)
+
+   A closure is called with its arguments on the stack, both from the Lama
+   code (CALLC) and from the runtime (__call_closure in gc_runtime64.s),
+   while a built-in implemented in C takes them in the registers. Thus a
+   closure of a built-in points to a thunk which loads up to six arguments
+   into the registers and calls the built-in as ccall does; it is emitted in
+   each unit which takes such a closure
+*)
+let thunk_label f = ".Lthunk_" ^ f
+
+let thunk f =
+  [Label (thunk_label f);
+   Push ebp;
+   Mov (esp, ebp)] @
+  List.mapi (fun i r -> Mov (I (stack_offset (-i-1), ebp), r)) [edi; esi; edx; ecx; r8; r9] @
+  [Mov (L 1, I (-8, esp));
+   Binop ("&&", L (-16), esp);
+   Binop ("^", eax, eax);
+   Call f;
+   Mov (ebp, esp);
+   Pop ebp;
+   Ret]
 
 (* Opening stack machine to use instructions without fully qualified names *)
 open SM
@@ -135,11 +399,49 @@ let compile cmd env imports code =
   | _    -> failwith "unknown operator"
   in
   let box n = (n lsl 1) lor 1 in 
+  (* The built-ins implemented in C; they are called with the C calling convention *)
+  let builtins =
+    if !x64
+    then List.fold_left (fun acc -> function `Fun name -> ("L" ^ name) :: acc | _ -> acc) [] (snd (Interface.find "Std" cmd#get_include_paths))
+    else []
+  in
+  let is_builtin f = f.[0] = 'B' || List.mem f builtins in
+  (* the entry point of a closure of a function (see thunk) *)
+  let entry env f = if !x64 && is_builtin f then env#thunk f else f, env in
+  (* on x86-64 main keeps the registers preserved across calls for its caller
+     above the return address, out of the stack scanned by the GC; hence it
+     does not make tail calls, which would also write over the frame of the
+     caller as the arguments of main are passed in the registers *)
+  let saved env = if !x64 && env#fname = "main" then [ebx; r12; r13; r14; r15] else [] in
+  (* Calls a C function with the arguments pushed by pushs (the first argument is
+     pushed last); on x86-64 the first six arguments are popped into registers and
+     the stack is aligned to 16 bytes at the call, %r12 keeps the stack pointer *)
+  let ccall f pushs =
+    if !x64
+    then
+      let n = List.length pushs in
+      let rec pops i = function
+      | r :: rs when i < n -> Pop r :: pops (i+1) rs
+      | _                  -> []
+      in
+      [Mov (esp, r12); Mov (L 1, I (-8, esp)); Binop ("&&", L (-16), esp)] @
+      (if n > 6 && (n - 6) mod 2 = 1 then [Push (L 1)] else []) @
+      pushs @
+      pops 0 [edi; esi; edx; ecx; r8; r9] @
+      [Binop ("^", eax, eax); Call f; Mov (r12, esp)]
+    else pushs @ [Call f; Binop ("+", L (word_size () * List.length pushs), esp)]
+  in
   let rec compile' env scode =
     let on_stack = function S _ -> true | _ -> false in
     let mov x s = if on_stack x && on_stack s then [Mov (x, eax); Mov (eax, s)] else [Mov (x, s)]  in
+    (* stores into a frame slot and takes the address of a frame slot *)
+    let store x s = match x with R _ | L _ -> [Mov (x, s)] | _ -> [Mov (x, eax); Mov (eax, s)] in
+    let lea   x s = match s with R _ -> [Lea (x, s)] | _ -> [Lea (x, eax); Mov (eax, s)] in
+    (* A tail call reuses the argument area of the current function, which is
+       freed by its caller; thus the callee may take at most as many arguments,
+       the rest of the area is left as is *)
     let callc env n tail =
-      let tail = tail && env#nargs = n in 
+      let tail = tail && n <= env#nargs && saved env = [] in 
       if tail
       then (
         let rec push_args env acc = function
@@ -157,7 +459,7 @@ let compile cmd env imports code =
                       Mov (ebp, esp);
                       Pop (ebp)] @
                       (if env#has_closure then [Pop ebx] else []) @
-                      [Jmp "*%eax"] (* UGLY!!! *)
+                      [Jmp (if !x64 then "*%rax" else "*%eax")] (* UGLY!!! *)
       )
       else (
         let pushr, popr =
@@ -178,16 +480,16 @@ let compile cmd env imports code =
             then [Mov (closure, edx); Mov (edx, eax); CallI eax]
             else [Mov (closure, edx); CallI closure]
           in
-          env, pushr @ pushs @ call_closure @ [Binop ("+", L (word_size * List.length pushs), esp)] @ (List.rev popr) 
+          env, pushr @ pushs @ call_closure @ [Binop ("+", L (word_size () * List.length pushs), esp)] @ (List.rev popr) 
         in
         let y, env = env#allocate in env, code @ [Mov (eax, y)]
       )
     in
     let call env f n tail =
-      let tail = tail && env#nargs = n && f.[0] <> '.' in 
       let f =
         match f.[0] with '.' -> "B" ^ String.sub f 1 (String.length f - 1) | _ -> f
       in
+      let tail = tail && n <= env#nargs && f.[0] <> 'B' && not (!x64 && is_builtin f) && saved env = [] in 
       if tail
       then (
         let rec push_args env acc = function
@@ -220,7 +522,11 @@ let compile cmd env imports code =
             | "Bsta"   -> pushs
             | _        -> List.rev pushs
           in
-          env, pushr @ pushs @ [Call f; Binop ("+", L (word_size * List.length pushs), esp)] @ (List.rev popr) 
+          env, pushr @
+               (if is_builtin f
+                then ccall f pushs
+                else pushs @ [Call f; Binop ("+", L (word_size () * List.length pushs), esp)]) @
+               (List.rev popr) 
         in
         let y, env = env#allocate in env, code @ [Mov (eax, y)]
       )
@@ -243,7 +549,24 @@ let compile cmd env imports code =
           | EXTERN name -> env#register_extern name, []
           | IMPORT name -> env, []
                          
+          | CLOSURE (name, []) when !stack_objects ->
+             let name, env = entry env name in
+             let c, env = env#static_closure name in
+             let s, env = env#allocate in
+             env, [Mov (c, s)]
+
+          | CLOSURE (name, closure) when env#stack_object <> None ->
+             let Some b = env#stack_object in
+             let name, env = entry env name in
+             let n      = List.length closure in
+             let k      = n + 2 in
+             let s, env = env#allocate in
+             env, [Mov (L (((n+1) lsl 3) lor 7), S (b+k-1)); Mov (M ("$" ^ name), S (b+k-2))] @
+                  List.concat (List.mapi (fun i d -> store (env#loc d) (S (b+k-3-i))) closure) @
+                  lea (S (b+k-2)) s
+
           | CLOSURE (name, closure) ->
+             let name, env = entry env name in
              let pushr, popr =
                List.split @@ List.map (fun r -> (Push r, Pop r)) (env#live_registers 0)
              in
@@ -254,12 +577,8 @@ let compile cmd env imports code =
              let s, env = env#allocate in             
              (env,
               pushr @
-              push_closure @
-              [Push (M ("$" ^ name));
-              Push (L (box closure_len));
-              Call "Bclosure";
-              Binop ("+", L (word_size * (closure_len + 2)), esp); 
-              Mov (eax, s)] @
+              ccall "Bclosure" (push_closure @ [Push (M ("$" ^ name)); Push (L (box closure_len))]) @
+              [Mov (eax, s)] @
               List.rev popr @ env#reload_closure)
              
   	  | CONST n ->
@@ -276,7 +595,15 @@ let compile cmd env imports code =
              let s,  env' = (env #variable x)#allocate in
              let s', env''= env'#allocate in
              env'',
-             [Lea (env'#loc x, eax); Mov (eax, s); Mov (eax, s')]	     
+             (match x with
+              | Value.Global name ->
+                 (* lea ignores the base of the segment *)
+                 [Mov (M ("$global_" ^ name), eax);
+                  Binop ("-", M "$__start_custom_data", eax);
+                  Binop ("+", global "__globals_base", eax)]
+              | _ -> [Lea (env'#loc x, eax)]
+             ) @
+             [Mov (eax, s); Mov (eax, s')]	     
 
 	  | LD x ->
              let s, env' = (env#variable x)#allocate in
@@ -426,12 +753,15 @@ let compile cmd env imports code =
              env#assert_empty_stack;
              let has_closure = closure <> [] in
              let env         = env#enter f nargs nlocals has_closure in
+             let cfa         = ((if has_closure then 3 else 2) + List.length (saved env)) * word_size () in
+             let dwarf_bp    = if !x64 then 6 else 5 in
              env, [Meta (Printf.sprintf "\t.type %s, @function" name)] @
                   (if f = "main"
                    then []
                    else 
                      [Meta (Printf.sprintf "\t.stabs \"%s:F1\",36,0,0,%s" name f)] @
-                     (List.mapi (fun i a -> Meta (Printf.sprintf "\t.stabs \"%s:p1\",160,0,0,%d" a ((i*4) + 8))) args)  @
+                     (* the closure is pushed above the arguments *)
+                     (List.mapi (fun i a -> Meta (Printf.sprintf "\t.stabs \"%s:p1\",160,0,0,%d" a (stack_offset (-i - if closure <> [] then 2 else 1)))) args)  @
                      (List.flatten @@ List.map stabs_scope scopes)                         
                   )
                   @
@@ -439,34 +769,42 @@ let compile cmd env imports code =
                   (if has_closure then [Push edx] else []) @
                   (if f = cmd#topname
                    then
-                     [Mov   (M "_init", eax);
+                     (* the segment is not set up before __gc_init *)
+                     let init = if f = "main" then M "_init" else global "_init" in
+                     [Mov   (init, eax);
                       Binop ("test", eax, eax);
                       CJmp  ("z", "_continue");
                       Ret;
                       Label "_continue";
-                      Mov (L 1, M "_init");
+                      Mov (L 1, init);
                      ]
                    else []
-                  ) @                  
+                  ) @
+                  List.map (fun r -> Push r) (saved env) @
                   [Push ebp;
-                   Meta ("\t.cfi_def_cfa_offset\t" ^ if has_closure then "12" else "8");
-                   Meta ("\t.cfi_offset 5, -" ^ if has_closure then "12" else "8");
+                   Meta (Printf.sprintf "\t.cfi_def_cfa_offset\t%d" cfa);
+                   Meta (Printf.sprintf "\t.cfi_offset %d, -%d" dwarf_bp cfa);
                    Mov (esp, ebp);
-                   Meta "\t.cfi_def_cfa_register\t5";
-                   Binop ("-", M ("$" ^ env#lsize), esp);
+                   Meta (Printf.sprintf "\t.cfi_def_cfa_register\t%d" dwarf_bp)] @
+                  (if f = "main" && !x64 then [Mov (edi, r13); Mov (esi, r14)] else []) @
+                  [Binop ("-", M ("$" ^ env#lsize), esp);
                    Mov (esp, edi);
 	           Mov (M "$filler", esi);
 	           Mov (M ("$" ^ (env#allocated_size)), ecx);
 	           Repmovsl
                   ] @
                   (if f = "main"
-                   then [Call "__gc_init"; Push (I (12, ebp)); Push (I (8, ebp)); Call "set_args"; Binop ("+", L 8, esp)]
+                   then
+                     if !x64
+                     then ccall "__gc_init" [] @ ccall "set_args" [Push r14; Push r13]
+                     else [Call "__gc_init"; Push (I (12, ebp)); Push (I (8, ebp)); Call "set_args"; Binop ("+", L 8, esp)]
                    else []
                   ) @
                   (if f = cmd#topname
                    then List.map (fun i -> Call ("init" ^ i)) (List.filter (fun i -> i <> "Std") imports)
                    else []
-                  )    
+                  ) @
+                  env#init_locals
 
           | END ->
              let x, env = env#pop in
@@ -478,15 +816,17 @@ let compile cmd env imports code =
                  Mov (ebp, esp);
                  Pop ebp;
                ] @
+               List.rev_map (fun r -> Pop r) (saved env) @
                env#rest_closure @
                (if name = "main" then [Binop ("^", eax, eax)] else []) @
-               [Meta "\t.cfi_restore\t5";
-	        Meta "\t.cfi_def_cfa\t4, 4";
+               [Meta (if !x64 then "\t.cfi_restore\t6" else "\t.cfi_restore\t5");
+	        Meta (if !x64 then "\t.cfi_def_cfa\t7, 8" else "\t.cfi_def_cfa\t4, 4");
                 Ret;
                 Meta "\t.cfi_endproc";
-                Meta (Printf.sprintf "\t.set\t%s,\t%d" env#lsize (env#allocated * word_size));
+                Meta (Printf.sprintf "\t.set\t%s,\t%d" env#lsize (env#allocated * word_size ()));
                 Meta (Printf.sprintf "\t.set\t%s,\t%d" env#allocated_size env#allocated);
                 Meta (Printf.sprintf "\t.size %s, .-%s" name name);
+                Label (Printf.sprintf ".L%s_end" name)
                ]
 
           | RET ->
@@ -495,6 +835,18 @@ let compile cmd env imports code =
 
           | ELEM              -> call env ".elem" 2 false
                                
+          | CALL (".array", n, _) when env#stack_object <> None ->
+             let Some b = env#stack_object in
+             let k      = n + 1 in
+             let rec fields env acc j =
+               if j < 0
+               then env, acc
+               else let x, env = env#pop in fields env (store x (S (b+k-2-j)) @ acc) (j-1)
+             in
+             let env, stores = fields env [] (n-1) in
+             let s, env      = env#allocate in
+             env, [Mov (L ((n lsl 3) lor 3), S (b+k-1))] @ stores @ lea (S (b+k-2)) s
+
           | CALL (f, n, tail) -> call env f n tail
                          
           | CALLC (n, tail) -> callc env n tail
@@ -545,12 +897,12 @@ let compile cmd env imports code =
           | FAIL ((line, col), value) ->                       
              let v, env = if value then env#peek, env else env#pop in
              let s, env = env#string cmd#get_infile in
-             env, [Push (L (box col)); Push (L (box line)); Push (M ("$" ^ s)); Push v; Call "Bmatch_failure"; Binop  ("+", L (4 * word_size), esp)]
+             env, ccall "Bmatch_failure" [Push (L (box col)); Push (L (box line)); Push (M ("$" ^ s)); Push v]
              
           | i ->
              invalid_arg (Printf.sprintf "invalid SM insn: %s\n" (GT.show(insn) i))
         in
-        let env'', code'' = compile' env' scode' in
+        let env'', code'' = compile' env'#step scode' in
 	env'', [Meta (Printf.sprintf "# %s / % s" (GT.show(SM.insn) instr) stack)] @ code' @ code''
   in
   compile' env code
@@ -561,6 +913,211 @@ module S = Set.Make (String)
 (* A map indexed by strings *)
 module M = Map.Make (String)
 
+(* Register allocation for local variables
+
+   For each function the liveness of its locals is computed over the stack
+   machine code, and the live intervals are then assigned to registers by
+   linear scan. Locals whose address is taken stay in memory. On x86 the
+   registers are borrowed from the symbolic stack (only for locals used more
+   than once); on x86-64 there are dedicated ones. The registers of the
+   locals which are live across a call are saved around it in the same way
+   as the live registers of the symbolic stack, which also makes them
+   visible for the garbage collector.
+*)
+module IS = Set.Make (struct type t = int let compare = compare end)
+
+type allocation = {
+  assigned : (int * opnd) list; (* local index -> register                       *)
+  live     : opnd list array;   (* registers live after each instruction         *)
+  entry    : opnd list;         (* registers of the locals read before any store *)
+  top_reg  : int;               (* the last register of the symbolic stack       *)
+  objects  : (int * int) list;  (* frame allocation site -> offset in the area   *)
+  objects_size : int            (* the size of the frame area for the objects    *)
+}
+
+let local_registers () =
+  if !x64 then [r10; r11; r15; r13; r14] else [edi; esi]
+
+(* Frame allocation of non-escaping objects
+
+   An array or a closure can be placed in the frame of the function which
+   creates it if its pointer never leaves the symbolic stack: the object may
+   only be duplicated, swapped, dropped, matched against patterns, indexed,
+   updated in place, and (a closure) called not in a tail position. These
+   uses are found by a simulation of the symbolic stack over the stack machine
+   code of the function, repeated until it covers the bodies of loops; each
+   allocation site gets its own area in the frame.
+   The garbage collector scans these areas as any other frame slots, which
+   keeps the fields up to date, while the headers are odd and the code
+   pointers of closures never point into the heap. The closures without free
+   variables are static anyway (see CLOSURE). S-expressions are always
+   allocated in the heap since their tag word can look like a heap pointer.
+   Returns the positions of the sites with their offsets in the frame area
+   and the size of the area.
+*)
+let frame_objects code =
+  let escaped = Hashtbl.create 16 in
+  let labels  = Hashtbl.create 16 in
+  let escape  = List.iter (function Some p -> Hashtbl.replace escaped p () | None -> ()) in
+  let merge l stack =
+    try
+      let stack' = Hashtbl.find labels l in
+      if List.length stack <> List.length stack'
+      then (escape stack; escape stack')
+      else List.iter2 (fun x y -> if x <> y then escape [x; y]) stack stack'
+    with Not_found -> Hashtbl.replace labels l stack
+  in
+  let rec pop n stack =
+    if n = 0
+    then [], stack
+    else let x :: stack = stack in
+         let xs, stack  = pop (n-1) stack in
+         x :: xs, stack
+  in
+  let consume n stack = let xs, stack = pop n stack in escape xs; stack in
+  let rec simulate i sites barrier stack = function
+  | [] -> sites
+  | insn :: code when barrier ->
+     (match insn with
+      | LABEL l when Hashtbl.mem labels l -> simulate (i+1) sites false (Hashtbl.find labels l) code
+      | FLABEL _                          -> simulate (i+1) sites false stack code
+      | _                                 -> simulate (i+1) sites true  stack code
+     )
+  | insn :: code ->
+     let sites, barrier, stack =
+       match insn with
+       | CALL (".array", n, _)           -> (i, n+1) :: sites, false, Some i :: consume n stack
+       | CLOSURE (_, [])                 -> sites, false, None :: stack
+       | CLOSURE (_, ds)                 -> (i, List.length ds + 2) :: sites, false, Some i :: stack
+       | CONST _ | STRING _ | LD _ | LDA _ -> sites, false, None :: stack
+       | DUP                             -> sites, false, List.hd stack :: stack
+       | DROP                            -> sites, false, List.tl stack
+       | SWAP                            -> let x :: y :: stack = stack in sites, false, y :: x :: stack
+       | ELEM                            -> let j :: _ :: stack = stack in escape [j]; sites, false, None :: stack
+       | STA                             -> let v :: j :: _ :: stack = stack in escape [v; j]; sites, false, v :: stack
+       | STI                             -> let v :: r :: stack = stack in escape [v; r]; sites, false, v :: stack
+       | ST _                            -> escape [List.hd stack]; sites, false, stack
+       | BINOP _                         -> sites, false, None :: consume 2 stack
+       | SEXP (_, n) | CALL (_, n, _)    -> sites, false, None :: consume n stack
+       | CALLC (n, tail)                 -> let f :: stack = consume n stack in
+                                            if tail then escape [f];
+                                            sites, false, None :: stack
+       | TAG _ | ARRAY _                 -> sites, false, None :: List.tl stack
+       | PATT StrCmp                     -> sites, false, None :: snd (pop 2 stack)
+       | PATT _                          -> sites, false, None :: List.tl stack
+       | JMP l                           -> merge l stack; sites, true, stack
+       | CJMP (_, l)                     -> let stack = consume 1 stack in merge l stack; sites, false, stack
+       | LABEL l | FLABEL l              -> merge l stack; sites, false, stack
+       | FAIL (_, keep)                  -> escape [List.hd stack]; sites, false, if keep then stack else List.tl stack
+       | RET                             -> escape [List.hd stack]; sites, false, stack
+       | END                             -> escape stack; sites, false, []
+       | BEGIN _                         -> sites, false, []
+       | _                               -> sites, false, stack
+     in
+     simulate (i+1) sites barrier stack code
+  in
+  (* the code after a barrier is resumed at a label with a known stack; since
+     a label can get its stack later in the code (the body of a loop entered
+     by a jump to its condition), the simulation is repeated until no label
+     gets a stack and no object escapes anew *)
+  let rec fixpoint () =
+    let state = Hashtbl.length labels, Hashtbl.length escaped in
+    let sites = List.rev (simulate 0 [] false [] code) in
+    if state = (Hashtbl.length labels, Hashtbl.length escaped) then sites else fixpoint ()
+  in
+  let sites = try fixpoint () with _ -> [] in
+  List.fold_left
+    (fun (objects, size) (i, k) -> if Hashtbl.mem escaped i then objects, size else (i, size) :: objects, size + k)
+    ([], 0)
+    sites
+
+let allocate_function code =
+  let objects, objects_size = if !stack_objects then frame_objects code else [], 0 in
+  let code   = Array.of_list code in
+  let n      = Array.length code  in
+  let labels = Hashtbl.create 16  in
+  Array.iteri (fun i -> function LABEL l | FLABEL l | SLABEL l -> Hashtbl.replace labels l i | _ -> ()) code;
+  let next   i = if i+1 < n then [i+1] else [] in
+  let target l = try [Hashtbl.find labels l] with Not_found -> [] in
+  let succ   i =
+    match code.(i) with
+    | JMP l       -> target l
+    | CJMP (_, l) -> next i @ target l
+    | RET | END   -> []
+    | _           -> next i
+  in
+  let local = function Value.Local i -> IS.singleton i | _ -> IS.empty in
+  let use   = function
+  | LD x            -> local x
+  | CLOSURE (_, ds) -> List.fold_left (fun s d -> IS.union s (local d)) IS.empty ds
+  | _               -> IS.empty
+  in
+  let def    = function ST x -> local x | _ -> IS.empty in
+  let pinned = Array.fold_left (fun s -> function LDA x -> IS.union s (local x) | _ -> s) IS.empty code in
+  let live_in, live_out = Array.make n IS.empty, Array.make n IS.empty in
+  let changed = Pervasives.ref true in
+  while !changed do
+    changed := false;
+    for i = n-1 downto 0 do
+      let out = List.fold_left (fun s j -> IS.union s live_in.(j)) IS.empty (succ i) in
+      let inn = IS.union (use code.(i)) (IS.diff out (def code.(i))) in
+      if not (IS.equal inn live_in.(i) && IS.equal out live_out.(i))
+      then (changed := true; live_in.(i) <- inn; live_out.(i) <- out)
+    done
+  done;
+  (* live intervals and the numbers of accesses *)
+  let intervals = Hashtbl.create 16 in
+  for i = 0 to n-1 do
+    let accessed = IS.union (use code.(i)) (def code.(i)) in
+    IS.iter
+      (fun x ->
+        if not (IS.mem x pinned)
+        then
+          let b, e, k = try Hashtbl.find intervals x with Not_found -> i, i, 0 in
+          Hashtbl.replace intervals x (min b i, max e i, if IS.mem x accessed then k+1 else k)
+      )
+      (IS.union live_in.(i) accessed)
+  done;
+  let candidates =
+    List.sort (fun (_, (b, _)) (_, (b', _)) -> compare b b') @@
+    Hashtbl.fold (fun x (b, e, k) acc -> if !x64 || k > 1 then (x, (b, e)) :: acc else acc) intervals []
+  in
+  let rec scan free active assigned = function
+  | [] -> assigned
+  | (x, (b, e)) :: rest ->
+     let expired, active = List.partition (fun (e', _, _) -> e' < b) active in
+     match List.map (fun (_, _, r) -> r) expired @ free with
+     | r :: free -> scan free ((e, x, r) :: active) ((x, r) :: assigned) rest
+     | []        ->
+        (* spill the interval which ends last *)
+        match List.sort (fun (e, _, _) (e', _, _) -> compare e' e) active with
+        | (e', x', r) :: active when e' > e -> scan [] ((e, x, r) :: active) ((x, r) :: List.remove_assoc x' assigned) rest
+        | _                                 -> scan [] active assigned rest
+  in
+  let assigned = scan (local_registers ()) [] [] candidates in
+  let registers s = List.sort_uniq compare @@ List.fold_left (fun acc (x, r) -> if IS.mem x s then r :: acc else acc) [] assigned in
+  {assigned = assigned;
+   live     = Array.map registers live_out;
+   entry    = (if n > 0 then registers live_in.(0) else []);
+   top_reg  = if !x64 then num_of_regs else num_of_regs - List.length (registers (IS.of_list (List.map fst assigned)));
+   objects  = objects;
+   objects_size = objects_size
+  }
+
+(* Allocates the locals of all functions of a program *)
+let allocate_locals prg =
+  let table = Hashtbl.create 16 in
+  let rec iterate f acc = function
+  | []                         -> ()
+  | (BEGIN (g, _, _, _, _, _) as i) :: prg -> iterate (Some g) [i] prg
+  | END :: prg                 ->
+     (match f with Some g -> Hashtbl.replace table g (allocate_function (List.rev (END :: acc))) | None -> ());
+     iterate None [] prg
+  | i :: prg                   -> iterate f (i :: acc) prg
+  in
+  iterate None [] prg;
+  table
+
 (* Environment implementation *)
 class env prg =
   let chars          = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'" in
@@ -585,12 +1142,38 @@ class env prg =
     val publics         = S.empty
     val externs         = S.empty
     val nlabels         = 0
+    val closures        = S.empty (* functions with static closures    *)
+    val thunks          = S.empty (* built-ins with closures (x86-64)  *)
     val first_line      = true
+    val allocation      = allocate_locals prg
+    val current         = (None : allocation option) (* allocation for the current function *)
+    val position        = 0                           (* instruction position in the function *)
+    val nlocals         = 0                           (* number of local variables            *)
+    val functions       = []                          (* compiled functions and if they keep a closure *)
+    val lines           = []                          (* line labels and line numbers           *)
                         
     method publics = S.elements publics
                    
     method register_public name = {< publics = S.add name publics >}
     method register_extern name = {< externs = S.add name externs >}
+
+    (* registers a static closure for a function without free variables *)
+    method static_closure name = M (Printf.sprintf "$%s_closure" name), {< closures = S.add name closures >}
+
+    (* gets all static closures *)
+    method closures = S.elements closures
+
+    (* registers a thunk for a closure of a built-in *)
+    method thunk name = thunk_label name, {< thunks = S.add name thunks >}
+
+    (* gets all built-ins which need thunks *)
+    method thunks = S.elements thunks
+
+    (* gets all compiled functions with the flags if their frames keep a closure *)
+    method functions = List.rev functions
+
+    (* gets all line labels with the line numbers *)
+    method lines = List.rev lines
                                 
     method max_locals_size = max_locals_size
                            
@@ -655,19 +1238,20 @@ class env prg =
     (* gets a name for a global variable *)
     method loc x =
       match x with
-      | Value.Global name -> M ("global_" ^ name)
+      | Value.Global name -> global ("global_" ^ name)
       | Value.Fun    name -> M ("$" ^ name)
-      | Value.Local  i    -> S i
+      | Value.Local  i    -> (match current with Some a when List.mem_assoc i a.assigned -> List.assoc i a.assigned | _ -> S i)
       | Value.Arg    i    -> S (- (i + if has_closure then 2 else 1))
-      | Value.Access i    -> I (word_size * (i+1), edx)
+      | Value.Access i    -> I (word_size () * (i+1), edx)
          
     (* allocates a fresh position on a symbolic stack *)
     method allocate =
+      let top = match current with Some a -> a.top_reg | None -> num_of_regs in
       let x, n =
         let rec allocate' = function
         | []                            -> ebx          , 0
         | (S n)::_                      -> S (n+1)      , n+2
-        | (R n)::_ when n < num_of_regs -> R (n+1)      , stack_slots
+        | (R n)::_ when n < top         -> R (n+1)      , stack_slots
         | _                             -> S static_size, static_size+1
         in
         allocate' stack
@@ -746,7 +1330,25 @@ class env prg =
                      
     (* enters a function *)
     method enter f nargs nlocals has_closure =
-      {< nargs = nargs; static_size = nlocals; stack_slots = nlocals; stack = []; fname = f; has_closure = has_closure; first_line = true >}
+      let current = Hashtbl.find_opt allocation f in
+      let size    = nlocals + match current with Some a -> a.objects_size | None -> 0 in
+      {< nargs = nargs; nlocals = nlocals; static_size = size; stack_slots = size; stack = []; fname = f; has_closure = has_closure; first_line = true;
+         current = current; position = 0; functions = (f, has_closure) :: functions >}
+
+    (* the first frame slot of an object allocated in the frame by the current instruction *)
+    method stack_object =
+      match current with
+      | Some a -> (try Some (nlocals + List.assoc position a.objects) with Not_found -> None)
+      | None   -> None
+
+    (* moves to the next instruction *)
+    method step = {< position = position + 1 >}
+
+    (* initializes the registers of the locals which can be read before being stored *)
+    method init_locals =
+      match current with
+      | Some a -> List.map (fun r -> Mov (L 1, r)) a.entry
+      | None   -> []
 
     (* returns a label for the epilogue *)
     method epilogue = Printf.sprintf "L%s_epilogue" fname
@@ -754,19 +1356,24 @@ class env prg =
     (* returns a name for local size meta-symbol *)
     method lsize = Printf.sprintf "L%s_SIZE" fname
                     
-    (* returns a list of live registers *)
+    (* returns a list of live registers: the ones of the symbolic stack and
+       the ones of the locals live after the current instruction *)
     method live_registers depth =
       let rec inner d acc = function
       | []             -> acc
       | (R _ as r)::tl -> inner (d+1) (if d >= depth then (r::acc) else acc) tl
       | _::tl          -> inner (d+1) acc tl
       in
-      inner 0 [] stack
+      inner 0 [] stack @
+      (match current with
+       | Some a when position < Array.length a.live -> a.live.(position)
+       | _                                          -> []
+      )
 
     (* generate a line number information for current function *)
     method gen_line line =
       let lab = Printf.sprintf ".L%d" nlabels in
-      {< nlabels = nlabels + 1; first_line = false >},
+      {< nlabels = nlabels + 1; first_line = false; lines = (lab, line) :: lines >},
       if fname = "main"
       then
          [Meta (Printf.sprintf "\t.stabn 68,0,%d,%s" line lab); Label lab]
@@ -780,22 +1387,56 @@ class env prg =
    the stack code, then generates x86 assember code, then prints the assembler file
 *)
 let genasm cmd prog =
+  x64 := cmd#is_x64;
+  stack_objects := cmd#is_optimize;
   let sm        = SM.compile cmd prog in
   let env, code = compile cmd (new env sm) (fst (fst prog)) sm in
+  let code      = Peephole.optimize code in
+  let dir       = if !x64 then ".quad" else ".int" in
+  (* the tables for the profiler in the runtime: the code range of each function,
+     if its frame keeps a closure, its name and file; the address of each line *)
+  let file, env = env#string cmd#get_infile in
+  let env, profile =
+    List.fold_left
+      (fun (env, acc) (f, closure) ->
+         let name   = if f.[0] = 'L' then String.sub f 1 (String.length f - 1) else f in
+         let s, env = env#string name in
+         env, Meta (Printf.sprintf "\t%s\t%s, .L%s_end, %d, %s, %s" dir f f (if closure then 1 else 0) s file) :: acc
+      )
+      (env, [])
+      env#functions
+  in
+  let profile =
+    [Meta "\t.section lama_functions,\"aw\",@progbits"; Meta (Printf.sprintf "\t.align %d" (word_size ()))] @
+    List.rev profile @
+    [Meta "\t.section lama_lines,\"aw\",@progbits"; Meta (Printf.sprintf "\t.align %d" (word_size ()))] @
+    List.map (fun (l, line) -> Meta (Printf.sprintf "\t%s\t%s, %d" dir l line)) env#lines
+  in
   let globals =
     List.map (fun s -> Meta (Printf.sprintf "\t.globl\t%s" s)) env#publics
   in
   let data = [Meta "\t.data"] @
              (List.map (fun (s, v) -> Meta (Printf.sprintf "%s:\t.string\t\"%s\"" v s)) env#strings) @
-             [Meta "_init:\t.int 0";
-              Meta "\t.section custom_data,\"aw\",@progbits";
-              Meta (Printf.sprintf "filler:\t.fill\t%d, 4, 1" env#max_locals_size)] @
+             (* a static closure: the header (one field) and the code pointer *)
+             (if env#closures = [] then [] else [Meta (Printf.sprintf "\t.align %d" (word_size ()))]) @
+             (List.concat @@
+                List.map
+                  (fun f -> let dir = if !x64 then ".quad" else ".int" in
+                            [Meta (Printf.sprintf "\t%s\t%d" dir ((1 lsl 3) lor 7));
+                             Meta (Printf.sprintf "%s_closure:\t%s\t%s" f dir f)])
+                  env#closures
+             ) @
+             (* the flag of the initialization is per runtime instance as the globals are *)
+             [Meta "\t.section custom_data,\"aw\",@progbits";
+              Meta (if !x64 then "_init:\t.quad 0" else "_init:\t.int 0");
+              Meta (Printf.sprintf "filler:\t.fill\t%d, %d, 1" env#max_locals_size (word_size ()))] @
               (List.concat @@
                  List.map
                    (fun s -> [Meta (Printf.sprintf "\t.stabs \"%s:S1\",40,0,0,%s" (String.sub s (String.length "global_") (String.length s - String.length "global_")) s);
-                              Meta (Printf.sprintf "%s:\t.int\t1" s)])
+                              Meta (Printf.sprintf "%s:\t%s\t1" s (if !x64 then ".quad" else ".int"))])
                    env#globals
-              )
+              ) @
+              profile
   in
   let asm = Buffer.create 1024 in
   List.iter
@@ -805,7 +1446,8 @@ let genasm cmd prog =
       globals @
       data @
       [Meta "\t.text"; Label ".Ltext"; Meta "\t.stabs \"data:t1=r1;0;4294967295;\",128,0,0,0"] @          
-      code);
+      code @
+      List.concat (List.map thunk env#thunks));
   Buffer.contents asm
 
 let get_std_path () =
@@ -836,13 +1478,14 @@ let build cmd prog =
   cmd#dump_file "s" (genasm cmd prog);
   cmd#dump_file "i" (Interface.gen prog);
   let inc  = get_std_path () in
+  let arch = if cmd#is_x64 then "-m64 -no-pie" else "-m32" in
   match cmd#get_mode with
   | `Default ->
      let objs = find_objects (fst @@ fst prog) cmd#get_include_paths in
      let buf  = Buffer.create 255 in
      List.iter (fun o -> Buffer.add_string buf o; Buffer.add_string buf " ") objs;
-     let gcc_cmdline = Printf.sprintf "gcc %s -m32 %s %s.s %s %s/runtime.a" cmd#get_debug cmd#get_output_option cmd#basename (Buffer.contents buf) inc in
+     let gcc_cmdline = Printf.sprintf "gcc %s %s %s %s.s %s %s/runtime.a -lpthread" cmd#get_debug arch cmd#get_output_option cmd#basename (Buffer.contents buf) inc in
      Sys.command gcc_cmdline
   | `Compile ->
-     Sys.command (Printf.sprintf "gcc %s -m32 -c %s.s" cmd#get_debug cmd#basename)
+     Sys.command (Printf.sprintf "gcc %s %s -c %s.s" cmd#get_debug arch cmd#basename)
   | _ -> invalid_arg "must not happen"